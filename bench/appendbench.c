@@ -0,0 +1,98 @@
+/*
+ * Keys that grow over time against random keys.
+ *
+ *   appendbench [-f dbfile] [-n keys]
+ *
+ * Inserts n keys of each kind into a bonsai collection in the order
+ * they are made, then looks every key up in random order.  The kinds
+ * are increasing Datetimes one second apart, uuids from _newkey (the
+ * ids PUT_ID hands out), and Ints in random order.  Each operation goes
+ * through dbcollection_setitem and getitem.  Prints CPU time per
+ * operation.
+ */
+#include "bench.h"
+
+enum { DATETIME, UUID, RANDINT };
+static const char *kind[] = { "datetime", "uuid", "int" };
+
+static dbtype_t *keys(pgctx_t *ctx, int which, int n)
+{
+	dbtype_t *k = malloc(n * sizeof(*k));
+	int64_t t0 = utime_now();
+	unsigned *p = NULL;
+	int i;
+
+	if (which == RANDINT)
+		p = bench_perm(n, 1);
+	dblock(ctx);
+	for(i=0; i<n; i++) {
+		switch(which) {
+		case DATETIME: k[i] = dbtime_new(ctx, t0 + i*1000000LL); break;
+		case UUID: k[i] = _newkey(ctx, DBNULL); break;
+		case RANDINT: k[i] = dbint_new(ctx, p[i]); break;
+		}
+	}
+	dbunlock(ctx);
+	free(p);
+	return k;
+}
+
+static void run(pgctx_t *ctx, int which, int n)
+{
+	dbtype_t coll, v, *k;
+	unsigned *p;
+	int64_t t0, t1, t2;
+	int i, missing = 0;
+
+	coll = bench_collection(ctx, kind[which], 0);
+	k = keys(ctx, which, n);
+	t0 = cpu_now();
+	for(i=0; i<n; i++) {
+		dblock(ctx);
+		dbcollection_setitem(ctx, coll, k[i], dbint_new(ctx, i), 0);
+		dbunlock(ctx);
+	}
+	p = bench_perm(n, 2);
+	t1 = cpu_now();
+	for(i=0; i<n; i++) {
+		dblock(ctx);
+		if (dbcollection_getitem(ctx, coll, k[p[i]], &v) < 0)
+			missing++;
+		dbunlock(ctx);
+	}
+	t2 = cpu_now();
+	free(p);
+	free(k);
+	printf("%-8s insert %7.2fus  lookup %6.2fus%s\n", kind[which],
+		(t1 - t0) / 1e3 / n, (t2 - t1) / 1e3 / n,
+		missing ? "  (keys missing!)" : "");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filename = BENCH_FILE;
+	int n = 200000;
+	int opt;
+	pgctx_t *ctx;
+
+	while((opt = getopt(argc, argv, "f:n:")) != -1) {
+		switch(opt) {
+		case 'f': filename = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		default:
+			fprintf(stderr, "%s [-f dbfile] [-n keys]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n < 1)
+		return 1;
+
+	ctx = bench_open(filename);
+	printf("keys=%d\n", n);
+	run(ctx, DATETIME, n);
+	run(ctx, UUID, n);
+	run(ctx, RANDINT, n);
+	dbfile_close(ctx);
+	unlink(filename);
+	return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef PONGO_BENCH_H
+#define PONGO_BENCH_H
+/*
+ * Helpers shared by the benchmarks.  Each one makes a new db file
+ * (/dev/shm/pongo-bench.db unless -f says otherwise) and takes dblock
+ * around every operation, the way the Python binding does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pongo/dbmem.h>
+#include <pongo/dbtypes.h>
+#include <pongo/log.h>
+#include <pongo/misc.h>
+
+#define BENCH_FILE "/dev/shm/pongo-bench.db"
+
+// CPU time of this process, and wall clock time (ns)
+static inline int64_t cpu_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline int64_t wall_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline pgctx_t *bench_open(const char *filename)
+{
+	pgctx_t *ctx;
+
+	unlink(filename);
+	log_init(NULL, LOG_ERROR);
+	ctx = dbfile_open(filename, 0);
+	if (!ctx) {
+		fprintf(stderr, "Can't open %s\n", filename);
+		exit(1);
+	}
+	return ctx;
+}
+
+// A new collection, kept in the root collection under name so that the
+// GC can find it
+static inline dbtype_t bench_collection(pgctx_t *ctx, const char *name, int btree)
+{
+	dbtype_t c;
+
+	dblock(ctx);
+	c = btree ? dbcollection_new_btree(ctx) : dbcollection_new(ctx, 0);
+	dbcollection_setitem(ctx, ctx->data, dbstring_new(ctx, name, strlen(name)), c, 0);
+	dbunlock(ctx);
+	return c;
+}
+
+// Repeatable random numbers (xorshift64*)
+static inline uint64_t bench_rand(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 2685821657736338717ULL;
+}
+
+// 0..n-1 in random order
+static inline unsigned *bench_perm(unsigned n, uint64_t seed)
+{
+	unsigned *p = malloc(n * sizeof(*p));
+	unsigned i, j, t;
+
+	for(i=0; i<n; i++)
+		p[i] = i;
+	for(i=n; i>1; i--) {
+		j = bench_rand(&seed) % i;
+		t = p[i-1]; p[i-1] = p[j]; p[j] = t;
+	}
+	return p;
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * BTreeCollection against the bonsai Collection.
+ *
+ *   btreebench [-f dbfile] [-n keys]
+ *
+ * Inserts n string keys in random order into each kind of collection,
+ * looks every key up, and deletes them all, each in its own random
+ * order.  Each operation goes through dbcollection_setitem, getitem and
+ * delitem, the way PongoCollection.create(db, 0) and create(db, 0, 1)
+ * are used from Python.  Prints CPU time per operation.
+ */
+#include "bench.h"
+
+static dbtype_t *keys(pgctx_t *ctx, int n)
+{
+	dbtype_t *k = malloc(n * sizeof(*k));
+	char buf[32];
+	int i;
+
+	dblock(ctx);
+	for(i=0; i<n; i++) {
+		sprintf(buf, "key number %010d", i);
+		k[i] = dbstring_new(ctx, buf, strlen(buf));
+	}
+	dbunlock(ctx);
+	return k;
+}
+
+static void run(pgctx_t *ctx, const char *name, int btree, dbtype_t *k, int n)
+{
+	dbtype_t coll, v;
+	unsigned *p;
+	int64_t t0, t1, t2, t3;
+	int i, missing = 0;
+
+	coll = bench_collection(ctx, name, btree);
+	p = bench_perm(n, 1);
+	t0 = cpu_now();
+	for(i=0; i<n; i++) {
+		dblock(ctx);
+		dbcollection_setitem(ctx, coll, k[p[i]], dbint_new(ctx, p[i]), 0);
+		dbunlock(ctx);
+	}
+	free(p);
+	p = bench_perm(n, 2);
+	t1 = cpu_now();
+	for(i=0; i<n; i++) {
+		dblock(ctx);
+		if (dbcollection_getitem(ctx, coll, k[p[i]], &v) < 0)
+			missing++;
+		dbunlock(ctx);
+	}
+	free(p);
+	p = bench_perm(n, 3);
+	t2 = cpu_now();
+	for(i=0; i<n; i++) {
+		dblock(ctx);
+		dbcollection_delitem(ctx, coll, k[p[i]], NULL, 0);
+		dbunlock(ctx);
+	}
+	t3 = cpu_now();
+	free(p);
+	printf("%-7s insert %7.2fus  lookup %6.2fus  delete %7.2fus%s\n", name,
+		(t1 - t0) / 1e3 / n, (t2 - t1) / 1e3 / n, (t3 - t2) / 1e3 / n,
+		missing ? "  (keys missing!)" : "");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filename = BENCH_FILE;
+	int n = 200000;
+	int opt;
+	dbtype_t *k;
+	pgctx_t *ctx;
+
+	while((opt = getopt(argc, argv, "f:n:")) != -1) {
+		switch(opt) {
+		case 'f': filename = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		default:
+			fprintf(stderr, "%s [-f dbfile] [-n keys]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n < 1)
+		return 1;
+
+	ctx = bench_open(filename);
+	k = keys(ctx, n);
+	printf("keys=%d\n", n);
+	run(ctx, "bonsai", 0, k, n);
+	run(ctx, "btree", 1, k, n);
+	dbfile_close(ctx);
+	unlink(filename);
+	return 0;
+}
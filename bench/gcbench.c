@@ -0,0 +1,84 @@
+/*
+ * Full collection mark time against the number of marker threads.
+ *
+ *   gcbench [-f dbfile] [-n entries] [-j threads,...] [-r runs]
+ *
+ * Fills a collection with entries objects of a few fields each, then
+ * runs a major full collection (db_gc(ctx, 2, ...)) runs times with each
+ * number of marker threads (ctx->gc.nthreads, pongogc -j).  Nothing is
+ * garbage, so every run marks the same blocks.  Prints the wall time of
+ * the collection, the time spent marking and the blocks marked per
+ * second (gcstats_t).  A speedup needs as many cpus as threads.
+ *
+ * The mark walk keeps GC_PREFETCH blocks in flight.  To compare depths,
+ * build lib/ and this with the same DEFS=-DGC_PREFETCH=k and run with
+ * -j 1, which takes the stealing out of the numbers.
+ */
+#include "bench.h"
+
+static void fill(pgctx_t *ctx, dbtype_t coll, int n)
+{
+	char buf[32];
+	dbtype_t obj;
+	int i;
+
+	for(i=0; i<n; i++) {
+		dblock(ctx);
+		obj = dbobject_new(ctx);
+		dbobject_setitem(ctx, obj, dbstring_new(ctx, "n", 1), dbint_new(ctx, i), 0);
+		sprintf(buf, "value number %08d", i);
+		dbobject_setitem(ctx, obj, dbstring_new(ctx, "s", 1), dbstring_new(ctx, buf, strlen(buf)), 0);
+		dbobject_setitem(ctx, obj, dbstring_new(ctx, "f", 1), dbfloat_new(ctx, i / 3.0), 0);
+		sprintf(buf, "key%08d", i);
+		dbcollection_setitem(ctx, coll, dbstring_new(ctx, buf, strlen(buf)), obj, 0);
+		dbunlock(ctx);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filename = BENCH_FILE;
+	char *threads = "1,2,4,8", *t;
+	int n = 100000, runs = 3;
+	int i, opt, nthreads;
+	gcstats_t st;
+	int64_t t0, t1;
+	pgctx_t *ctx;
+
+	while((opt = getopt(argc, argv, "f:n:j:r:")) != -1) {
+		switch(opt) {
+		case 'f': filename = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		case 'j': threads = optarg; break;
+		case 'r': runs = atoi(optarg); break;
+		default:
+			fprintf(stderr, "%s [-f dbfile] [-n entries] [-j threads,...] [-r runs]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	ctx = bench_open(filename);
+	fill(ctx, bench_collection(ctx, "gc", 0), n);
+	// The first collection frees whatever building the collection left
+	db_gc(ctx, 2, NULL);
+	printf("entries=%d cpus=%ld prefetch=%d\n", n, sysconf(_SC_NPROCESSORS_ONLN), GC_PREFETCH);
+	for(t=threads; *t; ) {
+		nthreads = strtol(t, &t, 10);
+		if (*t == ',')
+			t++;
+		ctx->gc.nthreads = nthreads;
+		for(i=0; i<runs; i++) {
+			memset(&st, 0, sizeof(st));
+			t0 = wall_now();
+			db_gc(ctx, 2, &st);
+			t1 = wall_now();
+			printf("threads=%d wall=%.1fms mark=%.1fms scanned=%llu %.2fM blocks/s\n",
+				nthreads, (t1 - t0) / 1e6, st.marktime / 1e3,
+				(unsigned long long)st.scanned,
+				st.marktime ? st.scanned / (double)st.marktime : 0.0);
+		}
+	}
+	dbfile_close(ctx);
+	unlink(filename);
+	return 0;
+}
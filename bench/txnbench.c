@@ -0,0 +1,110 @@
+/*
+ * Conflict rate of multi-collection transactions (see txn.c).
+ *
+ *   txnbench [-f dbfile] [-p procs] [-n txns] [-c collections] [-w writes]
+ *
+ * Each of procs processes runs txns transactions.  A transaction sets
+ * writes keys, each in a random one of the collections.  A transaction
+ * is run again whenever one of its roots changed after it was read, so
+ * two transactions running at once conflict if they share a collection.
+ * Fewer collections, more writes or more processes than cpus all raise
+ * the conflict rate.  Prints what each process published and retried
+ * (ctx->txn), and the totals.
+ */
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+typedef struct {
+	uint64_t commits, retries;
+	int64_t cpu;
+} result_t;
+
+static void run(pgctx_t *ctx, dbtype_t *coll, int ncoll, int ntxn, int nwrite, uint64_t seed, result_t *res)
+{
+	dbtxnop_t *ops = malloc(nwrite * sizeof(*ops));
+	int i, j, failed;
+	int64_t t0 = cpu_now();
+
+	for(i=0; i<ntxn; i++) {
+		dblock(ctx);
+		for(j=0; j<nwrite; j++) {
+			ops[j].op = multi_SET;
+			ops[j].obj = coll[bench_rand(&seed) % ncoll];
+			ops[j].key = dbint_new(ctx, bench_rand(&seed) % 1000);
+			ops[j].value = dbint_new(ctx, i);
+		}
+		if (db_transaction(ctx, nwrite, ops, &failed, 0) != 0) {
+			fprintf(stderr, "transaction failed at op %d\n", failed);
+			exit(1);
+		}
+		dbunlock(ctx);
+	}
+	res->commits = ctx->txn.commits;
+	res->retries = ctx->txn.retries;
+	res->cpu = cpu_now() - t0;
+	free(ops);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filename = BENCH_FILE;
+	int nproc = 4, ntxn = 10000, ncoll = 4, nwrite = 2;
+	int i, opt;
+	char name[32];
+	dbtype_t *coll;
+	result_t *res, total = { 0, 0, 0 };
+	int64_t t0, t1;
+	pgctx_t *ctx;
+
+	while((opt = getopt(argc, argv, "f:p:n:c:w:")) != -1) {
+		switch(opt) {
+		case 'f': filename = optarg; break;
+		case 'p': nproc = atoi(optarg); break;
+		case 'n': ntxn = atoi(optarg); break;
+		case 'c': ncoll = atoi(optarg); break;
+		case 'w': nwrite = atoi(optarg); break;
+		default:
+			fprintf(stderr, "%s [-f dbfile] [-p procs] [-n txns] [-c collections] [-w writes]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nproc < 1 || ntxn < 1 || ncoll < 1 || nwrite < 1)
+		return 1;
+
+	ctx = bench_open(filename);
+	coll = malloc(ncoll * sizeof(*coll));
+	for(i=0; i<ncoll; i++) {
+		sprintf(name, "coll%d", i);
+		coll[i] = bench_collection(ctx, name, 0);
+	}
+	res = mmap(NULL, nproc * sizeof(*res), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	memset(res, 0, nproc * sizeof(*res));
+
+	t0 = wall_now();
+	for(i=0; i<nproc; i++) {
+		if (fork() == 0) {
+			run(ctx, coll, ncoll, ntxn, nwrite, 0x9e3779b97f4a7c15ULL * (i+1), &res[i]);
+			_exit(0);
+		}
+	}
+	while(wait(NULL) > 0)
+		;
+	t1 = wall_now();
+
+	printf("procs=%d txns=%d collections=%d writes=%d\n", nproc, ntxn, ncoll, nwrite);
+	for(i=0; i<nproc; i++) {
+		printf("  proc %d: %llu commits, %llu retries, %.1fus cpu/commit\n", i,
+			(unsigned long long)res[i].commits, (unsigned long long)res[i].retries,
+			res[i].commits ? res[i].cpu / 1000.0 / res[i].commits : 0.0);
+		total.commits += res[i].commits;
+		total.retries += res[i].retries;
+	}
+	printf("total: %llu commits, %llu retries, conflict rate %.2f%%, %.0f commits/s\n",
+		(unsigned long long)total.commits, (unsigned long long)total.retries,
+		100.0 * total.retries / (total.commits + total.retries),
+		total.commits * 1e9 / (t1 - t0));
+	dbfile_close(ctx);
+	unlink(filename);
+	return total.commits == (uint64_t)nproc * ntxn ? 0 : 1;
+}
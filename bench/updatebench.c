@@ -0,0 +1,71 @@
+/*
+ * Replacing the values of keys which are already in a collection.
+ *
+ *   updatebench [-f dbfile] [-n keys] [-u updates]
+ *
+ * Fills a bonsai collection with n Int keys, then makes u updates of
+ * random existing keys with dbcollection_setitem: first storing a new
+ * value, then storing the value the key already holds.  Prints CPU time
+ * per update.
+ */
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+	const char *filename = BENCH_FILE;
+	int n = 50000, u = 100000;
+	int i, opt;
+	uint64_t seed = 1;
+	unsigned *k, *last;
+	dbtype_t coll;
+	int64_t t0, t1, t2;
+	pgctx_t *ctx;
+
+	while((opt = getopt(argc, argv, "f:n:u:")) != -1) {
+		switch(opt) {
+		case 'f': filename = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		case 'u': u = atoi(optarg); break;
+		default:
+			fprintf(stderr, "%s [-f dbfile] [-n keys] [-u updates]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n < 1 || u < 1)
+		return 1;
+
+	ctx = bench_open(filename);
+	coll = bench_collection(ctx, "update", 0);
+	for(i=0; i<n; i++) {
+		dblock(ctx);
+		dbcollection_setitem(ctx, coll, dbint_new(ctx, i), dbint_new(ctx, i), 0);
+		dbunlock(ctx);
+	}
+	k = malloc(u * sizeof(*k));
+	last = malloc(n * sizeof(*last));
+	for(i=0; i<u; i++)
+		k[i] = bench_rand(&seed) % n;
+	// What each key holds after the updates: n plus the index of the last
+	for(i=0; i<u; i++)
+		last[k[i]] = n + i;
+
+	t0 = cpu_now();
+	for(i=0; i<u; i++) {
+		dblock(ctx);
+		dbcollection_setitem(ctx, coll, dbint_new(ctx, k[i]), dbint_new(ctx, n + i), 0);
+		dbunlock(ctx);
+	}
+	t1 = cpu_now();
+	for(i=0; i<u; i++) {
+		dblock(ctx);
+		dbcollection_setitem(ctx, coll, dbint_new(ctx, k[i]), dbint_new(ctx, last[k[i]]), 0);
+		dbunlock(ctx);
+	}
+	t2 = cpu_now();
+	printf("keys=%d updates=%d\n", n, u);
+	printf("new value   %6.2fus\n", (t1 - t0) / 1e3 / u);
+	printf("same value  %6.2fus\n", (t2 - t1) / 1e3 / u);
+	dbfile_close(ctx);
+	unlink(filename);
+	return 0;
+}
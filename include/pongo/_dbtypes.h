@@ -24,13 +24,16 @@ typedef enum {
 	Object =	0x82,
 	Collection =0x83,
 	MultiCollection=0x84,
+	BTreeCollection=0x85,
 	Cache =     0x8f,
 
 	// Maintenence types for containers (193-255)
 	_InternalList=	0xc1,
 	_InternalObj=	0xc2,
 	_BonsaiNode=	0xc3,
-	_BonsaiMultiNode=	0xc4
+	_BonsaiMultiNode=	0xc4,
+	_BTreeNode=	0xc5,
+	_BonsaiPrefixNode=	0xc6
 } dbtag_t;
 
 #define isPtr(type) ((type & 7) == 0)
@@ -48,6 +51,45 @@ typedef union _dbtype {
 } dbtype_t;
 
 
+// Processes registered for epoch based reclamation (see dbmem.c)
+#define NR_READERS 64
+#define READER_FREE 0
+#define READER_LIVE 1
+#define READER_DEAD 2       // exited; its retired blocks go to the full GC
+typedef struct _dbreader {
+    volatile uint32_t pid;
+    volatile uint32_t state;
+    volatile uint64_t epoch;    // (epoch<<1)|1 while in the db, else 0
+    volatile uint64_t pinned;   // same, while holding snapshots (iterators)
+    volatile uint32_t freeing;  // set while freeing retired blocks
+    volatile uint32_t writing;  // set while inside a synchronize
+} dbreader_t;                   // 32 bytes
+
+// What one garbage collection did.  Also kept in the db file, in the
+// rings of recent collections at root->gchist (see gchist_t).
+#define GC_NR_CLS (NR_SZCLS+1)      // size classes, then the pool allocator
+typedef pmemcount_t gccount_t;
+typedef struct _gcstats {
+    int64_t start;              // when the collection started (utime)
+    uint32_t pid;               // process which ran it
+    uint32_t full;              // full collection, or only suggested blocks
+    gccount_t before;           // blocks in use when the collection started
+    gccount_t after;            // blocks in use when it finished
+    gccount_t freed;            // blocks freed by the collection
+    uint32_t slices;            // mark slices run
+    uint32_t major;             // walked everything, not only what changed
+    int64_t max_slice;          // longest mark slice (us)
+    int64_t remark;             // final remark with the db locked (us)
+    uint64_t scanned;           // blocks scanned by the mark phase
+    int64_t marktime;           // total mark time, remark included (us)
+    int64_t setup;              // marking every block as garbage (us)
+    int64_t sweep;              // freeing the garbage (us)
+    int64_t total;              // start to finish, pauses included (us)
+    gccount_t cls_before[GC_NR_CLS];
+    gccount_t cls_after[GC_NR_CLS];
+    gccount_t cls_freed[GC_NR_CLS];
+} gcstats_t;
+
 #define DBROOT_SIG "PongoDB"
 typedef struct _dbroot {
     uint8_t signature[16];      // 0    +16 bytes
@@ -56,7 +98,7 @@ typedef struct _dbroot {
 	uint64_t heap;				// 32   +8 bytes
 	dbtype_t data;				// 40   +8 bytes
 	dbtype_t cache;				// 48	+8 bytes
-	dbtype_t pidcache;			// 56   +8 bytes
+	dbtype_t pidcache;			// 56   +8 bytes (old format, see dbfile_open)
 	uint64_t booleans[2];		// 64	+16 bytes
 	uint64_t lock;				// 80   +8 bytes
 	uint64_t resize; 	        // 88   +8 bytes
@@ -64,7 +106,40 @@ typedef struct _dbroot {
 		int64_t gc_time;
 		int64_t gc_pid;
 	} gc;                       // 96  +16 bytes
-	uint8_t _pad1[3072-112];	// 112
+	struct {
+		uint32_t seq;			// odd while a transaction publishes
+		uint32_t pid;			// process holding it odd
+	} commit;                   // 112 +8 bytes
+	struct {
+		uint32_t phase;			// GC_IDLE or GC_MARK
+		uint32_t pid;			// process running the collection
+		uint64_t log;			// write barrier log (gclog_t)
+		uint64_t map;			// collector mark bits (gcmap_t)
+	} gcinc;                    // 120 +24 bytes
+	struct {
+		volatile uint64_t epoch;	// global reclamation epoch
+		uint64_t _pad;
+	} ebr;                      // 144 +16 bytes
+	dbreader_t readers[NR_READERS];	// 160 +2048 bytes
+	struct {
+		uint64_t full;			// recent full collections (gchist_t)
+		uint64_t fast;			// recent fast collections (gchist_t)
+	} gchist;                   // 2208 +16 bytes
+	struct {
+		uint64_t old;			// blocks which survived the last full collection (gcmap_t)
+		uint64_t dirty;			// containers changed since it started (gcmap_t)
+		uint32_t minor;			// full collections since the last major one
+		volatile uint32_t overflow;	// a change didn't fit in dirty
+	} gcgen;                    // 2224 +24 bytes
+	struct {
+		volatile uint64_t alloc;	// bytes allocated since the last full collection
+		volatile uint64_t suggest;	// bytes suggested since the last fast collection
+		volatile uint32_t grow;		// times the file grew since the last full collection
+		uint32_t _pad;
+		uint64_t full_at;			// alloc which calls for a full collection
+	} gcpressure;               // 2248 +32 bytes
+	uint64_t pidslab;			// 2280 +8 bytes (pidslab_t chain)
+	uint8_t _pad1[3072-2288];	// 2288
 	struct __meta {
 		uint64_t chunksize;		// 3072 + 8 bytes
 		dbtype_t id;			// 3080 + 8 bytes
@@ -139,7 +214,7 @@ typedef struct {
 
 typedef struct {
 	dbtag_t type;
-	uint32_t refcnt; // used only by pidcache
+	uint32_t refcnt; // unused
 	uint64_t obj;
 	uint64_t index;
     uint8_t _extra[40];
@@ -160,6 +235,20 @@ typedef struct {
 	dbtype_t key, value;
 } dbnode_t;
 
+// A bonsai node whose key is a String or ByteBuffer held by pointer.  The
+// start of the key is copied into the node (zero padded), so most
+// compares on the way down never touch the string itself.
+#define NODE_PREFIX 12
+typedef struct {
+	dbtag_t type;
+	uint32_t _pad;
+	uint64_t size;
+	dbtype_t left, right;
+	dbtype_t key, value;
+	uint32_t klen;
+	uint8_t kprefix[NODE_PREFIX];
+} dbpnode_t;
+
 typedef struct {
 	dbtag_t type;
 	uint32_t _pad;
@@ -170,6 +259,20 @@ typedef struct {
     dbtype_t values[];
 } dbmultinode_t;
 
+// B+-tree node (see btree.c).  Leaves hold the items.  Inner nodes hold
+// the lowest key under each child (key[0] is never compared) and the
+// children in val[].  14 entries make the node fit the 256 byte class.
+#define BTREE_ORDER 14
+typedef struct {
+	dbtag_t type;
+	uint32_t _pad;			// batch marks, as in dbnode_t
+	uint64_t size;			// items in this subtree
+	uint32_t n;				// entries in use
+	uint32_t leaf;
+	dbtype_t key[BTREE_ORDER];
+	dbtype_t val[BTREE_ORDER];
+} dbbtree_t;
+
 struct _dbval {
 	dbtag_t type;
 	union {
@@ -183,7 +286,11 @@ struct _dbval {
 					dbtype_t left, right;
 					dbtype_t key;
                     union {
-                        dbtype_t value;
+                        struct {
+                            dbtype_t value;
+                            uint32_t klen;      // only in _BonsaiPrefixNode
+                            uint8_t kprefix[NODE_PREFIX];
+                        };
                         struct {
                             uint64_t nvalue;
                             dbtype_t values[];
@@ -198,13 +305,16 @@ struct _dbval {
 			uint8_t sval[];
 		};
 		struct {
-			volatile uint32_t refcnt; // used only by pidcache.  _pad for everyone else
+			volatile uint32_t refcnt; // unused
 			union {
 				volatile dbtype_t list;
 				volatile dbtype_t obj;
 				volatile dbtype_t cache;
 			};
 			volatile dbtype_t index; // only in collection objects
+			volatile uint32_t version; // bumped by every synchronize
+			volatile uint32_t waiters; // processes in db_wait_change
+			volatile uint32_t frozen; // a snapshot, never written
 		};
 	};
 };
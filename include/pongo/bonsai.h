@@ -3,6 +3,13 @@
 
 #include <pongo/dbtypes.h>
 
+// Marks kept in the _pad word of nodes created while ctx->batch is set.
+// PRIVATE nodes have never been published and may be modified in place.
+// DEAD nodes were superseded before being published.  The B-tree nodes
+// use the same marks, so the batch calls work for both kinds of tree.
+#define BONSAI_PRIVATE 0x01
+#define BONSAI_DEAD    0x02
+
 extern int bonsai_size(pgctx_t *ctx, dbtype_t node);
 extern dbtype_t bonsai_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value, int insert_or_fail);
 extern dbtype_t bonsai_multi_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value);
@@ -10,13 +17,59 @@ extern dbtype_t bonsai_multi_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, d
 extern dbtype_t bonsai_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *valout);
 extern dbtype_t bonsai_multi_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value);
 
+extern dbtype_t bonsai_build_sorted(pgctx_t *ctx, const dbtype_t *keys, const dbtype_t *values, int n);
+extern dbtype_t bonsai_join(pgctx_t *ctx, dbtype_t left, dbtype_t node, dbtype_t right);
+extern dbtype_t bonsai_split(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *left, dbtype_t *right);
+extern dbtype_t bonsai_union(pgctx_t *ctx, dbtype_t a, dbtype_t b);
+extern dbtype_t bonsai_intersection(pgctx_t *ctx, dbtype_t a, dbtype_t b);
+extern dbtype_t bonsai_difference(pgctx_t *ctx, dbtype_t a, dbtype_t b);
+extern dbtype_t bonsai_insert_batch(pgctx_t *ctx, dbtype_t node, const dbtype_t *keys, const dbtype_t *values, int n);
+
 extern int bonsai_find(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value);
 extern dbtype_t bonsai_find_node(pgctx_t *ctx, dbtype_t node, dbtype_t key);
 extern dbtype_t bonsai_find_primitive(pgctx_t *ctx, dbtype_t node, dbtag_t type, const void *key);
-//extern dbtype_t bonsai_index(pgctx_t *ctx, dbtype_t node, int index);
+
+extern void bonsai_batch_begin(pgctx_t *ctx);
+extern void bonsai_batch_prepare(pgctx_t *ctx);
+extern void bonsai_batch_commit(pgctx_t *ctx);
+extern void bonsai_batch_abort(pgctx_t *ctx);
+extern void bonsai_batch_release(pgctx_t *ctx);
 
 typedef void (*bonsaicb_t)(pgctx_t *ctx, dbtype_t node, void *user);
+extern dbtype_t bonsai_select(pgctx_t *ctx, dbtype_t node, int index);
+extern int bonsai_rank(pgctx_t *ctx, dbtype_t node, dbtype_t key);
+extern void bonsai_slice(pgctx_t *ctx, dbtype_t node, int lo, int hi, bonsaicb_t cb, void *user);
 extern void bonsai_foreach(pgctx_t *ctx, dbtype_t node, bonsaicb_t cb, void *user);
 extern void bonsai_show(pgctx_t *ctx, dbtype_t node, int depth);
 
+/*
+ * A cursor walks a snapshot of a tree in either direction.  It sits in
+ * a gap between two items:  next returns the item after the gap and prev
+ * the one before it, each moving the cursor past the item it returns.
+ * When a range is set, items outside of it are never returned.  The
+ * cursor lives in process memory and pins the reclaim epoch from init to
+ * close, so it must be created inside dblock.
+ */
+// The weight balance keeps trees far shallower than this
+#define BONSAI_MAXDEPTH 128
+
+typedef struct {
+    dbtype_t root;              // the snapshot being walked
+    dbtype_t lo, hi;            // range bounds, if haslo/hashi
+    uint8_t haslo, hashi;
+    uint8_t loex, hiex;         // whether the bounds are exclusive
+    int after;                  // the gap is after path[depth], not before
+    int depth;                  // -1 if the tree is empty
+    dbtype_t path[BONSAI_MAXDEPTH];
+} bonsai_cursor_t;
+
+extern void bonsai_cursor_init(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t root);
+extern void bonsai_cursor_close(pgctx_t *ctx, bonsai_cursor_t *c);
+extern void bonsai_cursor_range(pgctx_t *ctx, bonsai_cursor_t *c, const dbtype_t *lo, int loex, const dbtype_t *hi, int hiex);
+extern void bonsai_cursor_seek(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t key, relop_t op);
+extern void bonsai_cursor_first(pgctx_t *ctx, bonsai_cursor_t *c);
+extern void bonsai_cursor_last(pgctx_t *ctx, bonsai_cursor_t *c);
+extern int bonsai_cursor_next(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t *node);
+extern int bonsai_cursor_prev(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t *node);
+
 #endif
@@ -0,0 +1,77 @@
+#ifndef PONGO_BTREE_H
+#define PONGO_BTREE_H
+
+#include <pongo/dbtypes.h>
+#include <pongo/bonsai.h>
+
+// Deep enough for far more items than fit in a db file
+#define BTREE_MAXDEPTH 16
+
+extern int btree_size(pgctx_t *ctx, dbtype_t node);
+extern dbtype_t btree_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value, int insert_or_fail);
+extern dbtype_t btree_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *valout);
+extern int btree_find(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value);
+extern dbtype_t btree_find_primitive(pgctx_t *ctx, dbtype_t node, dbtag_t type, const void *key);
+
+typedef void (*btreecb_t)(pgctx_t *ctx, dbtype_t key, dbtype_t value, void *user);
+extern void btree_foreach(pgctx_t *ctx, dbtype_t node, btreecb_t cb, void *user);
+extern void btree_show(pgctx_t *ctx, dbtype_t node, int depth);
+
+// Positional access, see bonsai_select, bonsai_rank and bonsai_slice
+extern int btree_select(pgctx_t *ctx, dbtype_t node, int index, dbtype_t *key, dbtype_t *value);
+extern int btree_rank(pgctx_t *ctx, dbtype_t node, dbtype_t key);
+extern void btree_slice(pgctx_t *ctx, dbtype_t node, int lo, int hi, btreecb_t cb, void *user);
+
+// Walk of a tree in either direction.  The iterator lives in process
+// memory and holds no references, so the caller must keep the tree alive.
+typedef struct {
+    int depth;                  // -1 if the tree is empty
+    dbtype_t node[BTREE_MAXDEPTH];
+    uint32_t pos[BTREE_MAXDEPTH];
+} btree_iter_t;
+
+extern void btree_iter_init(pgctx_t *ctx, btree_iter_t *it, dbtype_t node, dbtype_t key, int exclusive);
+extern void btree_iter_last(pgctx_t *ctx, btree_iter_t *it, dbtype_t node);
+extern int btree_iter_next(pgctx_t *ctx, btree_iter_t *it, dbtype_t *key, dbtype_t *value);
+extern int btree_iter_prev(pgctx_t *ctx, btree_iter_t *it, dbtype_t *key, dbtype_t *value);
+
+/*
+ * The tree operations for the root of a Collection or a BTreeCollection,
+ * picked by the type of the collection.
+ */
+static inline int tree_find(pgctx_t *ctx, dbtag_t type, dbtype_t node, dbtype_t key, dbtype_t *value)
+{
+    if (type == BTreeCollection)
+        return btree_find(ctx, node, key, value);
+    return bonsai_find(ctx, node, key, value);
+}
+
+static inline dbtype_t tree_insert(pgctx_t *ctx, dbtag_t type, dbtype_t node, dbtype_t key, dbtype_t value, int insert_or_fail)
+{
+    if (type == BTreeCollection)
+        return btree_insert(ctx, node, key, value, insert_or_fail);
+    return bonsai_insert(ctx, node, key, value, insert_or_fail);
+}
+
+static inline dbtype_t tree_delete(pgctx_t *ctx, dbtag_t type, dbtype_t node, dbtype_t key, dbtype_t *valout)
+{
+    if (type == BTreeCollection)
+        return btree_delete(ctx, node, key, valout);
+    return bonsai_delete(ctx, node, key, valout);
+}
+
+static inline int tree_size(pgctx_t *ctx, dbtag_t type, dbtype_t node)
+{
+    if (type == BTreeCollection)
+        return btree_size(ctx, node);
+    return bonsai_size(ctx, node);
+}
+
+static inline int tree_rank(pgctx_t *ctx, dbtag_t type, dbtype_t node, dbtype_t key)
+{
+    if (type == BTreeCollection)
+        return btree_rank(ctx, node, key);
+    return bonsai_rank(ctx, node, key);
+}
+
+#endif
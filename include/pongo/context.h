@@ -7,8 +7,8 @@
 
 typedef struct _pgctx pgctx_t;
 struct rcuhelper {
-	unsigned len;
-	dbtype_t addr[127];
+	unsigned len, size;
+	dbtype_t *addr;
 };
 
 struct _pgctx {
@@ -17,14 +17,54 @@ struct _pgctx {
 	dbroot_t *root;
 	dbtype_t cache;
 	dbtype_t data;
-	// This pidcache is the pidcache for the currently running process.
-	// The pidcache in root is the reference to the entire pidcache
-	dbtype_t pidcache;
 	dbtype_t (*newkey)(pgctx_t *ctx, dbtype_t value);
 	struct rcuhelper winner, loser;
-
+	// Set while building a private copy of a tree (see bonsai_batch_*)
+	int batch;
+	// State of an incremental full GC run by this process (see dbmem.c)
+	struct {
+		int running;
+		int nthreads;			// marker threads (0 or 1 marks serially)
+		int major;				// make the next collection a major one
+		int inline_gc;			// writers run the collections they call for
+		int due;				// ... and one is due at the next dbunlock
+		uint64_t alloc;			// bytes allocated, not yet in root->gcpressure
+		uint64_t suggest;		// bytes suggested, likewise
+		struct rcuhelper stack;
+		uint64_t *visited;		// one bit per 8 bytes of the file
+		uint64_t nvisited;		// number of words in visited
+		uint64_t scanned;		// blocks scanned this collection
+		int64_t marktime;		// time spent marking (us)
+		gcstats_t stats;		// the collection in progress
+	} gc;
+	// Epoch based reclamation of retired blocks (see dbmem.c)
+	struct {
+		int pid;				// owner of slot (re-register after fork)
+		int slot;				// index in root->readers
+		int pins;				// snapshots held by iterators
+		unsigned head;			// first retired block not yet freed
+		unsigned tries;			// failed attempts to advance the epoch
+		struct rcuhelper retired;
+		struct rcuhelper when;	// epoch each retired block was retired in
+	} ebr;
+	// Transactions run by this process (see txn.c)
+	struct {
+		uint64_t commits;		// transactions published
+		uint64_t retries;		// runs thrown away because a root changed
+	} txn;
+	// This process' pidcache slabs and free slots (see pidcache.c)
+	struct {
+		int pid;				// 0 until pidcache_new
+		int refcnt;
+		unsigned nslab;
+		uint64_t *slab;			// offsets of our slabs
+		unsigned nfree;
+		uint32_t *free;			// handles of the free slots
+	} pin;
 };
 
+extern void db_retire(pgctx_t *ctx, dbtype_t item);
+
 /*
  * Given a pointer in the mmap region, return its file offset
  */
@@ -59,17 +99,50 @@ static inline void *dbptr(pgctx_t *ctx, dbtype_t offset)
 	return _ptr(ctx, offset.all);
 }
 
+static inline void rcupush(struct rcuhelper *h, dbtype_t addr)
+{
+    if (h->len == h->size) {
+        h->size = h->size ? h->size*2 : 128;
+        h->addr = realloc(h->addr, h->size * sizeof(dbtype_t));
+        assert(h->addr);
+    }
+    h->addr[h->len++] = addr;
+}
+
 static inline void rcureset(pgctx_t *ctx)
 {
     ctx->loser.len = 0;
     ctx->winner.len = 0;
 }
 
+/*
+ * Free a block which was never published.  If a full GC is marking, the
+ * block may have been marked as garbage before we allocated it, and it
+ * could be handed out again to hold something the collector never looks
+ * at, so clear its mark bit.  The phase is checked after the free: the
+ * collector sets the phase before it looks at which blocks are allocated.
+ */
+static inline void rcufree(pgctx_t *ctx, void *addr)
+{
+    uint64_t ofs = _offset(ctx, addr);
+
+    pmem_sb_free(NULL, addr);
+    __sync_synchronize();
+    if (ctx->root->gcinc.phase)
+        pmem_gcmap_clear(_ptr(ctx, ctx->root->gcinc.map), ofs);
+}
+
 static inline void rculoser(pgctx_t *ctx)
 {
     unsigned i;
+    void *addr;
+    memblock_t *mb;
     for(i=0; i<ctx->loser.len; i++) {
-        pmem_sb_free(NULL, dbptr(ctx, ctx->loser.addr[i]));
+        addr = dbptr(ctx, ctx->loser.addr[i]);
+        mb = (memblock_t*)addr - 1;
+        // Pool allocations are left for the GC
+        if (mb->type == 1)
+            rcufree(ctx, addr);
     }
     rcureset(ctx);
 }
@@ -78,7 +151,7 @@ static inline void rcuwinner(pgctx_t *ctx)
 {
     unsigned i;
     for(i=0; i<ctx->winner.len; i++) {
-        pmem_gc_suggest(dbptr(ctx, ctx->winner.addr[i]), 0xc4);
+        db_retire(ctx, ctx->winner.addr[i]);
     }
     rcureset(ctx);
 }
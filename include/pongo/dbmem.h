@@ -1,9 +1,11 @@
 #ifndef PONGO_DBMEM_H
 #define PONGO_DBMEM_H
 #include <stdlib.h>
+#include <stddef.h>
 #include <pongo/stdtypes.h>
 #include <pongo/context.h>
 #include <pongo/atomic.h>
+#include <pongo/misc.h>
 
 #define GC_HASH_SZ 99991
 #define GC_BUCKET_LEN 64
@@ -18,14 +20,45 @@ typedef struct {
 	gcbucket_t *bucket[];
 } gchash_t;
 
+// Blocks in flight in the GC mark walk (see gc_pipe in dbmem.c).  Build
+// with DEFS=-DGC_PREFETCH=k to try other depths (see bench/gcbench.c).
+#ifndef GC_PREFETCH
+#define GC_PREFETCH 4
+#endif
+
+#define GC_IDLE 0
+#define GC_MARK 1
+#define GC_SWEEP 2
+
+// Ring of old roots replaced by a synchronize while an incremental GC
+// is marking.  Must be a power of 2.
+#define GC_LOG_SZ 65536
 typedef struct {
-        uint32_t num, size;
-} gccount_t;
+	uint32_t size;
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t overflow;
+	volatile uint64_t item[];
+} gclog_t;
 
+// Ring of the statistics of recent collections.  Only the process
+// holding root->gc writes to it.  Entry head-1 is the latest one.
+#define GC_HIST_SZ 64
 typedef struct {
-        gccount_t before;
-        gccount_t after;
-} gcstats_t;
+	uint32_t size;
+	volatile uint32_t head;
+	gcstats_t ent[];
+} gchist_t;
+
+// Every this many full collections, one walks everything so that old
+// blocks which became garbage are found (see gc_start).
+#define GC_MAJOR_EVERY 8
+
+// Allocation pressure (see db_gc_pressure).  Processes move their counts
+// to the shared counters every GC_COUNT_BYTES and at dbunlock.
+#define GC_COUNT_BYTES (64*1024)
+#define GC_FAST_BYTES (256*1024)
+#define GC_FULL_MIN (4*1024*1024)
 
 #define NR_DB_CONTEXT 16
 extern pgctx_t *dbctx[];
@@ -41,20 +74,110 @@ extern void dbunlock(pgctx_t *ctx);
 extern void *dballoc(pgctx_t *ctx, unsigned size);
 //extern void dbfree(pgctx_t *ctx, void *addr);
 extern int db_gc(pgctx_t *ctx, int complete, gcstats_t *stats);
+extern int db_gc_step(pgctx_t *ctx, int64_t budget, gcstats_t *stats);
+extern void db_gc_barrier(pgctx_t *ctx, uint64_t old);
+extern int db_gc_history(pgctx_t *ctx, int full, gcstats_t *stats, int n);
+extern int db_gc_pressure(pgctx_t *ctx);
+extern int db_gc_auto(pgctx_t *ctx, gcstats_t *stats);
+extern void db_suggest(pgctx_t *ctx, void *addr, int x);
+extern void db_pin(pgctx_t *ctx);
+extern void db_unpin(pgctx_t *ctx);
+extern uint32_t db_version(pgctx_t *ctx, dbtype_t obj);
+extern uint32_t db_wait_change(pgctx_t *ctx, dbval_t *obj, uint32_t last_version, int64_t timeout);
 
 extern int __dblocked;
-#define dbfree(addr, x) do { \
+#define dbfree(ctx, addr, x) do { \
 		assert(__dblocked); \
-		pmem_gc_suggest(addr, x); \
+		db_suggest(ctx, addr, x); \
 	} while(0)
 
+/*
+ * Single-container updates and multi-container transactions (see txn.c)
+ * are ordered through root->commit.  A synchronize sets writing in its
+ * reader slot and backs off while a transaction holds commit.seq odd.
+ * A transaction makes commit.seq odd, with its pid in commit.pid, and
+ * waits for the slots which are writing before it publishes its roots.
+ * A process without a reader slot takes commit.seq for itself.
+ */
+extern void commit_lock(pgctx_t *ctx);
+extern void commit_unlock(pgctx_t *ctx);
+extern void commit_wait(pgctx_t *ctx);
+
+static inline volatile uint32_t *commit_enter(pgctx_t *ctx)
+{
+    volatile dbroot_t *root = ctx->root;
+    volatile uint32_t *writing;
+
+    if (ctx->ebr.slot < 0 || ctx->ebr.pid != getpid()) {
+        commit_lock(ctx);
+        return NULL;
+    }
+    writing = &root->readers[ctx->ebr.slot].writing;
+    for(;;) {
+        *writing = 1;
+        __sync_synchronize();
+        if (!(root->commit.seq & 1))
+            return writing;
+        *writing = 0;
+        commit_wait(ctx);
+    }
+}
+
+static inline void commit_exit(pgctx_t *ctx, volatile uint32_t *writing)
+{
+    if (writing)
+        *writing = 0;
+    else
+        commit_unlock(ctx);
+}
+
+/*
+ * Every container keeps its root word at the same offset, so the
+ * container can be found from the word synchronize swapped.  Bump its
+ * version and wake anyone sleeping in db_wait_change.
+ */
+static inline void dbversion_bump(pgctx_t *ctx, volatile dbtype_t *ptr)
+{
+    dbval_t *obj = (dbval_t*)((uint8_t*)ptr - offsetof(dbval_t, obj));
+    atomic_inc(&obj->version);
+    if (obj->waiters)
+        mm_wake(&obj->version);
+}
+
+/*
+ * Blocks which survived the last full collection are old, and the next
+ * one doesn't look inside of them again (see gc_start).  Published blocks
+ * never change, except for the root words of containers, so a container
+ * whose root word was swapped gets a bit in root->gcgen.dirty and the
+ * collector walks its new tree.
+ */
+static inline void db_gc_remember(pgctx_t *ctx, volatile dbtype_t *ptr)
+{
+    gcmap_t *dirty = _ptr(ctx, ctx->root->gcgen.dirty);
+    uint64_t ofs;
+
+    if (!dirty)
+        return;
+    ofs = _offset(ctx, (uint8_t*)ptr - offsetof(dbval_t, obj));
+    if (ofs >= dirty->size)
+        ctx->root->gcgen.overflow = 1;
+    else if (!pmem_gcmap_test(dirty, ofs))
+        pmem_gcmap_set(dirty, ofs);
+}
+
 static inline int synchronizep(pgctx_t *ctx, int sync, volatile dbtype_t *ptr, void *oldval, void *newval)
 {
+    volatile uint32_t *writing;
     int ret;
     // Synchronize to disk to insure that all data structures
     // are in a consistent state
     if (sync) dbfile_sync(ctx);
+    writing = commit_enter(ctx);
     ret = cmpxchg64(ptr, _offset(ctx, oldval), _offset(ctx, newval));
+    commit_exit(ctx, writing);
+    if (ret && ctx->root->gcinc.phase == GC_MARK) db_gc_barrier(ctx, _offset(ctx, oldval));
+    if (ret) db_gc_remember(ctx, ptr);
+    if (ret) dbversion_bump(ctx, ptr);
     // If the atomic exchange was successfull, synchronize again
     // to write the newly exchanged word to disk
     if (ret && sync) dbfile_sync(ctx);
@@ -63,11 +186,17 @@ static inline int synchronizep(pgctx_t *ctx, int sync, volatile dbtype_t *ptr, v
 
 static inline int synchronize(pgctx_t *ctx, int sync, volatile dbtype_t *ptr, dbtype_t oldval, dbtype_t newval)
 {
+    volatile uint32_t *writing;
     int ret;
     // Synchronize to disk to insure that all data structures
     // are in a consistent state
     if (sync) dbfile_sync(ctx);
+    writing = commit_enter(ctx);
     ret = cmpxchg64(ptr, oldval.all, newval.all);
+    commit_exit(ctx, writing);
+    if (ret && ctx->root->gcinc.phase == GC_MARK) db_gc_barrier(ctx, oldval.all);
+    if (ret) db_gc_remember(ctx, ptr);
+    if (ret) dbversion_bump(ctx, ptr);
     // If the atomic exchange was successfull, synchronize again
     // to write the newly exchanged word to disk
     if (ret && sync) dbfile_sync(ctx);
@@ -17,6 +17,14 @@ extern const dbtype_t DBNULL;
 #define MULTI_ERR_INDEX -3
 #define MULTI_ERR_TYPE  -4
 #define MULTI_ERR_CMD   -5
+#define MULTI_ERR_FROZEN -6
+
+// Errors from the cas and incr operations and dbint_add
+#define CAS_ERR_KEY      -1		// no such key (cas)
+#define CAS_ERR_INT      -2		// the value isn't an Int (incr)
+#define CAS_ERR_OVERFLOW -3		// the result doesn't fit into an Int (incr)
+#define CAS_ERR_FROZEN   -4		// the container is a snapshot
+#define CAS_ERR_TYPE     -5		// the container can't do it
 
 typedef enum {
 	db_EQ,
@@ -48,6 +56,7 @@ static inline dbtag_t dbtype(pgctx_t *ctx, dbtype_t x)
 // In dbtypes.c
 extern dbtype_t dbboolean_new(pgctx_t *ctx, unsigned val);
 extern dbtype_t dbint_new(pgctx_t *ctx, int64_t val);
+extern int dbint_add(pgctx_t *ctx, dbtype_t a, int64_t delta, dbtype_t *result);
 extern dbtype_t dbstrtol(pgctx_t *ctx, dbtype_t s);
 extern dbtype_t dbfloat_new(pgctx_t *ctx, double val);
 extern dbtype_t dbstring_new(pgctx_t *ctx, const char *val, int len);
@@ -86,10 +95,13 @@ extern int dbobject_getitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *
 extern int dbobject_getstr(pgctx_t *ctx, dbtype_t obj, const char *key, dbtype_t *value);
 extern int dbobject_setitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t value, int sync);
 extern int dbobject_delitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value, int sync);
+extern int dbobject_cas(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t expected, dbtype_t value, int sync);
+extern int dbobject_incr(pgctx_t *ctx, dbtype_t obj, dbtype_t key, int64_t delta, dbtype_t *value, int sync);
 extern int dbobject_update(pgctx_t *ctx, dbtype_t obj, int n, updatecb_t elem, void *user, int sync);
 
 // In container_coll.c
 extern dbtype_t dbcollection_new(pgctx_t *ctx, int multi);
+extern dbtype_t dbcollection_new_btree(pgctx_t *ctx);
 extern int dbcollection_len(pgctx_t *ctx, dbtype_t obj);
 extern int dbcollection_contains(pgctx_t *ctx, dbtype_t obj, dbtype_t key);
 extern int dbcollection_getitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value);
@@ -97,13 +109,30 @@ extern int dbcollection_getnode(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype
 extern int dbcollection_getstr(pgctx_t *ctx, dbtype_t obj, const char *key, dbtype_t *value);
 extern int dbcollection_setitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t value, int sync);
 extern int dbcollection_delitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value, int sync);
+extern int dbcollection_cas(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t expected, dbtype_t value, int sync);
+extern int dbcollection_incr(pgctx_t *ctx, dbtype_t obj, dbtype_t key, int64_t delta, dbtype_t *value, int sync);
 extern int dbcollection_update(pgctx_t *ctx, dbtype_t obj, int n, updatecb_t elem, void *user, int sync);
+extern int dbcollection_delete_many(pgctx_t *ctx, dbtype_t obj, int n, extendcb_t elem, void *user, int sync);
+extern int dbcollection_union(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result);
+extern int dbcollection_intersection(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result);
+extern int dbcollection_difference(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result);
+extern int dbcollection_snapshot(pgctx_t *ctx, dbtype_t obj, dbtype_t *snap);
+extern void dbcollection_release(pgctx_t *ctx, dbtype_t snap);
 
 
 // In container_ops.c
 extern int db_search(pgctx_t *ctx, dbtype_t obj, dbtype_t path, int n, relop_t relop, dbtype_t value, dbtype_t result);
 extern int db_multi(pgctx_t *ctx, dbtype_t obj, dbtype_t path, multi_t op, dbtype_t *value, int sync);
 
+// In txn.c
+typedef struct {
+	multi_t op;
+	dbtype_t obj;
+	dbtype_t key;
+	dbtype_t value;
+} dbtxnop_t;
+extern int db_transaction(pgctx_t *ctx, int n, dbtxnop_t *ops, int *failed, int sync);
+
 // In container_cache.c
 #if 0
 extern dbtype_t *dbcache_new(pgctx_t *ctx, int cachesz, int retry);
@@ -3,8 +3,11 @@
 
 #include <time.h>
 #ifndef WIN32
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 #include <unistd.h>
+#include <sched.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #else
@@ -72,9 +75,26 @@ static inline uint32_t hash_x31(const uint8_t *str, int len)
 	return hash;
 }
 
+// Wait for another process: spin for a little while, then give up the cpu
+static inline void backoff(unsigned *n)
+{
+	if ((*n)++ < 64) {
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	} else {
+#ifdef WIN32
+		SwitchToThread();
+#else
+		sched_yield();
+#endif
+	}
+}
+
 extern int64_t utime_now(void);
 extern time_t mktimegm(struct tm *tm);
 extern int is_prime(uint32_t n);
+extern int pid_alive(int pid);
 
 #ifdef WIN32
 extern int getpid(void);
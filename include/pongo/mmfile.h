@@ -63,6 +63,8 @@ int mm_sync(mmfile_t *mm);
 int mm_resize(mmfile_t *mm, uint64_t newsize);
 int mm_lock(mmfile_t *mm, uint32_t flags, uint64_t offset, uint64_t len);
 uint64_t mm_size(mmfile_t *mm);
+int mm_wait(volatile uint32_t *addr, uint32_t val, int64_t timeout);
+void mm_wake(volatile uint32_t *addr);
 
 /*
  * Given a pointer in a mmap region, return the mapping to which it belongs
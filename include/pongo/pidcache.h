@@ -3,9 +3,24 @@
 #include <pongo/context.h>
 #include <pongo/dbtypes.h>
 
+/*
+ * Objects referenced by a process (python proxies, iterators) are pinned
+ * in slots of that process' pin slabs.  The slabs are chained off of
+ * root->pidslab and the GC treats every slot as a root.  A slot is named
+ * by a handle, which is 0 for "nothing pinned".
+ */
+#define PIDCACHE_SLOTS 254
+typedef struct _pidslab {
+    uint64_t next;              // next slab in the chain
+    volatile uint32_t pid;      // owning process, 0 if the slab is free
+    uint32_t _pad;
+    dbtype_t slot[PIDCACHE_SLOTS];
+} pidslab_t;
+
 extern int pidcache_new(pgctx_t *ctx);
-extern void pidcache_put(pgctx_t *ctx, void *localobj, dbtype_t dbobj);
-extern void pidcache_del(pgctx_t *ctx, void *localobj);
+extern uint32_t pidcache_put(pgctx_t *ctx, dbtype_t dbobj);
+extern void pidcache_del(pgctx_t *ctx, uint32_t handle);
 extern void pidcache_destroy(pgctx_t *ctx);
+extern int pidcache_reap(pgctx_t *ctx);
 
 #endif
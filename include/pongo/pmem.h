@@ -2,6 +2,7 @@
 #define PMEM_H
 
 #include <pongo/stdtypes.h>
+#include <pongo/atomic.h>
 #include <pongo/mmfile.h>
 
 #ifndef offsetof
@@ -37,19 +38,24 @@ typedef struct _poolblock {
 	uint32_t
 		type:	1,
 		alloc:	1,
-		gc:	1,
+		gc:	1,		// unused, see gcmap_t
 		pool:	29;
 } poolblock_t;
 
 typedef struct _memblock {
 	uint32_t sbofs;
-	uint32_t
-		type:	1,
-		alloc:	1,
-		gc:	1,
-		suggest:1,
-		_resv:  12,
-		next: 16;
+	union {
+		struct {
+			uint32_t
+				type:	1,
+				alloc:	1,
+				gc:	1,		// retired, waiting for reader slot _resv to free it
+				suggest:1,
+				_resv:  12,
+				next: 16;
+		};
+		volatile uint32_t flags;	// all of the above, for cmpxchg
+	};
 } memblock_t;
 
 typedef union _bdescr { 
@@ -69,7 +75,7 @@ typedef struct _superblock {
 	volatile bdescr_t desc;
 	uint32_t size, total;
 	uint32_t _xxx;
-	uint32_t gc :1,
+	uint32_t gc :1,	// unused, see gcmap_t
 		 suggest: 1,
 		_resv: 30;
 	uint8_t _pad[64 - (5*sizeof(uint64_t))];
@@ -81,8 +87,8 @@ typedef struct _mlist {
 } mlist_t;
 
 typedef struct _procheap {
-	int64_t last_used;
-	uint64_t id;
+	int64_t last_used;			// 0 once retired
+	uint64_t id;				// pid of a process using it
 	mlist_t szcls[NR_SZCLS];
 	uint8_t _pad[64 - (NR_SZCLS*sizeof(mlist_t)+2*sizeof(uint64_t)) % 64];
 } procheap_t;
@@ -95,6 +101,27 @@ typedef struct _plist {
 	                    // this many spare slots
 } plist_t;
 
+/*
+ * Collector mark bits, kept outside of the blocks themselves so that a
+ * collection dirties only the bitmap (and the blocks it frees) rather
+ * than every page in the file.  One bit per 8 bytes of the file, indexed
+ * by the offset of the block's data.  A set bit means the block is
+ * garbage unless the collector finds it again.  The bits are all clear
+ * between collections.
+ */
+typedef struct _gcmap {
+	uint64_t size;				// bytes of the file covered
+	uint64_t dead;				// reader slots whose retired blocks may go
+	volatile uint64_t bits[];
+} gcmap_t;
+
+// Blocks and bytes in use (or freed), one counter per size class.  The
+// counter after the last size class is for the pool allocator.
+typedef struct _pmemcount {
+	uint64_t num;
+	uint64_t size;
+} pmemcount_t;
+
 typedef struct _memheap {
 	uint64_t nr_procheap;
 	uint64_t mempool;
@@ -117,38 +144,84 @@ extern void pmem_sb_free(superblock_t *sb, void *addr);
 
 extern void *pmem_alloc(mmfile_t *mm, memheap_t *heap, uint32_t sz);
 extern void pmem_retire(mmfile_t *mm, memheap_t *heap, int ph);
-extern void pmem_gc_mark(mmfile_t *mm, memheap_t *heap, int suggest);
+extern void pmem_gc_mark(mmfile_t *mm, memheap_t *heap, int suggest, gcmap_t *map);
 extern void pmem_relist_pools(mmfile_t *mm, memheap_t *heap);
 
+// Processes share the per-process heaps by pid
+static inline int pmem_heap_of(memheap_t *heap, int pid)
+{
+    return 1 + pid % (heap->nr_procheap-1);
+}
+
 typedef void (*gcfreecb_t)(void *user, void *addr);
-extern void pmem_gc_free(mmfile_t *mm, memheap_t *heap, int fast, gcfreecb_t cb, void *user);
+extern void pmem_gc_free(mmfile_t *mm, memheap_t *heap, int fast, gcmap_t *map, pmemcount_t *freed, gcfreecb_t cb, void *user);
+extern void pmem_count(mmfile_t *mm, memheap_t *heap, pmemcount_t *inuse);
 
 extern void pmem_print_mem(mmfile_t *mm, memheap_t *heap);
 
+/*
+ * The flags of a published block change while other processes look at
+ * them: db_retire hands the block to a reader slot and pmem_gc_suggest
+ * hands it to the fast collector.  Both swap the whole flags word, and
+ * the collector reads it once, so gc is never seen without its _resv.
+ */
 static inline void pmem_gc_suggest(void *addr, int x)
 {
-    memblock_t *mb;
+    memblock_t *mb, old, new;
     superblock_t *sb;
 
     if (!addr) return;
     mb = (memblock_t*)addr - 1;
     if (mb->type == 1) {
 	assert(mb->alloc);
-        mb->suggest = 1;
-	mb->_resv = x;
+        do {
+            old.flags = new.flags = mb->flags;
+            new.suggest = 1;
+            if (!new.gc)
+                new._resv = x;
+        } while(!cmpxchg32(&mb->flags, old.flags, new.flags));
         sb = (superblock_t*)((uint8_t*)mb - mb->sbofs);
         sb->suggest = 1;
     }
 }
 
-static inline void pmem_gc_keep(void *addr)
+static inline void pmem_gc_retire(memblock_t *mb, unsigned slot)
 {
-    memblock_t *mb;
-    if (!addr) return;
-    mb = (memblock_t*)addr - 1;
-    assert(mb->alloc);
-    mb->gc = 0;
+    memblock_t old, new;
+
+    do {
+        old.flags = new.flags = mb->flags;
+        new.gc = 1;
+        new._resv = slot;
+    } while(!cmpxchg32(&mb->flags, old.flags, new.flags));
+}
+
+static inline void pmem_gcmap_set(gcmap_t *map, uint64_t ofs)
+{
+    if (ofs < map->size)
+        __sync_fetch_and_or(&map->bits[ofs >> 9], 1ULL << ((ofs >> 3) & 63));
+}
+
+static inline void pmem_gcmap_clear(gcmap_t *map, uint64_t ofs)
+{
+    if (ofs < map->size)
+        __sync_fetch_and_and(&map->bits[ofs >> 9], ~(1ULL << ((ofs >> 3) & 63)));
 }
 
+// Blocks retired by a live reader are freed by that reader
+static inline int pmem_gcmap_owned(gcmap_t *map, memblock_t *mb)
+{
+    memblock_t m;
+
+    m.flags = mb->flags;
+    return m.gc && !((map->dead >> (m._resv & 63)) & 1);
+}
+
+static inline int pmem_gcmap_test(gcmap_t *map, uint64_t ofs)
+{
+    if (ofs >= map->size)
+        return 0;
+    return (map->bits[ofs >> 9] >> ((ofs >> 3) & 63)) & 1;
+}
 
 #endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <assert.h>
 #include <pongo/dbmem.h>
 #include <pongo/context.h>
 #include <pongo/dbtypes.h>
@@ -11,14 +12,68 @@
 #define GET(x) ((dbtype_t*)_ptr(ctx, x))
 #define WEIGHT 4
 //#define rcuwinner(a, x) dbfree(a, x)
-#define rcuwinner(a, x) do { assert(ctx->winner.len < 126); ctx->winner.addr[ctx->winner.len++] = a; } while(0)
-#define rculoser(a, x)  do { assert(ctx->loser.len < 126); ctx->loser.addr[ctx->loser.len++] = a; } while(0)
+#define rcuwinner(a, x) rcupush(&ctx->winner, a)
+#define rculoser(a, x)  rcupush(&ctx->loser, a)
 
         
 
-typedef enum {
-    subtree_left, subtree_right
-} subtree_t;
+// A search key, with its prefix laid out as in a _BonsaiPrefixNode
+typedef struct {
+    dbtype_t key;
+    int str;                    // key is a String or ByteBuffer
+    uint32_t len;
+    uint8_t prefix[NODE_PREFIX];
+} probe_t;
+
+static void
+bonsai_probe(pgctx_t *ctx, dbtype_t key, probe_t *p)
+{
+    epstr_t ep;
+    dbval_t *kp;
+    const uint8_t *sval;
+
+    p->key = key;
+    p->str = 0;
+    if (key.type == String || key.type == ByteBuffer) {
+        ep.all = key.all;
+        p->len = ep.len;
+        sval = ep.val;
+    } else if (key.all && isPtr(key.type)) {
+        kp = dbptr(ctx, key);
+        if (kp->type != String && kp->type != ByteBuffer)
+            return;
+        p->len = kp->len;
+        sval = kp->sval;
+    } else {
+        return;
+    }
+    p->str = 1;
+    memset(p->prefix, 0, NODE_PREFIX);
+    memcpy(p->prefix, sval, p->len < NODE_PREFIX ? p->len : NODE_PREFIX);
+}
+
+/*
+ * Compare a search key with the key of a node, as dbcmp(p->key, np->key).
+ * Strings compare like strcmp, so the prefixes are compared the same way
+ * and only a tie over the whole prefix needs the strings themselves.
+ */
+static inline int
+bonsai_cmp(pgctx_t *ctx, const probe_t *p, dbval_t *np)
+{
+    int i;
+
+    if (p->str && np->type == _BonsaiPrefixNode) {
+        for(i=0; i<NODE_PREFIX; i++) {
+            if (p->prefix[i] != np->kprefix[i])
+                return p->prefix[i] < np->kprefix[i] ? -1 : 1;
+            if (!p->prefix[i])
+                return 0;
+        }
+        if (p->len == NODE_PREFIX && np->klen == NODE_PREFIX)
+            return 0;
+    }
+    return dbcmp(ctx, p->key, np->key);
+}
 
 int
 bonsai_size(pgctx_t *ctx, dbtype_t node)
@@ -33,16 +88,28 @@ static dbtype_t
 bonsai_new(pgctx_t *ctx, dbtype_t left, dbtype_t right, dbtype_t key, dbtype_t value)
 {
     dbtype_t node;
+    probe_t p;
 
-    node.ptr = dballoc(ctx, sizeof(dbnode_t));
-    node.ptr->type = _BonsaiNode;
+    // Inline keys are cheap to compare already
+    bonsai_probe(ctx, key, &p);
+    if (p.str && isPtr(key.type)) {
+        node.ptr = dballoc(ctx, sizeof(dbpnode_t));
+        node.ptr->type = _BonsaiPrefixNode;
+        node.ptr->klen = p.len;
+        memcpy(node.ptr->kprefix, p.prefix, NODE_PREFIX);
+    } else {
+        node.ptr = dballoc(ctx, sizeof(dbnode_t));
+        node.ptr->type = _BonsaiNode;
+    }
     node.ptr->left = left;
     node.ptr->right = right;
     node.ptr->size = 1 + bonsai_size(ctx, left) + bonsai_size(ctx, right);
     node.ptr->key = key;
     node.ptr->value = value;
+    node.ptr->_pad = ctx->batch ? BONSAI_PRIVATE : 0;
+    node = dboffset(ctx, node.ptr);
     rculoser(node, 0);
-    return dboffset(ctx, node.ptr);
+    return node;
 }
 
 static dbtype_t
@@ -58,8 +125,10 @@ bonsai_multi_new(pgctx_t *ctx, dbtype_t left, dbtype_t right, dbtype_t key, dbty
     node.ptr->key = key;
     node.ptr->nvalue = 1;
     node.ptr->values[0] = value;
+    node.ptr->_pad = ctx->batch ? BONSAI_PRIVATE : 0;
+    node = dboffset(ctx, node.ptr);
     rculoser(node, 0);
-    return dboffset(ctx, node.ptr);
+    return node;
 }
 
 static dbtype_t
@@ -72,17 +141,23 @@ bonsai_ncopy(pgctx_t *ctx, dbtype_t left, dbtype_t right, dbtype_t orig, int n)
     if (orig.ptr->type == _BonsaiNode) {
         node.ptr = dballoc(ctx, sizeof(dbnode_t));
         copysz = 2*sizeof(dbtype_t);
+    } else if (orig.ptr->type == _BonsaiPrefixNode) {
+        node.ptr = dballoc(ctx, sizeof(dbpnode_t));
+        copysz = sizeof(dbpnode_t) - offsetof(dbpnode_t, key);
     } else if (orig.ptr->type == _BonsaiMultiNode) {
-        node.ptr = dballoc(ctx, sizeof(dbmultinode_t) + orig.ptr->nvalue * sizeof(dbtype_t));
-        copysz = 2*sizeof(dbtype_t) + (orig.ptr->nvalue + n) * sizeof(dbtype_t);
+        // Leave room for n more values
+        node.ptr = dballoc(ctx, sizeof(dbmultinode_t) + (orig.ptr->nvalue + n) * sizeof(dbtype_t));
+        copysz = 2*sizeof(dbtype_t) + orig.ptr->nvalue * sizeof(dbtype_t);
     }
     node.ptr->type = orig.ptr->type;
     node.ptr->left = left;
     node.ptr->right = right;
     node.ptr->size = 1 + bonsai_size(ctx, left) + bonsai_size(ctx, right);
     memcpy(&node.ptr->key, &orig.ptr->key, copysz);
+    node.ptr->_pad = ctx->batch ? BONSAI_PRIVATE : 0;
+    node = dboffset(ctx, node.ptr);
     rculoser(node, 0);
-    return dboffset(ctx, node.ptr);
+    return node;
 }
 
 static dbtype_t
@@ -172,8 +247,15 @@ balance_right(pgctx_t *ctx, dbtype_t left, dbtype_t right, dbtype_t orig)
         double_right(ctx, left, right, orig) ;
 }
 
+/*
+ * Give cur the new children left and right, rotating if the weights are
+ * out of balance.  Published nodes are never written:  a reader may be
+ * walking them, and a writer that loses the race in synchronize must
+ * leave nothing behind.  So cur is copied and the copy is published with
+ * the new root.
+ */
 static inline dbtype_t
-balance(pgctx_t *ctx, dbtype_t cur, dbtype_t left, dbtype_t right, subtree_t which, int inplace)
+balance(pgctx_t *ctx, dbtype_t cur, dbtype_t left, dbtype_t right)
 {
     uint64_t ln = bonsai_size(ctx, left);
     uint64_t rn = bonsai_size(ctx, right);
@@ -192,55 +274,219 @@ balance(pgctx_t *ctx, dbtype_t cur, dbtype_t left, dbtype_t right, subtree_t whi
     rcuwinner(cur, 0xe7);
     return ret;
 balanced:
-    inplace = 0;
-    if (inplace) {
-        if (which == subtree_left) {
-            // rcu_assign_pointer
-            cp->left = left;
-        } else {
-            // rcu_assign_pointer
-            cp->right = right;
-        }
-        cp->size = 1 + bonsai_size(ctx, left) + bonsai_size(ctx, right);
-        ret = cur;
-    } else {
-        ret = bonsai_copy(ctx, left, right, cur);
-        rcuwinner(cur, 0xe8);
+    if (cp->_pad == BONSAI_PRIVATE) {
+        // Nobody else can see a node created by the current batch,
+        // so there is no need to copy it.
+        cp->left = left;
+        cp->right = right;
+        cp->size = 1 + ln + rn;
+        return cur;
     }
+    ret = bonsai_copy(ctx, left, right, cur);
+    rcuwinner(cur, 0xe8);
     return ret;
 }
 
-dbtype_t
-bonsai_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value, int insert_or_fail)
+/*
+ * Give node the new children left and right after an update which kept
+ * the size of every subtree, such as replacing a value.  Nothing can be
+ * out of balance, so the copy takes the size of the original and the
+ * children aren't looked at.
+ */
+static dbtype_t
+bonsai_path(pgctx_t *ctx, dbtype_t node, dbtype_t left, dbtype_t right)
+{
+    dbval_t *np = dbptr(ctx, node);
+    dbval_t *cp;
+    dbtype_t ret;
+
+    if (left.all == np->left.all && right.all == np->right.all)
+        return node;
+    if (np->_pad == BONSAI_PRIVATE) {
+        np->left = left;
+        np->right = right;
+        return node;
+    }
+    ret = bonsai_copy(ctx, DBNULL, DBNULL, node);
+    cp = dbptr(ctx, ret);
+    cp->left = left;
+    cp->right = right;
+    cp->size = np->size;
+    rcuwinner(node, 0xe8);
+    return ret;
+}
+
+/*
+ * *grew is set when a node was added.  Otherwise the shape of the tree
+ * is unchanged, and the path back up is copied without rebalancing.
+ */
+static dbtype_t
+_bonsai_insert(pgctx_t *ctx, dbtype_t node, const probe_t *p, dbtype_t value, int insert_or_fail, int *grew)
 {
     int cmp;
     dbval_t *np;
+    dbtype_t child;
+
     if (!node.all) {
-        return bonsai_new(ctx, DBNULL, DBNULL, key, value);
+        *grew = 1;
+        return bonsai_new(ctx, DBNULL, DBNULL, p->key, value);
     }
 
     np = dbptr(ctx, node);
-    cmp = dbcmp(ctx, key, np->key);
+    cmp = bonsai_cmp(ctx, p, np);
     if (insert_or_fail && cmp==0) {
         node.type = Error;
         return node;
     }
     if (cmp < 0) {
-        return balance(ctx, node,
-                bonsai_insert(ctx, np->left, key, value, insert_or_fail),
-                np->right,
-                subtree_left, 1);
+        child = _bonsai_insert(ctx, np->left, p, value, insert_or_fail, grew);
+        if (*grew)
+            return balance(ctx, node, child, np->right);
+        if (child.type == Error)
+            return child;
+        return bonsai_path(ctx, node, child, np->right);
     }
     if (cmp > 0) {
-        return balance(ctx, node,
-                np->left,
-                bonsai_insert(ctx, np->right, key, value, insert_or_fail),
-                subtree_right, 1);
+        child = _bonsai_insert(ctx, np->right, p, value, insert_or_fail, grew);
+        if (*grew)
+            return balance(ctx, node, np->left, child);
+        if (child.type == Error)
+            return child;
+        return bonsai_path(ctx, node, np->left, child);
+    }
+    // Storing the value already there changes nothing, and the tree is
+    // returned as it was.
+    if (np->value.all == value.all)
+        return node;
+    // Replace the value in a private copy of the node rather than
+    // writing into the published node:  a failed synchronize (or a
+    // concurrent reader) must never observe the new value early.
+    if (np->_pad == BONSAI_PRIVATE) {
+        np->value = value;
+        return node;
     }
+    node = bonsai_copy(ctx, np->left, np->right, node);
+    rcuwinner(dboffset(ctx, np), 0xea);
+    np = dbptr(ctx, node);
     np->value = value;
     return node;
 }
 
+static inline int
+balanced(uint64_t ln, uint64_t rn)
+{
+    return ln+rn < 2 || (ln <= WEIGHT * rn && rn <= WEIGHT * ln);
+}
+
+// Give orig the children left and right, in place if it is private
+static dbtype_t
+bonsai_relink(pgctx_t *ctx, dbtype_t orig, dbtype_t left, dbtype_t right)
+{
+    dbval_t *np = dbptr(ctx, orig);
+    dbtype_t ret;
+
+    if (np->_pad == BONSAI_PRIVATE) {
+        np->left = left;
+        np->right = right;
+        np->size = 1 + bonsai_size(ctx, left) + bonsai_size(ctx, right);
+        return orig;
+    }
+    ret = bonsai_copy(ctx, left, right, orig);
+    rcuwinner(orig, 0xec);
+    return ret;
+}
+
+/*
+ * Append a key greater than every key in the tree, as happens with keys
+ * that grow over time.  An append copies the whole right spine anyway, so
+ * the spine is rebuilt instead of being rotated node by node.  It is kept
+ * as a list of left subtrees from the top down, and whenever a subtree
+ * has grown as large as the one above it, the two are joined under the
+ * key between them, like the carry in a binary counter.  The subtrees
+ * stay perfectly balanced and the spine about log2(n) long, and an append
+ * costs one copy per spine node and no rotations.
+ *
+ * The plan is made on the sizes alone.  If the tree has a shape the plan
+ * can't keep in balance, nothing has been allocated and 0 is returned so
+ * that the key takes the ordinary insert.
+ */
+static int
+bonsai_append(pgctx_t *ctx, dbtype_t node, const probe_t *p, dbtype_t value, dbtype_t *out)
+{
+    dbtype_t spine[BONSAI_MAXDEPTH], block[BONSAI_MAXDEPTH];
+    uint64_t size[BONSAI_MAXDEPTH], below, merged;
+    uint8_t carry[BONSAI_MAXDEPTH];
+    int i, n, m, c, total, ncarry;
+    dbval_t *np = NULL;
+
+    for(n=0; node.all; n++) {
+        if (n == BONSAI_MAXDEPTH-1)
+            return 0;
+        np = dbptr(ctx, node);
+        spine[n] = node;
+        block[n] = np->left;
+        size[n] = bonsai_size(ctx, np->left);
+        node = np->right;
+    }
+    if (!n || bonsai_cmp(ctx, p, np) <= 0)
+        return 0;
+    // The new key goes at the bottom, with nothing on its left
+    spine[n] = DBNULL;
+    block[n] = DBNULL;
+    size[n++] = 0;
+    total = n;
+
+    // Carry from the bottom up.  below is the weight under entry i+1.
+    ncarry = 0;
+again:
+    for(i=n-2, below=0; i>=0; i--) {
+        merged = size[i] + size[i+1] + 1;
+        if (size[i+1] >= size[i] && balanced(size[i], size[i+1]) && balanced(merged, below)) {
+            size[i] = merged;
+            memmove(size+i+1, size+i+2, (n-i-2) * sizeof(uint64_t));
+            carry[ncarry++] = i;
+            n--;
+            goto again;
+        }
+        below += size[i+1] + 1;
+    }
+    for(i=n-1, below=0; i>=0; below += size[i--] + 1) {
+        if (!balanced(size[i], below))
+            return 0;
+    }
+
+    // Now do it:  each carry makes a subtree of two neighbours, and then
+    // the spine is linked from the bottom up.
+    for(i=0, m=total; i<ncarry; i++, m--) {
+        c = carry[i];
+        block[c] = bonsai_relink(ctx, spine[c], block[c], block[c+1]);
+        memmove(spine+c, spine+c+1, (m-c-1) * sizeof(dbtype_t));
+        memmove(block+c+1, block+c+2, (m-c-2) * sizeof(dbtype_t));
+    }
+    node = DBNULL;
+    for(i=n-1; i>=0; i--) {
+        if (spine[i].all)
+            node = bonsai_relink(ctx, spine[i], block[i], node);
+        else
+            node = bonsai_new(ctx, block[i], node, p->key, value);
+    }
+    *out = node;
+    return 1;
+}
+
+dbtype_t
+bonsai_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value, int insert_or_fail)
+{
+    probe_t p;
+    dbtype_t ret;
+    int grew = 0;
+
+    bonsai_probe(ctx, key, &p);
+    if (bonsai_append(ctx, node, &p, value, &ret))
+        return ret;
+    return _bonsai_insert(ctx, node, &p, value, insert_or_fail, &grew);
+}
+
 dbtype_t
 bonsai_multi_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value)
 {
@@ -256,16 +502,15 @@ bonsai_multi_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value)
     if (cmp < 0) {
         return balance(ctx, node,
                 bonsai_multi_insert(ctx, np->left, key, value),
-                np->right,
-                subtree_left, 1);
+                np->right);
     }
     if (cmp > 0) {
         return balance(ctx, node,
                 np->left,
-                bonsai_multi_insert(ctx, np->right, key, value),
-                subtree_right, 1);
+                bonsai_multi_insert(ctx, np->right, key, value));
     }
     orig = np;
+    rcuwinner(node, 0xeb);
     node = bonsai_ncopy(ctx, np->left, np->right, node, 1);
     np = dbptr(ctx, node);
     for(done=i=j=0; i<orig->nvalue; i++, j++) {
@@ -299,11 +544,11 @@ delete_min(pgctx_t *ctx, dbtype_t node, dbtype_t *out)
         *out = node;
         return right;
     }
-    return balance(ctx, node, delete_min(ctx, left, out), right, subtree_left, 0);
+    return balance(ctx, node, delete_min(ctx, left, out), right);
 }
 
 static dbtype_t
-_bonsai_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *valout)
+_bonsai_delete(pgctx_t *ctx, dbtype_t node, const probe_t *p, dbtype_t *valout)
 {
     dbval_t *np = dbptr(ctx, node);
     dbtype_t min, left, right;
@@ -316,12 +561,12 @@ _bonsai_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *valout)
 
     left = np->left;
     right = np->right;
-    cmp = dbcmp(ctx, key, np->key);
+    cmp = bonsai_cmp(ctx, p, np);
     if (cmp < 0) {
-        return balance(ctx, node, _bonsai_delete(ctx, left, key, valout), right, subtree_left, 1);
+        return balance(ctx, node, _bonsai_delete(ctx, left, p, valout), right);
     }
     if (cmp > 0) {
-        return balance(ctx, node, left, _bonsai_delete(ctx, right, key, valout), subtree_right, 1);
+        return balance(ctx, node, left, _bonsai_delete(ctx, right, p, valout));
     }
 
     if (valout) *valout = np->value;
@@ -330,14 +575,18 @@ _bonsai_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *valout)
     if (!left.all) return right;
     if (!right.all) return left;
     right = delete_min(ctx, right, &min);
-    return balance(ctx, min, left, right, subtree_right, 0);
+    return balance(ctx, min, left, right);
 }
 
 dbtype_t
 bonsai_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value)
 {
     dbtype_t valout = DBNULL;
-    dbtype_t ret = _bonsai_delete(ctx, node, key, &valout);
+    dbtype_t ret;
+    probe_t p;
+
+    bonsai_probe(ctx, key, &p);
+    ret = _bonsai_delete(ctx, node, &p, &valout);
     if (value) *value = valout;
     return (valout.type == Error) ? valout : ret;
 }
@@ -347,6 +596,7 @@ _bonsai_multi_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value)
 {
     dbval_t *np = dbptr(ctx, node);
     dbtype_t min, left, right;
+    probe_t p;
     int cmp;
     int i;
 
@@ -357,12 +607,13 @@ _bonsai_multi_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value)
 
     left = np->left;
     right = np->right;
-    cmp = dbcmp(ctx, key, np->key);
+    bonsai_probe(ctx, key, &p);
+    cmp = bonsai_cmp(ctx, &p, np);
     if (cmp < 0) {
-        return balance(ctx, node, _bonsai_delete(ctx, left, key, value), right, subtree_left, 1);
+        return balance(ctx, node, _bonsai_delete(ctx, left, &p, value), right);
     }
     if (cmp > 0) {
-        return balance(ctx, node, left, _bonsai_delete(ctx, right, key, value), subtree_right, 1);
+        return balance(ctx, node, left, _bonsai_delete(ctx, right, &p, value));
     }
 
     if (np->nvalue == 1) {
@@ -374,7 +625,7 @@ _bonsai_multi_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value)
         if (!right.all) return left;
         right = delete_min(ctx, right, &min);
         rcuwinner(node, 0xe9);
-        return balance(ctx, min, left, right, subtree_right, 0);
+        return balance(ctx, min, left, right);
     }
 
     node = bonsai_copy(ctx, left, right, node);
@@ -400,13 +651,397 @@ bonsai_multi_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value)
     return (value.type == Error) ? value : ret;
 }
 
+/*
+ * Build a tree from n keys in strictly ascending order.  The middle key
+ * becomes the root and each half becomes a subtree, so the result is
+ * perfectly balanced and costs exactly n allocations, with no rotations
+ * or path copies along the way.
+ */
+dbtype_t
+bonsai_build_sorted(pgctx_t *ctx, const dbtype_t *keys, const dbtype_t *values, int n)
+{
+    dbtype_t left, right;
+    int mid;
+
+    if (n <= 0)
+        return DBNULL;
+    mid = n/2;
+    left = bonsai_build_sorted(ctx, keys, values, mid);
+    right = bonsai_build_sorted(ctx, keys+mid+1, values+mid+1, n-mid-1);
+    return bonsai_new(ctx, left, right, keys[mid], values[mid]);
+}
+
+/*
+ * Join two trees with node in between:  every key in left must be less
+ * than the key of node and every key in right greater.  The trees may be
+ * of any size.  When one side outweighs the other by more than WEIGHT,
+ * node is joined into the inner spine of the heavy side and the spine is
+ * rebalanced on the way back up.  node is replaced by a copy, like any
+ * node whose children change.
+ */
+dbtype_t
+bonsai_join(pgctx_t *ctx, dbtype_t left, dbtype_t node, dbtype_t right)
+{
+    uint64_t ln = bonsai_size(ctx, left);
+    uint64_t rn = bonsai_size(ctx, right);
+    dbval_t *np;
+
+    if (ln+rn >= 2 && ln > WEIGHT * rn) {
+        np = dbptr(ctx, left);
+        return balance(ctx, left,
+                np->left,
+                bonsai_join(ctx, np->right, node, right));
+    }
+    if (ln+rn >= 2 && rn > WEIGHT * ln) {
+        np = dbptr(ctx, right);
+        return balance(ctx, right,
+                bonsai_join(ctx, left, node, np->left),
+                np->right);
+    }
+    return balance(ctx, node, left, right);
+}
+
+/*
+ * Insert n keys in strictly ascending order.  The batch is split around
+ * the key of each node on the way down, so a node is copied at most once
+ * no matter how many keys pass through it, and an empty subtree takes its
+ * part of the batch through bonsai_build_sorted.  Meant to run inside a
+ * bonsai batch, where the copies are private and are not copied again
+ * while rebalancing.
+ */
+dbtype_t
+bonsai_insert_batch(pgctx_t *ctx, dbtype_t node, const dbtype_t *keys, const dbtype_t *values, int n)
+{
+    int lo, hi, mid, eq = 0;
+    dbtype_t left, right;
+    dbval_t *np;
+
+    if (n <= 0)
+        return node;
+    if (!node.all)
+        return bonsai_build_sorted(ctx, keys, values, n);
+
+    // Find the first key of the batch that is not less than the node key
+    np = dbptr(ctx, node);
+    for(lo=0, hi=n; lo < hi; ) {
+        mid = lo + (hi-lo)/2;
+        if (dbcmp(ctx, keys[mid], np->key) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if (lo < n && dbcmp(ctx, keys[lo], np->key) == 0)
+        eq = 1;
+
+    left = bonsai_insert_batch(ctx, np->left, keys, values, lo);
+    right = bonsai_insert_batch(ctx, np->right, keys+lo+eq, values+lo+eq, n-lo-eq);
+    if (eq) {
+        // Same rule as bonsai_insert: never write into a published node
+        if (np->_pad != BONSAI_PRIVATE) {
+            node = bonsai_copy(ctx, np->left, np->right, node);
+            rcuwinner(dboffset(ctx, np), 0xeb);
+            np = dbptr(ctx, node);
+        }
+        np->value = values[lo];
+    }
+    return bonsai_join(ctx, left, node, right);
+}
+
+/*
+ * Split a tree around key into the trees of the keys less than and
+ * greater than key.  Returns the node holding key, or DBNULL.
+ */
+static dbtype_t
+_bonsai_split(pgctx_t *ctx, dbtype_t node, const probe_t *p, dbtype_t *left, dbtype_t *right)
+{
+    dbval_t *np;
+    dbtype_t found;
+    int cmp;
+
+    if (!node.all) {
+        *left = *right = DBNULL;
+        return DBNULL;
+    }
+    np = dbptr(ctx, node);
+    cmp = bonsai_cmp(ctx, p, np);
+    if (cmp == 0) {
+        *left = np->left;
+        *right = np->right;
+        return node;
+    }
+    if (cmp < 0) {
+        found = _bonsai_split(ctx, np->left, p, left, right);
+        *right = bonsai_join(ctx, *right, node, np->right);
+    } else {
+        found = _bonsai_split(ctx, np->right, p, left, right);
+        *left = bonsai_join(ctx, np->left, node, *left);
+    }
+    return found;
+}
+
+dbtype_t
+bonsai_split(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *left, dbtype_t *right)
+{
+    probe_t p;
+
+    bonsai_probe(ctx, key, &p);
+    return _bonsai_split(ctx, node, &p, left, right);
+}
+
+// Join two trees without a node in between
+static dbtype_t
+bonsai_join2(pgctx_t *ctx, dbtype_t left, dbtype_t right)
+{
+    dbtype_t min;
+
+    if (!right.all)
+        return left;
+    right = delete_min(ctx, right, &min);
+    return bonsai_join(ctx, left, min, right);
+}
+
+// A new multinode with key and the values of both a and b
+static dbtype_t
+bonsai_multi_merge(pgctx_t *ctx, dbtype_t a, dbtype_t b)
+{
+    dbval_t *ap = dbptr(ctx, a);
+    dbval_t *bp = dbptr(ctx, b);
+    dbtype_t node;
+    unsigned i, j, n;
+    int cmp;
+
+    node.ptr = dballoc(ctx, sizeof(dbmultinode_t) + (ap->nvalue + bp->nvalue) * sizeof(dbtype_t));
+    node.ptr->type = _BonsaiMultiNode;
+    node.ptr->left = node.ptr->right = DBNULL;
+    node.ptr->size = 1;
+    node.ptr->key = ap->key;
+    // Both lists of values are sorted, so merge them
+    for(i=j=n=0; i<ap->nvalue || j<bp->nvalue; n++) {
+        if (i == ap->nvalue) {
+            cmp = 1;
+        } else if (j == bp->nvalue) {
+            cmp = -1;
+        } else {
+            cmp = dbcmp(ctx, ap->values[i], bp->values[j]);
+        }
+        if (cmp <= 0) {
+            node.ptr->values[n] = ap->values[i++];
+            if (cmp == 0) j++;
+        } else {
+            node.ptr->values[n] = bp->values[j++];
+        }
+    }
+    node.ptr->nvalue = n;
+    node.ptr->_pad = ctx->batch ? BONSAI_PRIVATE : 0;
+    node = dboffset(ctx, node.ptr);
+    rculoser(node, 0);
+    return node;
+}
+
+/*
+ * Set algebra.  Each operation splits one tree around the root of the
+ * other, recurses on the two halves and joins the results, so it does
+ * O(m log(n/m+1)) work for trees of sizes m <= n.  The results are
+ * built inside a batch and may still share subtrees with a and b until
+ * bonsai_unshare gives them copies of their own.
+ */
+static dbtype_t
+_bonsai_union(pgctx_t *ctx, dbtype_t a, dbtype_t b)
+{
+    dbtype_t l, r, found;
+    dbval_t *bp;
+
+    if (!a.all)
+        return b;
+    if (!b.all)
+        return a;
+    bp = dbptr(ctx, b);
+    found = bonsai_split(ctx, a, bp->key, &l, &r);
+    l = _bonsai_union(ctx, l, bp->left);
+    r = _bonsai_union(ctx, r, bp->right);
+    // The value in b wins, except that multinodes keep both sets of values
+    if (found.all && bp->type == _BonsaiMultiNode)
+        b = bonsai_multi_merge(ctx, found, b);
+    return bonsai_join(ctx, l, b, r);
+}
+
+static dbtype_t
+_bonsai_intersection(pgctx_t *ctx, dbtype_t a, dbtype_t b)
+{
+    dbtype_t l, r, found;
+    dbval_t *ap;
+
+    if (!a.all || !b.all)
+        return DBNULL;
+    ap = dbptr(ctx, a);
+    found = bonsai_split(ctx, b, ap->key, &l, &r);
+    l = _bonsai_intersection(ctx, ap->left, l);
+    r = _bonsai_intersection(ctx, ap->right, r);
+    if (found.all)
+        return bonsai_join(ctx, l, a, r);
+    return bonsai_join2(ctx, l, r);
+}
+
+static dbtype_t
+_bonsai_difference(pgctx_t *ctx, dbtype_t a, dbtype_t b)
+{
+    dbtype_t l, r;
+    dbval_t *bp;
+
+    if (!a.all || !b.all)
+        return a;
+    bp = dbptr(ctx, b);
+    bonsai_split(ctx, a, bp->key, &l, &r);
+    l = _bonsai_difference(ctx, l, bp->left);
+    r = _bonsai_difference(ctx, r, bp->right);
+    return bonsai_join2(ctx, l, r);
+}
+
+/*
+ * Nodes may only belong to one published tree, because a node replaced
+ * in one tree is retired.  Copy every node of the result that is not
+ * private to the batch.  A node which isn't private has no private
+ * descendants, so its whole subtree is copied.
+ */
+static dbtype_t
+bonsai_unshare(pgctx_t *ctx, dbtype_t node)
+{
+    dbval_t *np;
+
+    if (!node.all)
+        return node;
+    np = dbptr(ctx, node);
+    if (np->_pad == BONSAI_PRIVATE) {
+        np->left = bonsai_unshare(ctx, np->left);
+        np->right = bonsai_unshare(ctx, np->right);
+        return node;
+    }
+    return bonsai_ncopy(ctx,
+            bonsai_unshare(ctx, np->left),
+            bonsai_unshare(ctx, np->right),
+            node, 0);
+}
+
+// The keys in a or b.  Values come from b when the key is in both.
+dbtype_t
+bonsai_union(pgctx_t *ctx, dbtype_t a, dbtype_t b)
+{
+    assert(ctx->batch);
+    return bonsai_unshare(ctx, _bonsai_union(ctx, a, b));
+}
+
+// The keys in both a and b, with the values from a
+dbtype_t
+bonsai_intersection(pgctx_t *ctx, dbtype_t a, dbtype_t b)
+{
+    assert(ctx->batch);
+    return bonsai_unshare(ctx, _bonsai_intersection(ctx, a, b));
+}
+
+// The keys in a but not in b
+dbtype_t
+bonsai_difference(pgctx_t *ctx, dbtype_t a, dbtype_t b)
+{
+    assert(ctx->batch);
+    return bonsai_unshare(ctx, _bonsai_difference(ctx, a, b));
+}
+
+/*
+ * Batch support.  Between bonsai_batch_begin and bonsai_batch_commit,
+ * every node allocated by the bonsai routines is marked private.  Private
+ * nodes are updated in place instead of being path-copied again, and the
+ * ones superseded before the tree is published are freed right away
+ * instead of being left for the GC.
+ */
+void
+bonsai_batch_begin(pgctx_t *ctx)
+{
+    ctx->batch = 1;
+}
+
+// Call before publishing the new root.  Clears the private marks on all
+// nodes that are part of the new tree.
+void
+bonsai_batch_prepare(pgctx_t *ctx)
+{
+    unsigned i;
+    dbval_t *np;
+
+    for(i=0; i<ctx->winner.len; i++) {
+        np = dbptr(ctx, ctx->winner.addr[i]);
+        if (np->_pad == BONSAI_PRIVATE)
+            np->_pad = BONSAI_DEAD;
+    }
+    for(i=0; i<ctx->loser.len; i++) {
+        np = dbptr(ctx, ctx->loser.addr[i]);
+        if (np->_pad == BONSAI_PRIVATE)
+            np->_pad = 0;
+    }
+}
+
+// Call after the new root was published.  Frees the nodes which never
+// became visible and retires the replaced published nodes.
+void
+bonsai_batch_commit(pgctx_t *ctx)
+{
+    unsigned i;
+    dbval_t *np;
+    memblock_t *mb;
+
+    for(i=0; i<ctx->winner.len; i++) {
+        np = dbptr(ctx, ctx->winner.addr[i]);
+        mb = (memblock_t*)np - 1;
+        if (np->_pad != BONSAI_DEAD) {
+            db_retire(ctx, ctx->winner.addr[i]);
+        } else if (mb->type == 1) {
+            rcufree(ctx, np);
+        }
+        // Large multinodes come from the pool allocator and are left
+        // for the full GC.
+    }
+    rcureset(ctx);
+    ctx->batch = 0;
+}
+
+// Call instead of bonsai_batch_commit when the batch built a new tree
+// from trees which stay published.  Frees the nodes which never became
+// visible and leaves the nodes of the old trees alone.
+void
+bonsai_batch_release(pgctx_t *ctx)
+{
+    unsigned i;
+    dbval_t *np;
+    memblock_t *mb;
+
+    for(i=0; i<ctx->winner.len; i++) {
+        np = dbptr(ctx, ctx->winner.addr[i]);
+        mb = (memblock_t*)np - 1;
+        if (np->_pad == BONSAI_DEAD && mb->type == 1)
+            rcufree(ctx, np);
+    }
+    rcureset(ctx);
+    ctx->batch = 0;
+}
+
+// Throw away everything allocated since the last publish attempt.
+void
+bonsai_batch_abort(pgctx_t *ctx)
+{
+    // The parentheses get past the rculoser macro defined above
+    (rculoser)(ctx);
+    ctx->batch = 0;
+}
+
 int
 bonsai_find(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value)
 {
+    probe_t p;
     int cmp;
+
+    bonsai_probe(ctx, key, &p);
     while(node.all) {
         node.ptr = dbptr(ctx, node);
-        cmp = dbcmp(ctx, key, node.ptr->key);
+        cmp = bonsai_cmp(ctx, &p, node.ptr);
         if (cmp < 0) {
             node = node.ptr->left;
         } else if (cmp > 0) {
@@ -422,12 +1057,15 @@ bonsai_find(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value)
 dbtype_t
 bonsai_find_node(pgctx_t *ctx, dbtype_t node, dbtype_t key)
 {
+    probe_t p;
     int cmp;
     dbtype_t ret;
+
+    bonsai_probe(ctx, key, &p);
     while(node.all) {
         ret = node;
         node.ptr = dbptr(ctx, node);
-        cmp = dbcmp(ctx, key, node.ptr->key);
+        cmp = bonsai_cmp(ctx, &p, node.ptr);
         if (cmp < 0) {
             node = node.ptr->left;
         } else if (cmp > 0) {
@@ -461,6 +1099,79 @@ bonsai_find_primitive(pgctx_t *ctx, dbtype_t node, dbtag_t type, const void *key
     return DBNULL;
 }
 
+/*
+ * Order statistics.  Every node knows the size of its subtree, so the
+ * position of a node can be found on the way down from the root.
+ */
+
+// The node at position index (counting from 0), or DBNULL
+dbtype_t
+bonsai_select(pgctx_t *ctx, dbtype_t node, int index)
+{
+    dbval_t *np;
+    int ln;
+
+    while(node.all) {
+        np = dbptr(ctx, node);
+        ln = bonsai_size(ctx, np->left);
+        if (index < ln) {
+            node = np->left;
+        } else if (index > ln) {
+            index -= ln + 1;
+            node = np->right;
+        } else {
+            return node;
+        }
+    }
+    return DBNULL;
+}
+
+// The number of keys less than key, which is the position of key if it
+// is in the tree
+int
+bonsai_rank(pgctx_t *ctx, dbtype_t node, dbtype_t key)
+{
+    dbval_t *np;
+    probe_t p;
+    int cmp, rank = 0;
+
+    bonsai_probe(ctx, key, &p);
+    while(node.all) {
+        np = dbptr(ctx, node);
+        cmp = bonsai_cmp(ctx, &p, np);
+        if (cmp < 0) {
+            node = np->left;
+        } else {
+            rank += bonsai_size(ctx, np->left);
+            if (cmp == 0)
+                break;
+            rank++;
+            node = np->right;
+        }
+    }
+    return rank;
+}
+
+// Call cb for the nodes at positions lo up to, but not including, hi.
+// Subtrees outside of the range are skipped without being visited.
+void
+bonsai_slice(pgctx_t *ctx, dbtype_t node, int lo, int hi, bonsaicb_t cb, void *user)
+{
+    dbval_t *np;
+    int ln;
+
+    if (!node.all || lo >= hi)
+        return;
+    np = dbptr(ctx, node);
+    ln = bonsai_size(ctx, np->left);
+    if (lo < ln)
+        bonsai_slice(ctx, np->left, lo, hi, cb, user);
+    if (lo <= ln && ln < hi)
+        cb(ctx, node, user);
+    if (hi > ln+1)
+        bonsai_slice(ctx, np->right, lo-ln-1, hi-ln-1, cb, user);
+}
+
 void
 bonsai_foreach(pgctx_t *ctx, dbtype_t node, bonsaicb_t cb, void *user)
 {
@@ -473,6 +1184,252 @@ bonsai_foreach(pgctx_t *ctx, dbtype_t node, bonsaicb_t cb, void *user)
     }
 }
 
+/*
+ * Cursors.  The path from the root to the current node is kept in the
+ * cursor, so stepping to a neighbour only walks the nodes in between.
+ * Moving never writes into path[0..depth], so a step can be undone by
+ * restoring depth and after.
+ */
+static inline void
+cursor_push(bonsai_cursor_t *c, dbtype_t node)
+{
+    assert(c->depth < BONSAI_MAXDEPTH-1);
+    c->path[++c->depth] = node;
+}
+
+// Move the gap past the next item in the direction fwd, and return it
+static int
+cursor_step(pgctx_t *ctx, bonsai_cursor_t *c, int fwd, dbtype_t *node)
+{
+    dbval_t *np, *pp;
+    dbtype_t child;
+    int d;
+
+    if (c->depth < 0)
+        return -1;
+    if (c->after != fwd) {
+        // The item is the current node itself
+        c->after = fwd;
+        *node = c->path[c->depth];
+        return 0;
+    }
+    np = dbptr(ctx, c->path[c->depth]);
+    child = fwd ? np->right : np->left;
+    if (child.all) {
+        // The neighbour is the innermost node of the subtree on that side
+        while(child.all) {
+            cursor_push(c, child);
+            np = dbptr(ctx, child);
+            child = fwd ? np->left : np->right;
+        }
+    } else {
+        // Otherwise it is the first ancestor we approach from the other side
+        for(d=c->depth; d>0; d--) {
+            pp = dbptr(ctx, c->path[d-1]);
+            child = fwd ? pp->left : pp->right;
+            if (child.all == c->path[d].all)
+                break;
+        }
+        if (d == 0)
+            return -1;
+        c->depth = d-1;
+    }
+    *node = c->path[c->depth];
+    return 0;
+}
+
+static inline int
+cursor_below(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t node)
+{
+    dbval_t *np = dbptr(ctx, node);
+    return c->haslo && dbcmp(ctx, np->key, c->lo) < c->loex;
+}
+
+static inline int
+cursor_above(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t node)
+{
+    dbval_t *np = dbptr(ctx, node);
+    return c->hashi && dbcmp(ctx, np->key, c->hi) > -c->hiex;
+}
+
+// Put the gap before the first key >= key, or > key if excl
+static void
+cursor_ge(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t key, int excl)
+{
+    dbtype_t node = c->root;
+    dbval_t *np;
+    probe_t p;
+    int cmp, cand = -1;
+
+    bonsai_probe(ctx, key, &p);
+    c->depth = -1;
+    while(node.all) {
+        cursor_push(c, node);
+        np = dbptr(ctx, node);
+        cmp = -bonsai_cmp(ctx, &p, np);
+        if (cmp > 0 || (cmp == 0 && !excl)) {
+            cand = c->depth;
+            node = np->left;
+        } else {
+            node = np->right;
+        }
+    }
+    // Without a candidate, every key is smaller and the path ends at the
+    // largest one.
+    c->after = cand < 0;
+    if (cand >= 0)
+        c->depth = cand;
+}
+
+// Put the gap after the last key <= key, or < key if excl
+static void
+cursor_le(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t key, int excl)
+{
+    dbtype_t node = c->root;
+    dbval_t *np;
+    probe_t p;
+    int cmp, cand = -1;
+
+    bonsai_probe(ctx, key, &p);
+    c->depth = -1;
+    while(node.all) {
+        cursor_push(c, node);
+        np = dbptr(ctx, node);
+        cmp = -bonsai_cmp(ctx, &p, np);
+        if (cmp < 0 || (cmp == 0 && !excl)) {
+            cand = c->depth;
+            node = np->right;
+        } else {
+            node = np->left;
+        }
+    }
+    c->after = cand >= 0;
+    if (cand >= 0)
+        c->depth = cand;
+}
+
+// Put the gap at one end of the tree
+static void
+cursor_end(pgctx_t *ctx, bonsai_cursor_t *c, int fwd)
+{
+    dbtype_t node = c->root;
+    dbval_t *np;
+
+    c->depth = -1;
+    while(node.all) {
+        cursor_push(c, node);
+        np = dbptr(ctx, node);
+        node = fwd ? np->right : np->left;
+    }
+    c->after = fwd;
+}
+
+void
+bonsai_cursor_init(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t root)
+{
+    c->root = root;
+    c->haslo = c->hashi = 0;
+    c->loex = c->hiex = 0;
+    c->lo = c->hi = DBNULL;
+    db_pin(ctx);
+    bonsai_cursor_first(ctx, c);
+}
+
+void
+bonsai_cursor_close(pgctx_t *ctx, bonsai_cursor_t *c)
+{
+    c->depth = -1;
+    db_unpin(ctx);
+}
+
+// Limit the cursor to lo <= key <= hi (< if exclusive).  A NULL bound
+// leaves that side open.  The cursor moves to the start of the range.
+void
+bonsai_cursor_range(pgctx_t *ctx, bonsai_cursor_t *c, const dbtype_t *lo, int loex, const dbtype_t *hi, int hiex)
+{
+    c->haslo = lo != NULL;
+    c->hashi = hi != NULL;
+    c->lo = lo ? *lo : DBNULL;
+    c->hi = hi ? *hi : DBNULL;
+    c->loex = !!loex;
+    c->hiex = !!hiex;
+    bonsai_cursor_first(ctx, c);
+}
+
+void
+bonsai_cursor_first(pgctx_t *ctx, bonsai_cursor_t *c)
+{
+    if (c->haslo)
+        cursor_ge(ctx, c, c->lo, c->loex);
+    else
+        cursor_end(ctx, c, 0);
+}
+
+void
+bonsai_cursor_last(pgctx_t *ctx, bonsai_cursor_t *c)
+{
+    if (c->hashi)
+        cursor_le(ctx, c, c->hi, c->hiex);
+    else
+        cursor_end(ctx, c, 1);
+}
+
+// Place the cursor so that next returns the first key >= key (db_GE) or
+// > key (db_GT), or so that prev returns the last key <= key (db_LE) or
+// < key (db_LT).  db_EQ and db_NE count as db_GE.  A gap outside of the
+// range is moved to the nearest end of it.
+void
+bonsai_cursor_seek(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t key, relop_t op)
+{
+    dbtype_t node;
+    int depth, after;
+
+    if (op == db_LT || op == db_LE)
+        cursor_le(ctx, c, key, op == db_LT);
+    else
+        cursor_ge(ctx, c, key, op == db_GT);
+
+    depth = c->depth; after = c->after;
+    if (cursor_step(ctx, c, 1, &node) == 0 && cursor_below(ctx, c, node)) {
+        bonsai_cursor_first(ctx, c);
+        return;
+    }
+    c->depth = depth; c->after = after;
+    if (cursor_step(ctx, c, 0, &node) == 0 && cursor_above(ctx, c, node)) {
+        bonsai_cursor_last(ctx, c);
+        return;
+    }
+    c->depth = depth; c->after = after;
+}
+
+int
+bonsai_cursor_next(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t *node)
+{
+    int depth = c->depth, after = c->after;
+
+    if (cursor_step(ctx, c, 1, node) < 0)
+        return -1;
+    if (cursor_above(ctx, c, *node)) {
+        c->depth = depth; c->after = after;
+        return -1;
+    }
+    return 0;
+}
+
+int
+bonsai_cursor_prev(pgctx_t *ctx, bonsai_cursor_t *c, dbtype_t *node)
+{
+    int depth = c->depth, after = c->after;
+
+    if (cursor_step(ctx, c, 0, node) < 0)
+        return -1;
+    if (cursor_below(ctx, c, *node)) {
+        c->depth = depth; c->after = after;
+        return -1;
+    }
+    return 0;
+}
+
 void
 bonsai_show(pgctx_t *ctx, dbtype_t node, int depth)
 {
@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <string.h>
+#include <pongo/dbmem.h>
+#include <pongo/context.h>
+#include <pongo/dbtypes.h>
+#include <pongo/btree.h>
+
+/*
+ * Copy-on-write B+-tree, the tree under a BTreeCollection.
+ *
+ * As with the bonsai tree, published nodes are never modified.  An update
+ * copies the nodes on the path from the root to the leaf it changes and
+ * returns the new root, for the caller to publish with synchronize.  New
+ * nodes are pushed on ctx->loser and replaced ones on ctx->winner, and
+ * nodes made while ctx->batch is set carry the bonsai batch marks, so the
+ * RCU loops and bonsai_batch_* work unchanged.
+ *
+ * A node holds up to BTREE_ORDER entries, so a lookup visits a handful of
+ * nodes where the bonsai tree visits one node per key compared, and an
+ * update copies as many.  Nodes other than the root have at least
+ * BTREE_MIN entries.
+ */
+#define BTREE_MIN (BTREE_ORDER/2)
+
+// Entries of up to two nodes, gathered on the stack to build new nodes
+typedef struct {
+    int n;
+    dbtype_t key[2*BTREE_ORDER];
+    dbtype_t val[2*BTREE_ORDER];
+} btentries_t;
+
+int
+btree_size(pgctx_t *ctx, dbtype_t node)
+{
+    dbbtree_t *np;
+    if (node.all == 0)
+        return 0;
+    np = dbptr(ctx, node);
+    return np->size;
+}
+
+// Compare key, or the primitive pkey of type ptype if pkey is set, with
+// a key in the tree.  dbcmp_primitive only takes a dbtype as its first
+// argument, so the sense of that compare is inverted.
+static inline int
+btree_cmp(pgctx_t *ctx, dbtype_t key, dbtag_t ptype, const void *pkey, dbtype_t nodekey)
+{
+    if (pkey)
+        return -dbcmp_primitive(ctx, nodekey, ptype, pkey);
+    return dbcmp(ctx, key, nodekey);
+}
+
+// Index of the child of an inner node which covers key
+static int
+btree_child(pgctx_t *ctx, dbbtree_t *np, dbtype_t key, dbtag_t ptype, const void *pkey)
+{
+    int lo = 1, hi = np->n, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if (btree_cmp(ctx, key, ptype, pkey, np->key[mid]) >= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+// Index of key in a leaf, or of the first item after it if it isn't there
+static int
+btree_slot(pgctx_t *ctx, dbbtree_t *np, dbtype_t key, dbtag_t ptype, const void *pkey, int *found)
+{
+    int lo = 0, hi = np->n, mid, cmp;
+
+    *found = 0;
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = btree_cmp(ctx, key, ptype, pkey, np->key[mid]);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static dbbtree_t *
+btree_leaf(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtag_t ptype, const void *pkey)
+{
+    dbbtree_t *np;
+
+    while(node.all) {
+        np = dbptr(ctx, node);
+        if (np->leaf)
+            return np;
+        node = np->val[btree_child(ctx, np, key, ptype, pkey)];
+    }
+    return NULL;
+}
+
+static void
+btree_gather(dbbtree_t *np, btentries_t *e)
+{
+    memcpy(e->key + e->n, np->key, np->n * sizeof(dbtype_t));
+    memcpy(e->val + e->n, np->val, np->n * sizeof(dbtype_t));
+    e->n += np->n;
+}
+
+static void
+btree_open(btentries_t *e, int i)
+{
+    memmove(e->key + i + 1, e->key + i, (e->n - i) * sizeof(dbtype_t));
+    memmove(e->val + i + 1, e->val + i, (e->n - i) * sizeof(dbtype_t));
+    e->n++;
+}
+
+static void
+btree_close(btentries_t *e, int i)
+{
+    e->n--;
+    memmove(e->key + i, e->key + i + 1, (e->n - i) * sizeof(dbtype_t));
+    memmove(e->val + i, e->val + i + 1, (e->n - i) * sizeof(dbtype_t));
+}
+
+// A node which is no longer part of the tree being built
+static inline void
+btree_drop(pgctx_t *ctx, dbtype_t node)
+{
+    rcupush(&ctx->winner, node);
+}
+
+// Make a node out of n entries of e starting at first.  A node private to
+// the current batch is updated in place, otherwise a new node is made and
+// orig, if given, is replaced by it.
+static dbtype_t
+btree_make(pgctx_t *ctx, dbtype_t orig, int leaf, btentries_t *e, int first, int n)
+{
+    dbbtree_t *np = NULL;
+    dbtype_t node;
+    uint64_t size;
+    int i;
+
+    if (orig.all) {
+        np = dbptr(ctx, orig);
+        if (np->_pad != BONSAI_PRIVATE) {
+            btree_drop(ctx, orig);
+            np = NULL;
+        }
+    }
+    if (np) {
+        node = orig;
+    } else {
+        np = dballoc(ctx, sizeof(dbbtree_t));
+        np->type = _BTreeNode;
+        np->_pad = ctx->batch ? BONSAI_PRIVATE : 0;
+        node = dboffset(ctx, np);
+        rcupush(&ctx->loser, node);
+    }
+    np->leaf = leaf;
+    np->n = n;
+    memcpy(np->key, e->key + first, n * sizeof(dbtype_t));
+    memcpy(np->val, e->val + first, n * sizeof(dbtype_t));
+    if (leaf) {
+        size = n;
+    } else {
+        for(size=i=0; i<n; i++)
+            size += btree_size(ctx, np->val[i]);
+    }
+    np->size = size;
+    return node;
+}
+
+// Insert into the subtree at node.  Returns the new subtree, and in
+// *right the new sibling to its right if the node had to be split.
+static dbtype_t
+_btree_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value, int insert_or_fail, dbtype_t *right)
+{
+    dbbtree_t *np = dbptr(ctx, node);
+    dbbtree_t *sp;
+    dbtype_t child, split = DBNULL;
+    btentries_t e;
+    int i, found, half;
+
+    *right = DBNULL;
+    e.n = 0;
+    if (np->leaf) {
+        i = btree_slot(ctx, np, key, 0, NULL, &found);
+        if (found && insert_or_fail) {
+            node.type = Error;
+            return node;
+        }
+        btree_gather(np, &e);
+        if (!found) {
+            btree_open(&e, i);
+            e.key[i] = key;
+        }
+        e.val[i] = value;
+    } else {
+        i = btree_child(ctx, np, key, 0, NULL);
+        child = _btree_insert(ctx, np->val[i], key, value, insert_or_fail, &split);
+        if (child.type == Error)
+            return child;
+        btree_gather(np, &e);
+        e.val[i] = child;
+        if (split.all) {
+            sp = dbptr(ctx, split);
+            btree_open(&e, i+1);
+            e.key[i+1] = sp->key[0];
+            e.val[i+1] = split;
+        }
+    }
+    if (e.n <= BTREE_ORDER)
+        return btree_make(ctx, node, np->leaf, &e, 0, e.n);
+
+    half = e.n / 2;
+    *right = btree_make(ctx, DBNULL, np->leaf, &e, half, e.n - half);
+    return btree_make(ctx, node, np->leaf, &e, 0, half);
+}
+
+dbtype_t
+btree_insert(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t value, int insert_or_fail)
+{
+    dbtype_t right;
+    dbbtree_t *lp, *rp;
+    btentries_t e;
+
+    if (!node.all) {
+        e.n = 1;
+        e.key[0] = key;
+        e.val[0] = value;
+        return btree_make(ctx, DBNULL, 1, &e, 0, 1);
+    }
+    node = _btree_insert(ctx, node, key, value, insert_or_fail, &right);
+    if (node.type == Error || !right.all)
+        return node;
+
+    // The root was split, so the tree grows by one level
+    lp = dbptr(ctx, node);
+    rp = dbptr(ctx, right);
+    e.n = 2;
+    e.key[0] = lp->key[0]; e.val[0] = node;
+    e.key[1] = rp->key[0]; e.val[1] = right;
+    return btree_make(ctx, DBNULL, 0, &e, 0, 2);
+}
+
+// Delete key from the subtree at node.  Returns the new subtree, which
+// may be left with fewer than BTREE_MIN entries, or Error if key isn't
+// in the tree.
+static dbtype_t
+_btree_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *valout)
+{
+    dbbtree_t *np = dbptr(ctx, node);
+    dbbtree_t *cp, *sp;
+    dbtype_t child, sibling, a, b;
+    btentries_t e, m;
+    int i, j, l, found, half, leaf;
+
+    e.n = 0;
+    if (np->leaf) {
+        i = btree_slot(ctx, np, key, 0, NULL, &found);
+        if (!found) {
+            node.type = Error;
+            return node;
+        }
+        if (valout) *valout = np->val[i];
+        btree_gather(np, &e);
+        btree_close(&e, i);
+        return btree_make(ctx, node, 1, &e, 0, e.n);
+    }
+
+    i = btree_child(ctx, np, key, 0, NULL);
+    child = _btree_delete(ctx, np->val[i], key, valout);
+    if (child.type == Error)
+        return child;
+    cp = dbptr(ctx, child);
+    btree_gather(np, &e);
+    if (cp->n >= BTREE_MIN) {
+        e.val[i] = child;
+        return btree_make(ctx, node, 0, &e, 0, e.n);
+    }
+
+    // The child is too small.  Merge it with a sibling, or if they don't
+    // fit in one node, even out their entries.
+    j = (i+1 < np->n) ? i+1 : i-1;
+    l = (i < j) ? i : j;
+    sibling = np->val[j];
+    sp = dbptr(ctx, sibling);
+    leaf = cp->leaf;
+    m.n = 0;
+    btree_gather(l == i ? cp : sp, &m);
+    half = m.n;
+    btree_gather(l == i ? sp : cp, &m);
+    // The first key of an inner node is never compared and may be stale.
+    // The parent knows the lower bound of the right node.
+    if (!leaf && half < m.n)
+        m.key[half] = np->key[l+1];
+
+    if (m.n <= BTREE_ORDER) {
+        a = btree_make(ctx, child, leaf, &m, 0, m.n);
+        btree_drop(ctx, sibling);
+        e.val[l] = a;
+        btree_close(&e, l+1);
+    } else {
+        half = m.n / 2;
+        a = btree_make(ctx, child, leaf, &m, 0, half);
+        b = btree_make(ctx, sibling, leaf, &m, half, m.n - half);
+        e.val[l] = a;
+        e.key[l+1] = m.key[half];
+        e.val[l+1] = b;
+    }
+    return btree_make(ctx, node, 0, &e, 0, e.n);
+}
+
+dbtype_t
+btree_delete(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *valout)
+{
+    dbbtree_t *np;
+    dbtype_t ret;
+
+    if (!node.all) {
+        ret = DBNULL;
+        ret.type = Error;
+        return ret;
+    }
+    ret = _btree_delete(ctx, node, key, valout);
+    if (ret.type == Error)
+        return ret;
+
+    // Shrink the tree if the root has only one child or nothing left
+    np = dbptr(ctx, ret);
+    if (np->n == 0) {
+        btree_drop(ctx, ret);
+        return DBNULL;
+    }
+    if (!np->leaf && np->n == 1) {
+        btree_drop(ctx, ret);
+        return np->val[0];
+    }
+    return ret;
+}
+
+int
+btree_find(pgctx_t *ctx, dbtype_t node, dbtype_t key, dbtype_t *value)
+{
+    dbbtree_t *np;
+    int i, found;
+
+    np = btree_leaf(ctx, node, key, 0, NULL);
+    if (!np)
+        return -1;
+    i = btree_slot(ctx, np, key, 0, NULL, &found);
+    if (!found)
+        return -1;
+    if (value) *value = np->val[i];
+    return 0;
+}
+
+dbtype_t
+btree_find_primitive(pgctx_t *ctx, dbtype_t node, dbtag_t type, const void *key)
+{
+    dbbtree_t *np;
+    int i, found;
+
+    np = btree_leaf(ctx, node, DBNULL, type, key);
+    if (!np)
+        return DBNULL;
+    i = btree_slot(ctx, np, DBNULL, type, key, &found);
+    return found ? np->val[i] : DBNULL;
+}
+
+void
+btree_foreach(pgctx_t *ctx, dbtype_t node, btreecb_t cb, void *user)
+{
+    dbbtree_t *np;
+    int i;
+
+    if (!node.all)
+        return;
+    np = dbptr(ctx, node);
+    for(i=0; i<np->n; i++) {
+        if (np->leaf)
+            cb(ctx, np->key[i], np->val[i], user);
+        else
+            btree_foreach(ctx, np->val[i], cb, user);
+    }
+}
+
+/*
+ * Order statistics.  An inner node has no count per child, but each child
+ * knows its own size, so positions are found by summing the sizes of the
+ * children skipped over on the way down.
+ */
+int
+btree_select(pgctx_t *ctx, dbtype_t node, int index, dbtype_t *key, dbtype_t *value)
+{
+    dbbtree_t *np;
+    int i, sz;
+
+    if (index < 0 || index >= btree_size(ctx, node))
+        return -1;
+    for(;;) {
+        np = dbptr(ctx, node);
+        if (np->leaf)
+            break;
+        for(i=0; i<np->n-1; i++) {
+            sz = btree_size(ctx, np->val[i]);
+            if (index < sz)
+                break;
+            index -= sz;
+        }
+        node = np->val[i];
+    }
+    if (key) *key = np->key[index];
+    if (value) *value = np->val[index];
+    return 0;
+}
+
+int
+btree_rank(pgctx_t *ctx, dbtype_t node, dbtype_t key)
+{
+    dbbtree_t *np;
+    int i, c, found, rank = 0;
+
+    while(node.all) {
+        np = dbptr(ctx, node);
+        if (np->leaf)
+            return rank + btree_slot(ctx, np, key, 0, NULL, &found);
+        c = btree_child(ctx, np, key, 0, NULL);
+        for(i=0; i<c; i++)
+            rank += btree_size(ctx, np->val[i]);
+        node = np->val[c];
+    }
+    return rank;
+}
+
+void
+btree_slice(pgctx_t *ctx, dbtype_t node, int lo, int hi, btreecb_t cb, void *user)
+{
+    dbbtree_t *np;
+    int i, sz;
+
+    if (!node.all || lo >= hi)
+        return;
+    np = dbptr(ctx, node);
+    for(i=0; i<np->n && hi > 0; i++) {
+        if (np->leaf) {
+            if (lo <= 0)
+                cb(ctx, np->key[i], np->val[i], user);
+            sz = 1;
+        } else {
+            sz = btree_size(ctx, np->val[i]);
+            if (lo < sz)
+                btree_slice(ctx, np->val[i], lo, hi, cb, user);
+        }
+        lo -= sz;
+        hi -= sz;
+    }
+}
+
+void
+btree_show(pgctx_t *ctx, dbtype_t node, int depth)
+{
+    char buf1[80], buf2[80];
+    dbbtree_t *np;
+    int i;
+
+    if (!node.all)
+        return;
+
+    np = dbptr(ctx, node);
+    printf("%*s[%s n=%u size=%" PRIu64 "]\n", depth*2, "",
+            np->leaf ? "leaf" : "inner", np->n, np->size);
+    for(i=0; i<np->n; i++) {
+        if (np->leaf) {
+            printf("%*s%s=>%s\n", depth*2+2, "",
+                    dbprint(ctx, np->key[i], buf1, sizeof(buf1)),
+                    dbprint(ctx, np->val[i], buf2, sizeof(buf2)));
+        } else {
+            btree_show(ctx, np->val[i], depth+1);
+        }
+    }
+}
+
+/*
+ * Iteration.  Like a bonsai cursor, the iterator sits in a gap between
+ * two items:  the position in the leaf at the bottom of the stack is the
+ * index of the item after the gap.  btree_iter_init puts the gap before
+ * the first item, or with a key, before the first item not less than the
+ * key (greater than it if exclusive is set).  btree_iter_last puts it
+ * after the last item.  btree_iter_next and btree_iter_prev return the
+ * item after or before the gap and step over it, or return -1 at the end
+ * of the tree without moving.
+ */
+void
+btree_iter_init(pgctx_t *ctx, btree_iter_t *it, dbtype_t node, dbtype_t key, int exclusive)
+{
+    dbbtree_t *np;
+    int i, found;
+
+    it->depth = -1;
+    while(node.all) {
+        np = dbptr(ctx, node);
+        it->node[++it->depth] = node;
+        if (np->leaf) {
+            i = 0;
+            if (key.all) {
+                i = btree_slot(ctx, np, key, 0, NULL, &found);
+                if (found && exclusive)
+                    i++;
+            }
+            it->pos[it->depth] = i;
+            break;
+        }
+        i = key.all ? btree_child(ctx, np, key, 0, NULL) : 0;
+        it->pos[it->depth] = i;
+        node = np->val[i];
+    }
+}
+
+void
+btree_iter_last(pgctx_t *ctx, btree_iter_t *it, dbtype_t node)
+{
+    dbbtree_t *np;
+
+    it->depth = -1;
+    while(node.all) {
+        np = dbptr(ctx, node);
+        it->node[++it->depth] = node;
+        it->pos[it->depth] = np->leaf ? np->n : np->n - 1;
+        if (np->leaf)
+            break;
+        node = np->val[np->n - 1];
+    }
+}
+
+// Move the gap to the neighbouring leaf in the direction fwd
+static int
+btree_iter_leaf(pgctx_t *ctx, btree_iter_t *it, int fwd)
+{
+    dbbtree_t *np;
+    int d;
+
+    // Find the lowest inner node with a child left on that side
+    for(d=it->depth-1; d>=0; d--) {
+        np = dbptr(ctx, it->node[d]);
+        if (fwd ? it->pos[d] < np->n-1 : it->pos[d] > 0)
+            break;
+    }
+    if (d < 0)
+        return -1;
+    it->pos[d] += fwd ? 1 : -1;
+    // and go down the near side of that child
+    for(; d < it->depth; d++) {
+        np = dbptr(ctx, it->node[d]);
+        it->node[d+1] = np->val[it->pos[d]];
+        np = dbptr(ctx, it->node[d+1]);
+        if (np->leaf)
+            it->pos[d+1] = fwd ? 0 : np->n;
+        else
+            it->pos[d+1] = fwd ? 0 : np->n - 1;
+    }
+    return 0;
+}
+
+int
+btree_iter_next(pgctx_t *ctx, btree_iter_t *it, dbtype_t *key, dbtype_t *value)
+{
+    dbbtree_t *np;
+    int d = it->depth;
+
+    if (d < 0)
+        return -1;
+    np = dbptr(ctx, it->node[d]);
+    // Leaves are never empty, so one step over is enough
+    if (it->pos[d] >= np->n) {
+        if (btree_iter_leaf(ctx, it, 1) < 0)
+            return -1;
+        np = dbptr(ctx, it->node[d]);
+    }
+    if (key) *key = np->key[it->pos[d]];
+    if (value) *value = np->val[it->pos[d]];
+    it->pos[d]++;
+    return 0;
+}
+
+int
+btree_iter_prev(pgctx_t *ctx, btree_iter_t *it, dbtype_t *key, dbtype_t *value)
+{
+    dbbtree_t *np;
+    int d = it->depth;
+
+    if (d < 0)
+        return -1;
+    np = dbptr(ctx, it->node[d]);
+    if (it->pos[d] == 0) {
+        if (btree_iter_leaf(ctx, it, 0) < 0)
+            return -1;
+        np = dbptr(ctx, it->node[d]);
+    }
+    it->pos[d]--;
+    if (key) *key = np->key[it->pos[d]];
+    if (value) *value = np->val[it->pos[d]];
+    return 0;
+}
+
+// vim: ts=4 sts=4 sw=4 expandtab:
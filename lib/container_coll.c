@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <pongo/dbtypes.h>
 #include <pongo/bonsai.h>
+#include <pongo/btree.h>
 #include <pongo/dbmem.h>
 #include <pongo/misc.h>
 #include <pongo/log.h>
@@ -23,7 +24,7 @@ int put_id_helper(pgctx_t *ctx, dbtype_t *key, dbtype_t value)
             *key = ctx->newkey(ctx, value);
             dbobject_setitem(ctx, value, id, *key, 0);
         }
-    } else if (ptr->type == Collection) {
+    } else if (ptr->type == Collection || ptr->type == BTreeCollection) {
         if (dbcollection_getitem(ctx, value, id, key) < 0) {
             *key = ctx->newkey(ctx, value);
             dbcollection_setitem(ctx, value, id, *key, 0);
@@ -38,13 +39,13 @@ int put_id_helper(pgctx_t *ctx, dbtype_t *key, dbtype_t value)
 int dbcollection_len(pgctx_t *ctx, dbtype_t obj)
 {
     obj.ptr = dbptr(ctx, obj);
-    return bonsai_size(ctx, obj.ptr->obj);
+    return tree_size(ctx, obj.ptr->type, obj.ptr->obj);
 }
 
 int dbcollection_contains(pgctx_t *ctx, dbtype_t obj, dbtype_t key)
 {
     obj.ptr = dbptr(ctx, obj);
-    return bonsai_find(ctx, obj.ptr->obj, key, NULL) == 0;
+    return tree_find(ctx, obj.ptr->type, obj.ptr->obj, key, NULL) == 0;
 }
 
 dbtype_t dbcollection_new(pgctx_t *ctx, int multi)
@@ -56,12 +57,25 @@ dbtype_t dbcollection_new(pgctx_t *ctx, int multi)
     return dboffset(ctx, obj.ptr);
 }
 
+// A collection kept in a B-tree (see btree.c) instead of a bonsai tree
+dbtype_t dbcollection_new_btree(pgctx_t *ctx)
+{
+    dbtype_t obj;
+    obj.ptr = dballoc(ctx, sizeof(dbcollection_t));
+    obj.ptr->type = BTreeCollection;
+    obj.ptr->obj = DBNULL;
+    return dboffset(ctx, obj.ptr);
+}
+
 int dbcollection_setitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t value, int sync)
 {
     dbtype_t node, newnode;
 
     obj.ptr = dbptr(ctx, obj);
-    assert(obj.ptr->type == Collection || obj.ptr->type == MultiCollection);
+    assert(obj.ptr->type == Collection || obj.ptr->type == MultiCollection ||
+           obj.ptr->type == BTreeCollection);
+    if (obj.ptr->frozen)
+        return -1;
 
     if (sync & PUT_ID) {
         if (put_id_helper(ctx, &key, value) < 0)
@@ -74,8 +88,8 @@ int dbcollection_setitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t valu
         // Read-Copy-Update loop for safe modify
         node = obj.ptr->obj;
         rculoser(ctx);
-        if (obj.ptr->type == Collection) {
-            newnode = bonsai_insert(ctx, node, key, value, sync & SET_OR_FAIL);
+        if (obj.ptr->type != MultiCollection) {
+            newnode = tree_insert(ctx, obj.ptr->type, node, key, value, sync & SET_OR_FAIL);
         } else {
             newnode = bonsai_multi_insert(ctx, node, key, value);
         }
@@ -83,20 +97,90 @@ int dbcollection_setitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t valu
             rcureset(ctx);
             return -1;
         }
+        // The key already held this value
+        if (newnode.all == node.all)
+            break;
+    } while(!synchronize(ctx, sync & SYNC_MASK, &obj.ptr->obj, node, newnode));
+    rcuwinner(ctx);
+    return 0;
+}
+
+int dbcollection_cas(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t expected, dbtype_t value, int sync)
+{
+    dbtype_t node, newnode, cur;
+
+    obj.ptr = dbptr(ctx, obj);
+    if (obj.ptr->type != Collection && obj.ptr->type != BTreeCollection)
+        return CAS_ERR_TYPE;
+    if (obj.ptr->frozen)
+        return CAS_ERR_FROZEN;
+
+    assert(ctx->winner.len == 0);
+    assert(ctx->loser.len == 0);
+    do {
+        // Read-Copy-Update loop for safe modify.  The compare is done
+        // against the same snapshot of the tree that synchronize checks,
+        // so the swap only happens if nobody changed the tree in between.
+        node = obj.ptr->obj;
+        rculoser(ctx);
+        if (tree_find(ctx, obj.ptr->type, node, key, &cur) < 0) {
+            rcureset(ctx);
+            return CAS_ERR_KEY;
+        }
+        if (dbcmp(ctx, cur, expected) != 0) {
+            rcureset(ctx);
+            return 1;
+        }
+        newnode = tree_insert(ctx, obj.ptr->type, node, key, value, 0);
     } while(!synchronize(ctx, sync & SYNC_MASK, &obj.ptr->obj, node, newnode));
     rcuwinner(ctx);
     return 0;
 }
 
+int dbcollection_incr(pgctx_t *ctx, dbtype_t obj, dbtype_t key, int64_t delta, dbtype_t *value, int sync)
+{
+    dbtype_t node, newnode, cur, result;
+    int r;
+
+    obj.ptr = dbptr(ctx, obj);
+    if (obj.ptr->type != Collection && obj.ptr->type != BTreeCollection)
+        return CAS_ERR_TYPE;
+    if (obj.ptr->frozen)
+        return CAS_ERR_FROZEN;
+
+    assert(ctx->winner.len == 0);
+    assert(ctx->loser.len == 0);
+    do {
+        // Read-Copy-Update loop for safe modify.  A missing key counts
+        // as zero.
+        node = obj.ptr->obj;
+        rculoser(ctx);
+        if (tree_find(ctx, obj.ptr->type, node, key, &cur) < 0)
+            cur = dbint_new(ctx, 0);
+        if ((r = dbint_add(ctx, cur, delta, &result)) < 0) {
+            rcureset(ctx);
+            return r;
+        }
+        newnode = tree_insert(ctx, obj.ptr->type, node, key, result, 0);
+    } while(!synchronize(ctx, sync & SYNC_MASK, &obj.ptr->obj, node, newnode));
+    rcuwinner(ctx);
+    if (value) *value = result;
+    return 0;
+}
+
 int dbcollection_getitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value)
 {
     obj.ptr = dbptr(ctx, obj);
-    return bonsai_find(ctx, obj.ptr->obj, key, value);
+    return tree_find(ctx, obj.ptr->type, obj.ptr->obj, key, value);
 }
 
+// The B-tree has no node per key, so for a BTreeCollection this returns
+// the value itself.  to_python with TP_NODEVAL gives the same result.
 int dbcollection_getnode(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value)
 {
     obj.ptr = dbptr(ctx, obj);
+    if (obj.ptr->type == BTreeCollection)
+        return btree_find(ctx, obj.ptr->obj, key, value);
     *value = bonsai_find_node(ctx, obj.ptr->obj, key);
     return value->all ? 0 : -1;
 }
@@ -104,37 +188,327 @@ int dbcollection_getnode(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *val
 int dbcollection_getstr(pgctx_t *ctx, dbtype_t obj, const char *key, dbtype_t *value)
 {
     obj.ptr = dbptr(ctx, obj);
-    *value = bonsai_find_primitive(ctx, obj.ptr->obj, String, key);
+    if (obj.ptr->type == BTreeCollection)
+        *value = btree_find_primitive(ctx, obj.ptr->obj, String, key);
+    else
+        *value = bonsai_find_primitive(ctx, obj.ptr->obj, String, key);
     return 0;
 }
 
-int dbcollection_update(pgctx_t *ctx, dbtype_t obj, int n, updatecb_t elem, void *user, int sync)
+typedef struct {
+    multi_t op;
+    dbtype_t key, value;
+} batchop_t;
+
+// Stable merge sort of the batch by key, so that when the same key
+// appears more than once, the last operation on it still wins.
+static void _mergesort(pgctx_t *ctx, batchop_t *ops, batchop_t *tmp, int n)
+{
+    int i, j, k, mid;
+    if (n < 2)
+        return;
+    mid = n/2;
+    _mergesort(ctx, ops, tmp, mid);
+    _mergesort(ctx, ops+mid, tmp, n-mid);
+    for(i=0, j=mid, k=0; i<mid && j<n; k++) {
+        if (dbcmp(ctx, ops[j].key, ops[i].key) < 0) {
+            tmp[k] = ops[j++];
+        } else {
+            tmp[k] = ops[i++];
+        }
+    }
+    while(i<mid) tmp[k++] = ops[i++];
+    while(j<n) tmp[k++] = ops[j++];
+    memcpy(ops, tmp, n*sizeof(*ops));
+}
+
+typedef struct {
+    dbtype_t *keys, *values;
+    int len;
+} sorted_t;
+
+// Collect the items of the old tree in order.  Every node of the old tree
+// is replaced by the rebuild, so each one goes on the winner list.
+static void sorted_helper(pgctx_t *ctx, dbtype_t node, void *user)
+{
+    sorted_t *s = (sorted_t*)user;
+    dbval_t *np = dbptr(ctx, node);
+
+    s->keys[s->len] = np->key;
+    s->values[s->len] = np->value;
+    s->len++;
+    rcupush(&ctx->winner, node);
+}
+
+// Merge the sorted, distinct keys of a batch into the items of the tree
+// and build a new balanced tree from the result.  The tree is read once
+// and every item costs one allocation, instead of a path copy per key.
+static dbtype_t dbcollection_rebuild(pgctx_t *ctx, dbtype_t node, sorted_t *batch)
+{
+    sorted_t old, new;
+    int i, j, cmp, n = batch->len;
+    dbtype_t ret;
+
+    old.len = new.len = 0;
+    i = bonsai_size(ctx, node);
+    old.keys = malloc(i * sizeof(dbtype_t));
+    old.values = malloc(i * sizeof(dbtype_t));
+    new.keys = malloc((i+n) * sizeof(dbtype_t));
+    new.values = malloc((i+n) * sizeof(dbtype_t));
+    bonsai_foreach(ctx, node, sorted_helper, &old);
+
+    for(i=j=0; i<old.len || j<n; new.len++) {
+        if (i == old.len) {
+            cmp = 1;
+        } else if (j == n) {
+            cmp = -1;
+        } else {
+            cmp = dbcmp(ctx, old.keys[i], batch->keys[j]);
+        }
+        if (cmp < 0) {
+            new.keys[new.len] = old.keys[i];
+            new.values[new.len] = old.values[i];
+            i++;
+        } else {
+            new.keys[new.len] = batch->keys[j];
+            new.values[new.len] = batch->values[j];
+            if (cmp == 0) i++;
+            j++;
+        }
+    }
+    ret = bonsai_build_sorted(ctx, new.keys, new.values, new.len);
+    free(old.keys); free(old.values);
+    free(new.keys); free(new.values);
+    return ret;
+}
+
+// Reduce a sorted batch of set operations to its distinct keys.  The sort
+// is stable, so the last of a run of equal keys is the one that counts.
+static void dbcollection_distinct(pgctx_t *ctx, int n, batchop_t *ops, sorted_t *batch)
 {
     int i;
-    dbtype_t key, value;
 
+    batch->keys = malloc(n * sizeof(dbtype_t));
+    batch->values = malloc(n * sizeof(dbtype_t));
+    batch->len = 0;
     for(i=0; i<n; i++) {
-        if (elem(ctx, i, &key, &value, user) < 0)
-            return -1;
-        dbcollection_setitem(ctx, obj, key, value, (i==n-1) ? sync : 0);
+        if (i+1 < n && dbcmp(ctx, ops[i].key, ops[i+1].key) == 0)
+            continue;
+        batch->keys[batch->len] = ops[i].key;
+        batch->values[batch->len] = ops[i].value;
+        batch->len++;
+    }
+}
+
+// Apply a list of set/delete operations to a private copy of the tree
+// and publish the result with a single synchronize.  Returns the number
+// of keys deleted.
+static int dbcollection_batch(pgctx_t *ctx, dbtype_t obj, int n, batchop_t *ops, int sync)
+{
+    dbtype_t node, newnode;
+    batchop_t *tmp;
+    sorted_t batch;
+    int i, ndel, nset;
+
+    obj.ptr = dbptr(ctx, obj);
+    assert(obj.ptr->type == Collection || obj.ptr->type == MultiCollection ||
+           obj.ptr->type == BTreeCollection);
+    if (obj.ptr->frozen)
+        return -1;
+    if (n == 0)
+        return 0;
+
+    tmp = malloc(n * sizeof(*tmp));
+    _mergesort(ctx, ops, tmp, n);
+    free(tmp);
+    for(nset=i=0; i<n; i++)
+        nset += (ops[i].op == multi_SET);
+    // A plain collection takes a batch of sets as a whole: either the
+    // tree is rebuilt or the batch is merged in with one descent.
+    batch.len = 0;
+    if (obj.ptr->type == Collection && nset == n)
+        dbcollection_distinct(ctx, n, ops, &batch);
+
+    assert(ctx->winner.len == 0);
+    assert(ctx->loser.len == 0);
+    bonsai_batch_begin(ctx);
+    do {
+        // Read-Copy-Update loop for safe modify
+        node = obj.ptr->obj;
+        rculoser(ctx);
+        newnode = node;
+        ndel = 0;
+        if (batch.len && bonsai_size(ctx, node) <= batch.len) {
+            // Loading at least as many items as the tree already holds:
+            // building a new tree is cheaper than merging into it.
+            newnode = dbcollection_rebuild(ctx, node, &batch);
+        } else if (batch.len) {
+            newnode = bonsai_insert_batch(ctx, node, batch.keys, batch.values, batch.len);
+        } else {
+            for(i=0; i<n; i++) {
+                if (ops[i].op == multi_DEL) {
+                    // Only delete keys which exist: a failed bonsai_delete
+                    // would leave copies behind that belong to no tree.
+                    if (tree_find(ctx, obj.ptr->type, newnode, ops[i].key, NULL) < 0)
+                        continue;
+                    newnode = tree_delete(ctx, obj.ptr->type, newnode, ops[i].key, NULL);
+                    ndel++;
+                } else if (obj.ptr->type != MultiCollection) {
+                    newnode = tree_insert(ctx, obj.ptr->type, newnode, ops[i].key, ops[i].value, 0);
+                } else {
+                    newnode = bonsai_multi_insert(ctx, newnode, ops[i].key, ops[i].value);
+                }
+            }
+        }
+        bonsai_batch_prepare(ctx);
+    } while(!synchronize(ctx, sync & SYNC_MASK, &obj.ptr->obj, node, newnode));
+    bonsai_batch_commit(ctx);
+    if (batch.len) {
+        free(batch.keys);
+        free(batch.values);
     }
+    return ndel;
+}
+
+int dbcollection_update(pgctx_t *ctx, dbtype_t obj, int n, updatecb_t elem, void *user, int sync)
+{
+    int i, ret = -1;
+    batchop_t *ops;
+
+    ops = malloc(n * sizeof(*ops));
+    for(i=0; i<n; i++) {
+        ops[i].op = multi_SET;
+        if (elem(ctx, i, &ops[i].key, &ops[i].value, user) < 0)
+            goto exitproc;
+    }
+    if (dbcollection_batch(ctx, obj, n, ops, sync) < 0)
+        goto exitproc;
+    ret = 0;
+exitproc:
+    free(ops);
+    return ret;
+}
+
+int dbcollection_delete_many(pgctx_t *ctx, dbtype_t obj, int n, extendcb_t elem, void *user, int sync)
+{
+    int i, ret = -1;
+    batchop_t *ops;
+
+    obj.ptr = dbptr(ctx, obj);
+    if (obj.ptr->type != Collection && obj.ptr->type != BTreeCollection)
+        return -1;
+
+    ops = malloc(n * sizeof(*ops));
+    for(i=0; i<n; i++) {
+        ops[i].op = multi_DEL;
+        ops[i].value = DBNULL;
+        if (elem(ctx, i, &ops[i].key, user) < 0)
+            goto exitproc;
+    }
+    ret = dbcollection_batch(ctx, dboffset(ctx, obj.ptr), n, ops, sync);
+exitproc:
+    free(ops);
+    return ret;
+}
+
+// Build a new collection from the trees of a and b.  Both must be plain
+// collections, or both multi collections.
+static int dbcollection_setop(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result,
+        dbtype_t (*op)(pgctx_t *ctx, dbtype_t a, dbtype_t b))
+{
+    dbtype_t root, coll;
+
+    a.ptr = dbptr(ctx, a);
+    b.ptr = dbptr(ctx, b);
+    if ((a.ptr->type != Collection && a.ptr->type != MultiCollection) ||
+        a.ptr->type != b.ptr->type)
+        return -1;
+
+    assert(ctx->winner.len == 0);
+    assert(ctx->loser.len == 0);
+    // Nothing is published until the new collection is returned, so
+    // there is no RCU loop.  The batch only makes the new nodes private.
+    bonsai_batch_begin(ctx);
+    root = op(ctx, a.ptr->obj, b.ptr->obj);
+    bonsai_batch_prepare(ctx);
+    bonsai_batch_release(ctx);
+
+    *result = dbcollection_new(ctx, a.ptr->type == MultiCollection);
+    coll.ptr = dbptr(ctx, *result);
+    coll.ptr->obj = root;
     return 0;
 }
 
+int dbcollection_union(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result)
+{
+    return dbcollection_setop(ctx, a, b, result, bonsai_union);
+}
+
+int dbcollection_intersection(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result)
+{
+    return dbcollection_setop(ctx, a, b, result, bonsai_intersection);
+}
+
+int dbcollection_difference(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result)
+{
+    return dbcollection_setop(ctx, a, b, result, bonsai_difference);
+}
+
+/*
+ * Published trees never change, so a snapshot is a new collection header
+ * pointing at the current tree.  It is frozen, since writing through it
+ * would retire nodes the live tree still uses.  The epoch stays pinned
+ * until dbcollection_release, which keeps the nodes the live tree
+ * replaces in the meantime from being reclaimed.  Only the tree is
+ * frozen: containers stored in it are shared with the live collection.
+ */
+int dbcollection_snapshot(pgctx_t *ctx, dbtype_t obj, dbtype_t *snap)
+{
+    dbtype_t s;
+
+    obj.ptr = dbptr(ctx, obj);
+    if (obj.ptr->type == BTreeCollection) {
+        *snap = dbcollection_new_btree(ctx);
+    } else if (obj.ptr->type == Collection || obj.ptr->type == MultiCollection) {
+        *snap = dbcollection_new(ctx, obj.ptr->type == MultiCollection);
+    } else {
+        return -1;
+    }
+    s.ptr = dbptr(ctx, *snap);
+    s.ptr->obj = obj.ptr->obj;
+    s.ptr->frozen = 1;
+    db_pin(ctx);
+    return 0;
+}
+
+// Let go of the tree of a snapshot.  Must be called by the process
+// which took it.
+void dbcollection_release(pgctx_t *ctx, dbtype_t snap)
+{
+    snap.ptr = dbptr(ctx, snap);
+    if (!snap.ptr->frozen || !snap.ptr->obj.all)
+        return;
+    snap.ptr->obj = DBNULL;
+    db_unpin(ctx);
+}
+
 int dbcollection_delitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value, int sync)
 {
     dbtype_t node, newnode;
 
     obj.ptr = dbptr(ctx, obj);
-    assert(obj.ptr->type == Collection || obj.ptr->type == MultiCollection);
+    assert(obj.ptr->type == Collection || obj.ptr->type == MultiCollection ||
+           obj.ptr->type == BTreeCollection);
+    if (obj.ptr->frozen)
+        return -1;
     assert(ctx->winner.len == 0);
     assert(ctx->loser.len == 0);
     // Read-Copy-Update loop for safe modify
     do {
         node = obj.ptr->obj;
         rculoser(ctx);
-        if (obj.ptr->type == Collection) {
-            newnode = bonsai_delete(ctx, node, key, value);
+        if (obj.ptr->type != MultiCollection) {
+            newnode = tree_delete(ctx, obj.ptr->type, node, key, value);
         } else {
             newnode = bonsai_multi_delete(ctx, node, key, *value);
         }
@@ -70,12 +70,12 @@ int dblist_setitem(pgctx_t *ctx, dbtype_t list, int n, dbtype_t item, int sync)
 		return -1;
 
         sz = dblist_size(_list, 0);
-        dbfree(_newlist, 0xf1);
+        dbfree(ctx, _newlist, 0xf1);
         _newlist = dballoc(ctx, sz);
         memcpy(_newlist, _list, sz);
         _newlist->item[n] = item;
     } while(!synchronizep(ctx, sync, &list.ptr->list, _list, _newlist));
-    dbfree(_list, 0xf2);
+    dbfree(ctx, _list, 0xf2);
     return 0;
 }
 
@@ -96,7 +96,7 @@ int dblist_delitem(pgctx_t *ctx, dbtype_t list, int n, dbtype_t *item, int sync)
         if (n < 0 || n >= _list->len)
             return -1;
         sz = dblist_size(_list, 0);
-        dbfree(_newlist, 0xf3);
+        dbfree(ctx, _newlist, 0xf3);
         _newlist = dballoc(ctx, sz);
         _newlist->type = _InternalList;
         _newlist->len = _list->len - 1;
@@ -108,7 +108,7 @@ int dblist_delitem(pgctx_t *ctx, dbtype_t list, int n, dbtype_t *item, int sync)
             }
         }
     } while(!synchronizep(ctx, sync, &list.ptr->list, _list, _newlist));
-    dbfree(_list, 0xf4);
+    dbfree(ctx, _list, 0xf4);
     return 0;
 }
 
@@ -131,7 +131,7 @@ int dblist_insert(pgctx_t *ctx, dbtype_t list, int n, dbtype_t item, int sync)
         if (n < 0 || n > llen)
             return -1;
         sz = dblist_size(_list, 1);
-        dbfree(_newlist, 0xf5);
+        dbfree(ctx, _newlist, 0xf5);
         _newlist = dballoc(ctx, sz);
         _newlist->type = _InternalList;
         _newlist->len = llen + 1;
@@ -143,7 +143,7 @@ int dblist_insert(pgctx_t *ctx, dbtype_t list, int n, dbtype_t item, int sync)
             }
         }
     } while(!synchronizep(ctx, sync, &list.ptr->list, _list, _newlist));
-    dbfree(_list, 0xf6);
+    dbfree(ctx, _list, 0xf6);
     return 0;
 }
 
@@ -165,7 +165,7 @@ int dblist_extend(pgctx_t *ctx, dbtype_t list, int n, extendcb_t elem, void *use
 	    _list = dbptr(ctx, list.ptr->list);
         llen = _list ? _list->len : 0;
         sz = dblist_size(_list, n);
-        dbfree(_newlist, 0xf7);
+        dbfree(ctx, _newlist, 0xf7);
         _newlist = dballoc(ctx, sz);
         _newlist->type = _InternalList;
         _newlist->len = llen + n;
@@ -179,7 +179,7 @@ int dblist_extend(pgctx_t *ctx, dbtype_t list, int n, extendcb_t elem, void *use
             _newlist->item[i] = item;
         }
     } while(!synchronizep(ctx, sync, &list.ptr->list, _list, _newlist));
-    dbfree(_list, 0xf8);
+    dbfree(ctx, _list, 0xf8);
     return 0;
 }
 
@@ -196,7 +196,7 @@ int dblist_remove(pgctx_t *ctx, dbtype_t list, dbtype_t item, int sync)
         if (!_list)
             return -1;
         sz = dblist_size(_list, 0);
-        dbfree(_newlist, 0xf9);
+        dbfree(ctx, _newlist, 0xf9);
         _newlist = dballoc(ctx, sz);
         _newlist->type = _InternalList;
         _newlist->len = _list->len - 1;
@@ -211,13 +211,13 @@ int dblist_remove(pgctx_t *ctx, dbtype_t list, dbtype_t item, int sync)
             }
         }
         if (!remove) {
-            dbfree(_newlist, 0xfa);
+            dbfree(ctx, _newlist, 0xfa);
             // No item was removed, so discard the copy (no one will
             // ever see it) and return an error
             return -1;
         }
     } while(!synchronizep(ctx, sync, &list.ptr->list, _list, _newlist));
-    dbfree(_list, 0xfb);
+    dbfree(ctx, _list, 0xfb);
     return 0;
 }
 
@@ -65,7 +65,7 @@ int dbobject_setitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t value, i
         // Read-Copy-Update loop for safe modify
         _obj = dbptr(ctx, obj.ptr->obj);
         sz = dbobject_size(_obj, 1);
-        dbfree(_newobj, 0xd1);
+        dbfree(ctx, _newobj, 0xd1);
 
         len = _obj ? _obj->len : 0;
         _newobj = dballoc(ctx, sz);
@@ -101,7 +101,7 @@ int dbobject_setitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t value, i
             _newobj->len++;
         }
     } while(!synchronizep(ctx, sync & SYNC_MASK, &obj.ptr->obj, _obj, _newobj));
-    dbfree(_obj, 0xd2);
+    dbfree(ctx, _obj, 0xd2);
     return 0;
 }
 
@@ -224,7 +224,7 @@ int dbobject_update(pgctx_t *ctx, dbtype_t obj, int n, updatecb_t elem, void *us
     do {
         _obj = dbptr(ctx, obj.ptr->obj);
         sz = dbobject_size(_obj, n);
-        dbfree(_newobj, 0xd3);
+        dbfree(ctx, _newobj, 0xd3);
         _newobj = dballoc(ctx, sz);
         if (_obj)
             memcpy(_newobj, _obj, sizeof(_obj_t) + _obj->len*sizeof(_objitem_t));
@@ -249,7 +249,7 @@ int dbobject_update(pgctx_t *ctx, dbtype_t obj, int n, updatecb_t elem, void *us
         _newobj->len = newlen;
         _quicksort(ctx, _newobj->item, 0, newlen-1);
     } while(!synchronizep(ctx, sync, &obj.ptr->obj, _obj, _newobj));
-    dbfree(_obj, 0xd4);
+    dbfree(ctx, _obj, 0xd4);
     return 0;
 }
 
@@ -266,7 +266,7 @@ int dbobject_delitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value,
         if (!_obj)
             return -1;
         sz = dbobject_size(_obj, 0);
-        dbfree(_newobj, 0xd5);
+        dbfree(ctx, _newobj, 0xd5);
         _newobj = dballoc(ctx, sz);
         _newobj->type = _InternalObj;
         _newobj->len = _obj->len - 1;
@@ -283,11 +283,67 @@ int dbobject_delitem(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t *value,
         }
         if (!done) {
             // If the key didn't exist, discard the copy and return an error
-            dbfree(_newobj, 0xd6);
+            dbfree(ctx, _newobj, 0xd6);
             return -1;
         }
     } while(!synchronizep(ctx, sync, &obj.ptr->obj, _obj, _newobj));
-    dbfree(_obj, 0xd7);
+    dbfree(ctx, _obj, 0xd7);
+    return 0;
+}
+
+int dbobject_cas(pgctx_t *ctx, dbtype_t obj, dbtype_t key, dbtype_t expected, dbtype_t value, int sync)
+{
+    _obj_t *_obj, *_newobj = NULL;
+    _objitem_t *item;
+
+    obj.ptr = dbptr(ctx, obj);
+	assert(obj.ptr->type == Object);
+    do {
+        // Read-Copy-Update loop for safe modify.  The compare is done
+        // against the same item list that synchronizep checks.
+        _obj = dbptr(ctx, obj.ptr->obj);
+        dbfree(ctx, _newobj, 0xd8);
+        _newobj = NULL;
+        item = dbobject_find(ctx, _obj, key);
+        if (!item)
+            return CAS_ERR_KEY;
+        if (dbcmp(ctx, item->value, expected) != 0)
+            return 1;
+
+        _newobj = dballoc(ctx, dbobject_size(_obj, 0));
+        memcpy(_newobj, _obj, dbobject_size(_obj, 0));
+        _newobj->item[item - _obj->item].value = value;
+    } while(!synchronizep(ctx, sync & SYNC_MASK, &obj.ptr->obj, _obj, _newobj));
+    dbfree(ctx, _obj, 0xd9);
+    return 0;
+}
+
+int dbobject_incr(pgctx_t *ctx, dbtype_t obj, dbtype_t key, int64_t delta, dbtype_t *value, int sync)
+{
+    _obj_t *_obj;
+    _objitem_t *item;
+    dbval_t *objp;
+    dbtype_t cur, result;
+    int r;
+
+    objp = dbptr(ctx, obj);
+	assert(objp->type == Object);
+    for(;;) {
+        // Compare-and-set loop.  A missing key counts as zero.
+        _obj = dbptr(ctx, objp->obj);
+        item = dbobject_find(ctx, _obj, key);
+        cur = item ? item->value : dbint_new(ctx, 0);
+        if ((r = dbint_add(ctx, cur, delta, &result)) < 0)
+            return r;
+        if (item) {
+            r = dbobject_cas(ctx, obj, key, cur, result, sync);
+        } else {
+            r = dbobject_setitem(ctx, obj, key, result, sync | SET_OR_FAIL);
+        }
+        if (r == 0)
+            break;
+    }
+    if (value) *value = result;
     return 0;
 }
 
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <pongo/dbtypes.h>
 #include <pongo/bonsai.h>
+#include <pongo/btree.h>
 #include <pongo/dbmem.h>
 #include <pongo/misc.h>
 #include <pongo/log.h>
@@ -35,7 +36,7 @@ int db_multi(pgctx_t *ctx, dbtype_t obj, dbtype_t path, multi_t op, dbtype_t *va
                 r = dbobject_getitem(ctx, obj, p, &obj);
                 if (r<0)
                     return MULTI_ERR_KEY;
-            } else if (objp->type == Collection) {
+            } else if (objp->type == Collection || objp->type == BTreeCollection) {
                 r = dbcollection_getitem(ctx, obj, p, &obj);
                 if (r<0)
                     return MULTI_ERR_KEY;
@@ -85,7 +86,9 @@ int db_multi(pgctx_t *ctx, dbtype_t obj, dbtype_t path, multi_t op, dbtype_t *va
             r = MULTI_ERR_CMD;
         }
         if (r == -1) r = MULTI_ERR_KEY;
-    } else if (objp->type == Collection) {
+    } else if (objp->type == Collection || objp->type == BTreeCollection) {
+        if (op != multi_GET && objp->frozen)
+            return MULTI_ERR_FROZEN;
         if (op == multi_GET) {
             r = dbcollection_getitem(ctx, obj, p, value);
         } else if (op == multi_SET) {
@@ -118,19 +121,24 @@ typedef struct {
     int r;                  // resutl boolean
 } search_t;
 
-static void search_helper(pgctx_t *ctx, dbtype_t node, void *user)
+static void search_item(pgctx_t *ctx, dbtype_t key, dbtype_t value, void *user)
 {
     search_t *search = (search_t*)user;
     
-    node.ptr = dbptr(ctx, node);
-    search->r = db_search(ctx, node.ptr->value,
+    search->r = db_search(ctx, value,
             search->path, 
             search->n, 
             search->relop, 
             search->value, 
             search->result);
     if (search->r == 1 && search->n == 0)
-        dbcollection_setitem(ctx, search->result, node.ptr->key, node.ptr->value, 0);
+        dbcollection_setitem(ctx, search->result, key, value, 0);
+}
+
+static void search_helper(pgctx_t *ctx, dbtype_t node, void *user)
+{
+    node.ptr = dbptr(ctx, node);
+    search_item(ctx, node.ptr->key, node.ptr->value, user);
 }
 // Given a root object or collection, search all children for key (aka path) relop value.
 // Put all results into the supplied result collection.
@@ -205,7 +213,7 @@ int db_search(pgctx_t *ctx, dbtype_t obj, dbtype_t path, int n, relop_t relop, d
                 return db_search(ctx, x, path, n, relop, value, result);
             }
         }
-    } else if (otype == Collection) {
+    } else if (otype == Collection || otype == BTreeCollection) {
         objp = dbptr(ctx, obj);
         if (n==0 || dbcmp_primitive(ctx, p, String, "*") == 0) {
             // If we're at the beginning of the search or the search term is wildcard
@@ -216,7 +224,10 @@ int db_search(pgctx_t *ctx, dbtype_t obj, dbtype_t path, int n, relop_t relop, d
             search.value = value;
             search.result = result;
             search.r = 0;
-            bonsai_foreach(ctx, objp->obj, search_helper, &search);
+            if (otype == BTreeCollection)
+                btree_foreach(ctx, objp->obj, search_item, &search);
+            else
+                bonsai_foreach(ctx, objp->obj, search_helper, &search);
             // For n==0, the search_helper will put the result objects into the
             // collection.  We may need to return true if we're into the path list 
             if (n && search.r == 1)
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #ifndef WIN32
 #include <unistd.h>
+#include <pthread.h>
 #endif
 
 #include <pongo/dbmem.h>
@@ -57,6 +58,7 @@ void *dbfile_more_mem(mmfile_t *mm, uint32_t *size)
 	mm_lock(mm, MLCK_WR, __offset(mm, &root->resize), sizeof(root->resize));
 	if (mm->size == mm_size(mm)) {
 		log_debug("Resizing mmfile +%d bytes", chunksize);
+		atomic_inc(&root->gcpressure.grow);
 		rc = mm_resize(mm, mm->size + chunksize);
 		if (rc != 0) {
 			log_error("Resize failed"); abort();
@@ -77,6 +79,7 @@ pgctx_t *dbfile_open(const char *filename, uint32_t initsize)
 {
 	int ret, i;
 	dbroot_t *r;
+	dbtype_t old;
 	pgctx_t *ctx;
 	mempool_t *pool;
 	memheap_t *heap;
@@ -121,27 +124,30 @@ pgctx_t *dbfile_open(const char *filename, uint32_t initsize)
 		//ctx->cache = dbcache_new(ctx, 0, 0);
 		//r->cache = ctx->cache;
 
-		r->pidcache = dbcollection_new(ctx, 0);
-		
 		r->meta.chunksize = initsize;
 		r->meta.id = dbstring_new(ctx, "_id", 3);
 	} else {
 		ctx->data = ctx->root->data;
 		ctx->cache = ctx->root->cache;
+		// Older versions kept a collection of pidcaches in
+		// root->pidcache.  The pins are in root->pidslab now, so let
+		// go of the collection and let the GC free it.
+		r = ctx->root;
+		old = r->pidcache;
+		if (old.all)
+			cmpxchg64(&r->pidcache, old.all, 0);
 		log_verbose("data=%" PRIx64 " cache=%" PRIx64, ctx->data.all, ctx->cache.all);
 		// Probably don't want to run the GC here...
 		//db_gc(ctx, NULL);
 	}
 
-	// Pidcache in "ctx" points to this process' pidcache.
-	// The pidcache in root points to the global pidcache (container
-	// of pidcaches)
-	ctx->pidcache = DBNULL;
 	ctx->sync = 1;
 	return ctx;
 }
 
 
+static void ebr_reclaim(pgctx_t *ctx);
+
 void dbfile_close(pgctx_t *ctx)
 {
 	int i;
@@ -150,6 +156,20 @@ void dbfile_close(pgctx_t *ctx)
 			dbctx[i] = NULL;
 		}
 	}
+	if (ctx->ebr.pid == getpid() && ctx->ebr.slot >= 0) {
+		// Anything still waiting on other readers is left to the
+		// next full collection.
+		if (ctx->ebr.head < ctx->ebr.retired.len)
+			ebr_reclaim(ctx);
+		if (ctx->ebr.head < ctx->ebr.retired.len) {
+			ctx->root->readers[ctx->ebr.slot].state = READER_DEAD;
+		} else {
+			ctx->root->readers[ctx->ebr.slot].pid = 0;
+			ctx->root->readers[ctx->ebr.slot].state = READER_FREE;
+		}
+		// Proxies which outlive the file still lock and unlock it
+		ctx->ebr.slot = -1;
+	}
 	pmem_retire(&ctx->mm, _ptr(ctx, ctx->root->heap), 0);
         mm_close(&ctx->mm);
 }
@@ -177,25 +197,298 @@ int _dbmemlock(pgctx_t *ctx, memblock_t *mb, uint32_t op)
 	return 0;
 }
 
+/*
+ * Epoch based reclamation.
+ *
+ * Nodes replaced by a synchronize (rcuwinner) used to be left for the
+ * fast GC, which only runs when pongogc is around.  Now each process
+ * registers a reader slot in the root, and while it is inside the
+ * database (dblock) the slot shows the global epoch it entered in.  A
+ * retired block is tagged with the epoch it was retired in and kept on
+ * a private list.  The global epoch can move forward once every reader
+ * inside the database has seen the current one, so a block retired in
+ * epoch e can't be in use by anyone once the global epoch reaches e+2,
+ * and the process that retired it frees it.
+ *
+ * A retired block waiting to be freed has its gc bit set and its
+ * owner's slot in _resv (see pmem_gc_retire), so that the full GC leaves
+ * it alone unless its owner has gone away.  No retired blocks are freed
+ * while a full collection is running (the freeing flag in each reader
+ * slot keeps the two apart, see gc_dead_readers).
+ *
+ * Iterators walk a snapshot of a tree outside of dblock.  While a
+ * process holds any, its slot also shows the epoch of the oldest
+ * (pinned).
+ */
+static int ebr_register(pgctx_t *ctx)
+{
+	dbreader_t *r;
+	int i, pid = getpid();
+
+	if (ctx->ebr.pid == pid)
+		return ctx->ebr.slot >= 0;
+	// After a fork the list belongs to the parent
+	ctx->ebr.pid = pid;
+	ctx->ebr.slot = -1;
+	ctx->ebr.pins = 0;
+	ctx->ebr.head = ctx->ebr.retired.len = ctx->ebr.when.len = 0;
+	for(i=0; i<NR_READERS; i++) {
+		r = &ctx->root->readers[i];
+		if (r->state == READER_FREE &&
+				cmpxchg32(&r->state, READER_FREE, READER_LIVE)) {
+			r->epoch = 0;
+			r->pinned = 0;
+			r->writing = 0;
+			r->pid = pid;
+			ctx->ebr.slot = i;
+			return 1;
+		}
+	}
+	// Out of slots: retired blocks go to the fast GC instead
+	log_debug("No reader slot for pid %d", pid);
+	return 0;
+}
+
+// Try to move the global epoch forward
+static void ebr_advance(pgctx_t *ctx)
+{
+	uint64_t e = ctx->root->ebr.epoch;
+	uint64_t now = (e << 1) | 1;
+	dbreader_t *r;
+	int i, check;
+
+	// Readers that went away without saying so are only looked for
+	// once in a while.
+	check = (++ctx->ebr.tries % 64) == 0;
+	for(i=0; i<NR_READERS; i++) {
+		r = &ctx->root->readers[i];
+		if (r->state != READER_LIVE)
+			continue;
+		if ((r->epoch && r->epoch != now) ||
+				(r->pinned && r->pinned != now)) {
+			if (check && !pid_alive(r->pid)) {
+				cmpxchg32(&r->state, READER_LIVE, READER_DEAD);
+				continue;
+			}
+			return;
+		}
+	}
+	ctx->ebr.tries = 0;
+	cmpxchg64(&ctx->root->ebr.epoch, e, e+1);
+}
+
+// Free whatever this process retired that nobody can see anymore
+static void ebr_reclaim(pgctx_t *ctx)
+{
+	volatile uint32_t *freeing = &ctx->root->readers[ctx->ebr.slot].freeing;
+	gcmap_t *old;
+	unsigned i;
+	uint64_t e;
+
+	if (ctx->ebr.when.addr[ctx->ebr.head].all + 2 > ctx->root->ebr.epoch)
+		ebr_advance(ctx);
+	e = ctx->root->ebr.epoch;
+	if (ctx->ebr.when.addr[ctx->ebr.head].all + 2 > e)
+		return;
+
+	*freeing = 1;
+	__sync_synchronize();
+	if (ctx->root->gcinc.phase == GC_IDLE) {
+		old = _ptr(ctx, ctx->root->gcgen.old);
+		for(i=ctx->ebr.head; i<ctx->ebr.retired.len; i++) {
+			if (ctx->ebr.when.addr[i].all + 2 > e)
+				break;
+			pmem_sb_free(NULL, dbptr(ctx, ctx->ebr.retired.addr[i]));
+			// The address may come back as a young block
+			if (old)
+				pmem_gcmap_clear(old, ctx->ebr.retired.addr[i].all);
+		}
+		ctx->ebr.head = i;
+	}
+	__sync_synchronize();
+	*freeing = 0;
+
+	if (ctx->ebr.head == ctx->ebr.retired.len) {
+		ctx->ebr.head = ctx->ebr.retired.len = ctx->ebr.when.len = 0;
+	} else if (ctx->ebr.head > 4096 && ctx->ebr.head*2 > ctx->ebr.retired.len) {
+		i = ctx->ebr.retired.len - ctx->ebr.head;
+		memmove(ctx->ebr.retired.addr, ctx->ebr.retired.addr + ctx->ebr.head, i*sizeof(dbtype_t));
+		memmove(ctx->ebr.when.addr, ctx->ebr.when.addr + ctx->ebr.head, i*sizeof(dbtype_t));
+		ctx->ebr.retired.len = ctx->ebr.when.len = i;
+		ctx->ebr.head = 0;
+	}
+}
+
+// Retire a block which was replaced by a synchronize
+void db_retire(pgctx_t *ctx, dbtype_t item)
+{
+	void *addr = dbptr(ctx, item);
+	memblock_t *mb = (memblock_t*)addr - 1;
+	dbtype_t e;
+
+	if (mb->type != 1 || !ebr_register(ctx)) {
+		db_suggest(ctx, addr, 0xc4);
+		return;
+	}
+	pmem_gc_retire(mb, ctx->ebr.slot);
+	e.all = ctx->root->ebr.epoch;
+	rcupush(&ctx->ebr.retired, item);
+	rcupush(&ctx->ebr.when, e);
+}
+
+// Hold back reclamation for as long as an iterator looks at a snapshot
+void db_pin(pgctx_t *ctx)
+{
+	dbreader_t *r;
+
+	if (!ebr_register(ctx))
+		return;
+	r = &ctx->root->readers[ctx->ebr.slot];
+	// Called inside of dblock, so our epoch covers what we just read
+	if (ctx->ebr.pins++ == 0)
+		r->pinned = r->epoch;
+}
+
+void db_unpin(pgctx_t *ctx)
+{
+	if (ctx->ebr.pid != getpid() || ctx->ebr.slot < 0 || ctx->ebr.pins == 0)
+		return;
+	if (--ctx->ebr.pins == 0)
+		ctx->root->readers[ctx->ebr.slot].pinned = 0;
+}
+
 void dblock(pgctx_t *ctx)
 {
 	_dblockop(ctx, MLCK_RD, ctx->root->lock);
-	__dblocked++;
+	if (__dblocked++ == 0 && ebr_register(ctx)) {
+		ctx->root->readers[ctx->ebr.slot].epoch = (ctx->root->ebr.epoch << 1) | 1;
+		__sync_synchronize();
+	}
 }
 
+static void gc_count(pgctx_t *ctx);
+
 void dbunlock(pgctx_t *ctx)
 {
-	__dblocked--;
+	if (--__dblocked == 0 && ctx->ebr.slot >= 0 && ctx->ebr.pid == getpid()) {
+		ctx->root->readers[ctx->ebr.slot].epoch = 0;
+		if (ctx->ebr.head < ctx->ebr.retired.len)
+			ebr_reclaim(ctx);
+	}
+	if (ctx->gc.alloc || ctx->gc.suggest)
+		gc_count(ctx);
 	_dblockop(ctx, MLCK_UN, ctx->root->lock);
+	if (ctx->gc.due && __dblocked == 0) {
+		ctx->gc.due = 0;
+		db_gc_auto(ctx, NULL);
+	}
+}
+
+/*
+ * Return the version of a container.  The version changes every time
+ * the container is modified.
+ */
+uint32_t db_version(pgctx_t *ctx, dbtype_t obj)
+{
+	obj.ptr = dbptr(ctx, obj);
+	return obj.ptr->version;
+}
+
+/*
+ * Sleep until the version of a container differs from last_version or
+ * timeout microseconds have passed (negative waits forever).  Call this
+ * without holding the db lock, or the GC will be held off for as long as
+ * we sleep.  Looking up obj may have to map more of the file, so do that
+ * with dbptr under the lock first; the mappings stay where they are for
+ * as long as the file is open.  Returns the current version.
+ */
+uint32_t db_wait_change(pgctx_t *ctx, dbval_t *obj, uint32_t last_version, int64_t timeout)
+{
+	int64_t deadline = utime_now() + timeout;
+	int64_t remain = timeout;
+
+	atomic_inc(&obj->waiters);
+	while(obj->version == last_version) {
+		if (mm_wait(&obj->version, last_version, remain) < 0)
+			break;
+		if (timeout >= 0) {
+			remain = deadline - utime_now();
+			if (remain <= 0)
+				break;
+		}
+	}
+	atomic_dec(&obj->waiters);
+	return obj->version;
+}
+
+/*
+ * Allocation pressure.  Each process adds up what it allocates and what it
+ * suggests to the fast collector, and moves the counts to root->gcpressure
+ * now and then rather than on every allocation.  pongogc (or, with
+ * ctx->gc.inline_gc set, the writer at its next dbunlock) runs whatever
+ * collection the counters call for, and nothing while the database is idle.
+ */
+static void gc_count(pgctx_t *ctx)
+{
+	volatile dbroot_t *root = ctx->root;
+
+	if (ctx->gc.alloc)
+		__sync_fetch_and_add(&root->gcpressure.alloc, ctx->gc.alloc);
+	if (ctx->gc.suggest)
+		__sync_fetch_and_add(&root->gcpressure.suggest, ctx->gc.suggest);
+	ctx->gc.alloc = ctx->gc.suggest = 0;
+	if (ctx->gc.inline_gc && db_gc_pressure(ctx))
+		ctx->gc.due = 1;
+}
+
+/*
+ * Which collection the counters call for: 2 for a full one, 1 for a fast
+ * one and 0 for none.  A full collection is due once the file has grown,
+ * or once as much was allocated as half of what was in use after the last
+ * one (at least GC_FULL_MIN).  A fast one is due once GC_FAST_BYTES were
+ * suggested.
+ */
+int db_gc_pressure(pgctx_t *ctx)
+{
+	volatile dbroot_t *root = ctx->root;
+	uint64_t full_at = root->gcpressure.full_at;
+
+	if (full_at < GC_FULL_MIN)
+		full_at = GC_FULL_MIN;
+	if (root->gcpressure.grow || root->gcpressure.alloc >= full_at)
+		return 2;
+	if (root->gcpressure.suggest >= GC_FAST_BYTES)
+		return 1;
+	return 0;
 }
 
 void *dballoc(pgctx_t *ctx, unsigned size)
 {
 	void *addr;
 	addr = pmem_alloc(&ctx->mm, _ptr(ctx, ctx->root->heap), size);
+	ctx->gc.alloc += size;
+	if (ctx->gc.alloc >= GC_COUNT_BYTES)
+		gc_count(ctx);
 	return addr;
 }
 
+// Suggest a block to the fast collector
+void db_suggest(pgctx_t *ctx, void *addr, int x)
+{
+	memblock_t *mb = (memblock_t*)addr - 1;
+	superblock_t *sb;
+
+	if (!addr)
+		return;
+	if (mb->type == 1) {
+		sb = (superblock_t*)((uint8_t*)mb - mb->sbofs);
+		ctx->gc.suggest += sb->size;
+		if (ctx->gc.suggest >= GC_COUNT_BYTES)
+			gc_count(ctx);
+	}
+	pmem_gc_suggest(addr, x);
+}
+
 /*
 void dbfree(pgctx_t *ctx, void *addr)
 {
@@ -204,77 +497,196 @@ void dbfree(pgctx_t *ctx, void *addr)
 */
 
 
+// Make sure the visited bitmap covers the whole file
+static void gc_visited_grow(pgctx_t *ctx, uint64_t w)
+{
+	uint64_t n;
+
+	n = (ctx->mm.size >> 9) + 1;
+	if (n <= w) n = w+1;
+	if (n <= ctx->gc.nvisited)
+		return;
+	ctx->gc.visited = realloc(ctx->gc.visited, n*sizeof(uint64_t));
+	assert(ctx->gc.visited);
+	memset(ctx->gc.visited + ctx->gc.nvisited, 0,
+			(n - ctx->gc.nvisited)*sizeof(uint64_t));
+	ctx->gc.nvisited = n;
+}
+
+// Claim a block by its file offset.  Returns 0 if the block was already
+// visited during this collection, so there is no need to look inside of it
+// again.  Visits are tracked in a bitmap private to the collecting process,
+// laid out like the shared gcmap_t, and are only subtracted from the
+// garbage bits once marking is done.  Blocks which were allocated during
+// the walk (or which the initial marking missed) aren't garbage, but they
+// may still point to blocks that are, so they need a visited bit of their
+// own.  The bit is set atomically so that only one marker thread claims
+// each block.
+static inline int gc_shade(pgctx_t *ctx, uint64_t ofs)
+{
+	uint64_t w = ofs >> 9, bit = 1ULL << ((ofs >> 3) & 63);
+
+	if (w >= ctx->gc.nvisited)
+		gc_visited_grow(ctx, w);
+	if (ctx->gc.visited[w] & bit)
+		return 0;
+	if (__sync_fetch_and_or(&ctx->gc.visited[w], bit) & bit)
+		return 0;
+	return 1;
+}
+
+static inline int gc_visited(pgctx_t *ctx, uint64_t ofs)
+{
+	uint64_t w = ofs >> 9;
+	return w < ctx->gc.nvisited &&
+		((ctx->gc.visited[w] >> ((ofs >> 3) & 63)) & 1);
+}
+
+// Keep a block without looking inside of it
 static void gc_keep(pgctx_t *ctx, void *addr)
 {
-	//memblock_t *mb = (memblock_t*)addr - 1;
-	//printf("keeping type %02x at %p (%d bytes)\n", *(uint32_t*)addr, addr, psize(mb, addr));
-	pmem_gc_keep(addr);
+	if (addr)
+		gc_shade(ctx, _offset(ctx, addr));
 }
 
 static void gc_walk_cache(pgctx_t *ctx, dbtype_t node)
 {
-	if (!node.all) return;
-	node.ptr = dbptr(ctx, node);
-	gc_keep(ctx, node.ptr);
-	gc_walk_cache(ctx, node.ptr->left);
-	gc_walk_cache(ctx, node.ptr->right);
+	struct rcuhelper stack = { 0, 0, NULL };
+
+	if (node.all)
+		rcupush(&stack, node);
+	while(stack.len) {
+		node.ptr = dbptr(ctx, stack.addr[--stack.len]);
+		gc_keep(ctx, node.ptr);
+		if (node.ptr->left.all)
+			rcupush(&stack, node.ptr->left);
+		if (node.ptr->right.all)
+			rcupush(&stack, node.ptr->right);
+	}
+	free(stack.addr);
+}
+
+// Primitives stored in the value itself have nothing to mark, and
+// neither do blocks we've already visited.  Neither costs a memory access.
+static inline void gc_push(pgctx_t *ctx, struct rcuhelper *stack, dbtype_t item)
+{
+	if (item.all && isPtr(item.type) && !gc_visited(ctx, item.all))
+		rcupush(stack, item);
+}
+
+/*
+ * The walk is bound by cache misses, so blocks are claimed and prefetched
+ * GC_PREFETCH pops before they are scanned: pop an offset off the mark
+ * stack, claim it, prefetch it into a small FIFO and scan whatever falls
+ * out of the other end.  GC_PREFETCH is set in dbmem.h.
+ */
+struct gc_pipe {
+	unsigned head, len;
+	dbval_t *ptr[GC_PREFETCH];
+};
+
+// Claim the block at item and start loading it.  Returns NULL if some
+// other marker got there first.
+static inline dbval_t *gc_claim(pgctx_t *ctx, dbtype_t item)
+{
+	dbval_t *p;
+
+	if (!gc_shade(ctx, item.all))
+		return NULL;
+	p = dbptr(ctx, item);
+	__builtin_prefetch(p);
+	return p;
+}
+
+// Get the next block to scan, or NULL if there's no more work
+static inline dbval_t *gc_next(pgctx_t *ctx, struct rcuhelper *stack, struct gc_pipe *pipe)
+{
+	dbval_t *p;
+
+	while(stack->len && pipe->len < GC_PREFETCH) {
+		p = gc_claim(ctx, stack->addr[--stack->len]);
+		if (p)
+			pipe->ptr[(pipe->head + pipe->len++) % GC_PREFETCH] = p;
+	}
+	if (!pipe->len)
+		return NULL;
+	p = pipe->ptr[pipe->head];
+	pipe->head = (pipe->head + 1) % GC_PREFETCH;
+	pipe->len--;
+	return p;
+}
+
+static void gc_scan(pgctx_t *ctx, struct rcuhelper *stack, dbval_t *p);
+
+// Scan the blocks already claimed by the pipe.  Whatever they refer to
+// is left on the stack.
+static void gc_flush(pgctx_t *ctx, struct rcuhelper *stack, struct gc_pipe *pipe)
+{
+	while(pipe->len) {
+		gc_scan(ctx, stack, pipe->ptr[pipe->head]);
+		pipe->head = (pipe->head + 1) % GC_PREFETCH;
+		pipe->len--;
+	}
 }
 
-static void gc_walk(pgctx_t *ctx, dbtype_t root)
+// Push everything a claimed block refers to onto the mark stack
+static void gc_scan(pgctx_t *ctx, struct rcuhelper *stack, dbval_t *p)
 {
 	int i;
 	_list_t *list;
 	_obj_t *obj;
-	if (root.all == 0 || !isPtr(root.type))
-		return;
+	dbbtree_t *bt;
+	dbtype_t root;
 
-	root.ptr = dbptr(ctx, root);
-	gc_keep(ctx, root.ptr);
+	root.ptr = p;
 	switch(root.ptr->type) {
 		case List:
-			root.ptr = dbptr(ctx, root.ptr->list);
-			gc_keep(ctx, root.ptr);
-			// Fall-thru is intentional
+			gc_push(ctx, stack, root.ptr->list);
+			break;
 		case _InternalList:
 			list = (_list_t*)root.ptr;
-			if (list) {
-				for(i=0; i<list->len; i++) 
-					gc_walk(ctx, list->item[i]);
-			}
+			for(i=0; i<list->len; i++) 
+				gc_push(ctx, stack, list->item[i]);
 			break;
 		case Object:
-			root.ptr = dbptr(ctx, root.ptr->obj);
-			gc_keep(ctx, root.ptr);
-			// Fall-thru is intentional
+			gc_push(ctx, stack, root.ptr->obj);
+			break;
 		case _InternalObj:
 			obj = (_obj_t*)root.ptr;
-			if (obj) {
-				for(i=0; i<obj->len; i++) {
-					gc_walk(ctx, obj->item[i].key);
-					gc_walk(ctx, obj->item[i].value);
-				}
+			for(i=0; i<obj->len; i++) {
+				gc_push(ctx, stack, obj->item[i].key);
+				gc_push(ctx, stack, obj->item[i].value);
 			}
 			break;
 		case Collection:
 		case MultiCollection:
-			gc_walk(ctx, root.ptr->obj);
+		case BTreeCollection:
+			gc_push(ctx, stack, root.ptr->obj);
 			break;
 		case Cache:
 			gc_walk_cache(ctx, root.ptr->cache);
 			break;
 		case _BonsaiNode:
-			gc_walk(ctx, root.ptr->left);
-			gc_walk(ctx, root.ptr->key);
-			gc_walk(ctx, root.ptr->value);
-			gc_walk(ctx, root.ptr->right);
+		case _BonsaiPrefixNode:
+			gc_push(ctx, stack, root.ptr->right);
+			gc_push(ctx, stack, root.ptr->value);
+			gc_push(ctx, stack, root.ptr->key);
+			gc_push(ctx, stack, root.ptr->left);
 			break;
 		case _BonsaiMultiNode:
-			gc_walk(ctx, root.ptr->left);
-			gc_walk(ctx, root.ptr->key);
+			gc_push(ctx, stack, root.ptr->right);
 			for(i=0; i<root.ptr->nvalue; i++) {
-				gc_walk(ctx, root.ptr->values[i]);
+				gc_push(ctx, stack, root.ptr->values[i]);
+			}
+			gc_push(ctx, stack, root.ptr->key);
+			gc_push(ctx, stack, root.ptr->left);
+			break;
+		case _BTreeNode:
+			bt = (dbbtree_t*)root.ptr;
+			for(i=bt->n; i>0; i--) {
+				gc_push(ctx, stack, bt->val[i-1]);
+				gc_push(ctx, stack, bt->key[i-1]);
 			}
-			gc_walk(ctx, root.ptr->right);
 			break;
 		default:
 			// Nothing to do
@@ -283,69 +695,754 @@ static void gc_walk(pgctx_t *ctx, dbtype_t root)
 	}
 }
 
-int _db_gc(pgctx_t *ctx, gcstats_t *stats)
+/*
+ * Incremental full GC.
+ *
+ * A collection starts by marking every allocated block as garbage.  The
+ * walk then keeps everything reachable from the roots, a slice at a time,
+ * while the database stays in use.  It is a snapshot-at-the-beginning
+ * collector: while root->gcinc.phase is GC_MARK, every synchronize logs
+ * the root it replaced (db_gc_barrier), so anything which was reachable
+ * when the walk started is still found even if it gets unlinked before
+ * the walk reaches it.  Blocks allocated during the walk are never marked
+ * as garbage.  Once the mark stack is empty, the log is drained one last
+ * time with the database locked and everything still marked is freed.
+ */
+void db_gc_barrier(pgctx_t *ctx, uint64_t old)
 {
-	int64_t t0, t1, t2, t3, t4, t5;
-	memheap_t *heap = _ptr(ctx, ctx->root->heap);
+	gclog_t *log = _ptr(ctx, ctx->root->gcinc.log);
+	uint32_t n;
 
-	t0 = utime_now();
-	pmem_gc_mark(&ctx->mm, heap, 0);
-	t1 = utime_now();
+	if (!old || !log)
+		return;
+	n = atomic_inc(&log->head) - 1;
+	if (n - log->tail < log->size) {
+		log->item[n & (log->size-1)] = old;
+	} else {
+		// The collector fell too far behind.  It will redo the
+		// walk with the database locked.
+		log->overflow = 1;
+	}
+}
 
-	// Synchronize here.  All this does is make sure anyone who was
-	// in the database during the mark phase is out before we do the
-	// walk phase.
-	_dblockop(ctx, MLCK_WR, ctx->root->lock);
-	_dblockop(ctx, MLCK_UN, ctx->root->lock);
+static void gc_roots(pgctx_t *ctx)
+{
+	memheap_t *heap = _ptr(ctx, ctx->root->heap);
+	pidslab_t *slab;
+	dbtype_t log;
+	int i;
 
 	// Eliminate the structures used by the memory subsystem itself
 	gc_keep(ctx, heap);
 	gc_keep(ctx, _ptr(ctx, heap->pool));
+	log.all = ctx->root->gcinc.log;
+	gc_keep(ctx, dbptr(ctx, log));
+	gc_keep(ctx, _ptr(ctx, ctx->root->gcinc.map));
+	gc_keep(ctx, _ptr(ctx, ctx->root->gchist.full));
+	gc_keep(ctx, _ptr(ctx, ctx->root->gchist.fast));
+	gc_keep(ctx, _ptr(ctx, ctx->root->gcgen.old));
+	gc_keep(ctx, _ptr(ctx, ctx->root->gcgen.dirty));
 
 	// Eliminated references in the meta table
 	if (isPtr(ctx->root->meta.id.type)) {
 		gc_keep(ctx, dbptr(ctx, ctx->root->meta.id));
 	}
 
-	t2 = utime_now();
-	gc_walk(ctx, ctx->cache);
-	t3 = utime_now();
-
 	// Eliminate references that have parents that extend back to
-	// the root "data" objects
-	gc_walk(ctx, ctx->data);
+	// the root "data" objects.  Also any references owned by all
+	// currently running processes.
+	pidcache_reap(ctx);
+	for(slab=_ptr(ctx, ctx->root->pidslab); slab; slab=_ptr(ctx, slab->next)) {
+		gc_keep(ctx, slab);
+		for(i=0; i<PIDCACHE_SLOTS; i++)
+			gc_push(ctx, &ctx->gc.stack, slab->slot[i]);
+	}
+	gc_push(ctx, &ctx->gc.stack, ctx->data);
+	gc_push(ctx, &ctx->gc.stack, ctx->cache);
+}
+
+// Get the collector mark bits, making sure they cover the whole file.
+// Only call this while the phase is GC_IDLE: mutators only look for the
+// map while a full collection is marking.
+static gcmap_t *gc_map(pgctx_t *ctx)
+{
+	gcmap_t *map = _ptr(ctx, ctx->root->gcinc.map);
+	uint64_t n, size = mm_size(&ctx->mm);
+
+	if (!map || map->size < size) {
+		// Leave some room for the file to grow.  Blocks past the end
+		// of the map are never treated as garbage.  The old map is
+		// garbage as of the next full collection.
+		n = ((size + size/4) >> 9) + 1;
+		map = dballoc(ctx, sizeof(gcmap_t) + n*sizeof(uint64_t));
+		memset((void*)map->bits, 0, n*sizeof(uint64_t));
+		map->size = n << 9;
+		ctx->root->gcinc.map = _offset(ctx, map);
+	}
+	return map;
+}
+
+/*
+ * Generations.  Most of a big database doesn't change between two full
+ * collections, so a full collection only walks what is new: root->gcgen.old
+ * has a bit for every block which was reachable when the last collection
+ * finished.  Those are shaded before the walk starts, so the walk stops
+ * at them.  The only words of published blocks which ever change are the
+ * root words of containers, and db_gc_remember notes the containers whose
+ * root word was swapped in root->gcgen.dirty.  The trees those old
+ * containers point to now are walked like any other root.
+ *
+ * Old blocks which became garbage aren't found that way.  A major
+ * collection, which walks everything, runs every GC_MAJOR_EVERY full
+ * collections, when asked for (db_gc with complete > 1), and whenever the
+ * generations can't be trusted: a collection was left unfinished, the
+ * barrier log or the dirty map overflowed, the maps had to grow, or dead
+ * readers left retired blocks behind.
+ */
+
+// Get the map of old blocks and the map of changed containers, sized like
+// the mark bits.  Returns 1 if they had to be made anew, in which case
+// nothing is known to be old.
+static int gc_gen_maps(pgctx_t *ctx, gcmap_t *map)
+{
+	gcmap_t *old = _ptr(ctx, ctx->root->gcgen.old);
+	gcmap_t *dirty = _ptr(ctx, ctx->root->gcgen.dirty);
+	uint64_t len = sizeof(gcmap_t) + (map->size >> 9)*sizeof(uint64_t);
+
+	if (old && dirty && old->size == map->size)
+		return 0;
+	// The old maps are garbage as of this (major) collection.  Anyone
+	// still marking the old dirty map is out before the walk starts.
+	old = dballoc(ctx, len);
+	memset(old, 0, len);
+	old->size = map->size;
+	dirty = dballoc(ctx, len);
+	memset(dirty, 0, len);
+	dirty->size = map->size;
+	ctx->root->gcgen.old = _offset(ctx, old);
+	ctx->root->gcgen.dirty = _offset(ctx, dirty);
+	return 1;
+}
+
+// Take the containers changed since the last collection started and walk
+// what old ones point to now.  Young containers are walked anyway, if
+// they're reachable.  Called with the database write locked, so that the
+// bits set from here on are all for the next collection.
+static void gc_dirty(pgctx_t *ctx, int major)
+{
+	gcmap_t *dirty = _ptr(ctx, ctx->root->gcgen.dirty);
+	uint64_t i, n = dirty->size >> 9, bits, ofs;
+	dbval_t *obj;
+
+	for(i=0; i<n; i++) {
+		if (!(bits = dirty->bits[i]))
+			continue;
+		dirty->bits[i] = 0;
+		for(; !major && bits; bits &= bits-1) {
+			ofs = (i << 9) | (__builtin_ctzll(bits) << 3);
+			if (!gc_visited(ctx, ofs))
+				continue;
+			obj = _ptr(ctx, ofs);
+			gc_push(ctx, &ctx->gc.stack, obj->obj);
+		}
+	}
+	ctx->root->gcgen.overflow = 0;
+}
+
+// Whatever the collection found reachable is old now.  Blocks allocated
+// during the walk stay young until a collection has looked inside of them.
+static void gc_age(pgctx_t *ctx, int major)
+{
+	gcmap_t *old = _ptr(ctx, ctx->root->gcgen.old);
+	uint64_t n = old->size >> 9, m;
+
+	m = n < ctx->gc.nvisited ? n : ctx->gc.nvisited;
+	memcpy((void*)old->bits, ctx->gc.visited, m*sizeof(uint64_t));
+	memset((void*)(old->bits + m), 0, (n-m)*sizeof(uint64_t));
+	ctx->root->gcgen.minor = major ? 0 : ctx->root->gcgen.minor+1;
+}
+
+// A block freed by the fast collector may come back as a young block
+static void gc_forget(pgctx_t *ctx, void *addr)
+{
+	gcmap_t *old = _ptr(ctx, ctx->root->gcgen.old);
+
+	if (old)
+		pmem_gcmap_clear(old, _offset(ctx, addr));
+}
+
+// Find the reader slots of processes which went away.  Their retired
+// blocks are freed by this collection and the slots are reused after.
+static uint64_t gc_dead_readers(pgctx_t *ctx)
+{
+	dbreader_t *r;
+	uint64_t dead = 0;
+	unsigned n = 0;
+	int i;
+
+	for(i=0; i<NR_READERS; i++) {
+		r = &ctx->root->readers[i];
+		if (r->state == READER_LIVE && !pid_alive(r->pid))
+			cmpxchg32(&r->state, READER_LIVE, READER_DEAD);
+		if (r->state == READER_DEAD)
+			dead |= 1ULL << i;
+		// Wait for anyone who started freeing before the phase changed
+		while(r->freeing && r->state == READER_LIVE) {
+			if (n >= 64 && !pid_alive(r->pid))
+				break;
+			backoff(&n);
+		}
+	}
+	return dead;
+}
+
+// A heap is shared by every process whose pid maps to it, and only
+// remembers one of them.  Make that one a live reader, so the sweep
+// doesn't retire the heap because some other user of it went away.
+static void gc_heap_owners(pgctx_t *ctx, memheap_t *heap)
+{
+	dbreader_t *r;
+	int i;
+
+	for(i=0; i<NR_READERS; i++) {
+		r = &ctx->root->readers[i];
+		if (r->state == READER_LIVE && pid_alive(r->pid))
+			heap->procheap[pmem_heap_of(heap, r->pid)].id = r->pid;
+	}
+}
+
+static gccount_t gc_total(gccount_t *cls)
+{
+	gccount_t total = { 0, 0 };
+	int i;
+
+	for(i=0; i<GC_NR_CLS; i++) {
+		total.num += cls[i].num;
+		total.size += cls[i].size;
+	}
+	return total;
+}
+
+// Add up the counters of a finished collection and put it in the history.
+// Called with root->gc held.
+static void gc_record(pgctx_t *ctx, gcstats_t *stats)
+{
+	uint64_t *ring = stats->full ? &ctx->root->gchist.full : &ctx->root->gchist.fast;
+	gchist_t *hist = _ptr(ctx, *ring);
+
+	stats->before = gc_total(stats->cls_before);
+	stats->after = gc_total(stats->cls_after);
+	stats->freed = gc_total(stats->cls_freed);
+	if (!hist) {
+		hist = dballoc(ctx, sizeof(gchist_t) + GC_HIST_SZ*sizeof(gcstats_t));
+		memset(hist, 0, sizeof(gchist_t) + GC_HIST_SZ*sizeof(gcstats_t));
+		hist->size = GC_HIST_SZ;
+		*ring = _offset(ctx, hist);
+	}
+	hist->ent[hist->head % hist->size] = *stats;
+	__sync_synchronize();
+	hist->head++;
+}
+
+/*
+ * Copy the statistics of up to n of the most recent full (or fast)
+ * collections to stats, oldest first.  Returns the number copied.
+ */
+int db_gc_history(pgctx_t *ctx, int full, gcstats_t *stats, int n)
+{
+	gchist_t *hist = _ptr(ctx, full ? ctx->root->gchist.full : ctx->root->gchist.fast);
+	uint32_t head, i;
+
+	if (!hist)
+		return 0;
+	head = hist->head;
+	if ((uint32_t)n > head) n = head;
+	if ((uint32_t)n > hist->size) n = hist->size;
+	for(i=0; i<n; i++)
+		stats[i] = hist->ent[(head-n+i) % hist->size];
+	return n;
+}
+
+static void gc_start(pgctx_t *ctx)
+{
+	memheap_t *heap = _ptr(ctx, ctx->root->heap);
+	gcstats_t *stats = &ctx->gc.stats;
+	gclog_t *log;
+	gcmap_t *map, *old;
+	int64_t t0;
+	uint64_t n;
+	int major;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->start = utime_now();
+	stats->pid = getpid();
+	stats->full = 1;
+	major = ctx->gc.major;
+	ctx->gc.major = 0;
+	if (ctx->root->gcinc.phase != GC_IDLE) {
+		// Taking over a collection which never finished.  Get everyone
+		// out who might still be looking at its map, then start over
+		// with a clean one.
+		ctx->root->gcinc.phase = GC_IDLE;
+		_dblockop(ctx, MLCK_WR, ctx->root->lock);
+		_dblockop(ctx, MLCK_UN, ctx->root->lock);
+		map = gc_map(ctx);
+		memset((void*)map->bits, 0, (map->size >> 9)*sizeof(uint64_t));
+		// The changes it took from the dirty map are lost
+		major = 1;
+	}
+	map = gc_map(ctx);
+	if (gc_gen_maps(ctx, map))
+		major = 1;
+
+	log = _ptr(ctx, ctx->root->gcinc.log);
+	if (!log) {
+		log = dballoc(ctx, sizeof(gclog_t) + GC_LOG_SZ*sizeof(uint64_t));
+		log->size = GC_LOG_SZ;
+		ctx->root->gcinc.log = _offset(ctx, log);
+	}
+	// Consumed slots are cleared by gc_drain_log.  Anything left over
+	// is from a collection that didn't finish.
+	if (log->head != log->tail || log->overflow)
+		memset((void*)log->item, 0, log->size*sizeof(uint64_t));
+	log->head = log->tail = 0;
+	log->overflow = 0;
+	memset(ctx->gc.visited, 0, ctx->gc.nvisited*sizeof(uint64_t));
+	ctx->gc.stack.len = 0;
+	ctx->gc.scanned = 0;
+	// What gets allocated from now on counts towards the next one.  The
+	// sweep also frees whatever was suggested.
+	ctx->root->gcpressure.alloc = 0;
+	ctx->root->gcpressure.suggest = 0;
+	ctx->root->gcpressure.grow = 0;
+	ctx->gc.marktime = 0;
+	pmem_count(&ctx->mm, heap, stats->cls_before);
+
+	t0 = utime_now();
+	ctx->root->gcinc.pid = getpid();
+	ctx->root->gcinc.phase = GC_MARK;
+	// See rcufree and ebr_reclaim
+	__sync_synchronize();
+	map->dead = gc_dead_readers(ctx);
+	if (map->dead || ctx->root->gcgen.minor >= GC_MAJOR_EVERY-1)
+		major = 1;
+
+	pmem_gc_mark(&ctx->mm, heap, 0, map);
+	if (!major) {
+		// Don't look inside of old blocks
+		old = _ptr(ctx, ctx->root->gcgen.old);
+		n = old->size >> 9;
+		gc_visited_grow(ctx, n-1);
+		memcpy(ctx->gc.visited, (void*)old->bits, n*sizeof(uint64_t));
+	}
+
+	// Synchronize here.  All this does is make sure anyone who was
+	// in the database during the mark phase is out before we do the
+	// walk phase.  Changes after this are in the barrier log.
+	_dblockop(ctx, MLCK_WR, ctx->root->lock);
+	if (ctx->root->gcgen.overflow && !major) {
+		major = 1;
+		memset(ctx->gc.visited, 0, ctx->gc.nvisited*sizeof(uint64_t));
+	}
+	gc_dirty(ctx, major);
+	_dblockop(ctx, MLCK_UN, ctx->root->lock);
+	stats->major = major;
+
+	gc_roots(ctx);
+	ctx->gc.running = 1;
+	stats->setup = utime_now() - t0;
+}
+
+// Move entries from the barrier log onto the mark stack
+static void gc_drain_log(pgctx_t *ctx)
+{
+	gclog_t *log = _ptr(ctx, ctx->root->gcinc.log);
+	volatile uint64_t *slot;
+	dbtype_t item;
+
+	while(log->tail != log->head && !log->overflow) {
+		// The slot is claimed before it is written
+		slot = &log->item[log->tail & (log->size-1)];
+		while((item.all = *slot) == 0) {
+			if (log->overflow)
+				return;
+		}
+		gc_push(ctx, &ctx->gc.stack, item);
+		*slot = 0;
+		log->tail++;
+	}
+}
+
+#ifndef WIN32
+/*
+ * Parallel marking.
+ *
+ * Each marker thread works depth first on its own private stack.  When
+ * some thread runs out of work, the busy ones move the bottom half of
+ * their stacks (the entries nearest the roots, which are the largest
+ * subtrees) to a shared deque, and idle threads steal from the fullest
+ * deque.  The deques, the idle count and the stop flag are all protected
+ * by one lock: sharing happens rarely, and having every transition under
+ * the lock makes "everyone is idle and nothing is left to steal" an
+ * exact termination test.
+ */
+struct gc_pool;
+struct gc_worker {
+	struct gc_pool *pool;
+	pthread_t thread;
+	struct rcuhelper stack;		// private to the thread
+	struct rcuhelper shared;	// work other threads may steal
+	uint64_t scanned;
+};
+
+struct gc_pool {
+	pgctx_t *ctx;
+	int64_t end;				// deadline (0 means no limit)
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n;
+	volatile int idle, done, stop;
+	struct gc_worker *w;
+};
+
+// Give away the bottom half of our stack.  Called with the pool locked.
+static void gc_share(struct gc_worker *self)
+{
+	struct rcuhelper *st = &self->stack;
+	unsigned i, half = st->len / 2;
+
+	for(i=0; i<half; i++)
+		rcupush(&self->shared, st->addr[i]);
+	memmove(st->addr, st->addr+half, (st->len-half)*sizeof(dbtype_t));
+	st->len -= half;
+	pthread_cond_broadcast(&self->pool->cond);
+}
+
+// Take the contents of the fullest shared deque.  Called with the pool
+// locked.  Returns 0 if there was nothing to steal.
+static int gc_steal(struct gc_worker *self)
+{
+	struct gc_pool *pool = self->pool;
+	struct gc_worker *victim = NULL;
+	struct rcuhelper tmp;
+	int i;
+
+	for(i=0; i<pool->n; i++) {
+		if (pool->w[i].shared.len &&
+				(!victim || pool->w[i].shared.len > victim->shared.len))
+			victim = &pool->w[i];
+	}
+	if (!victim)
+		return 0;
+	// Our own stack is empty, so just trade buffers
+	tmp = self->stack;
+	self->stack = victim->shared;
+	victim->shared = tmp;
+	return 1;
+}
+
+static void *gc_worker_main(void *arg)
+{
+	struct gc_worker *self = arg;
+	struct gc_pool *pool = self->pool;
+	pgctx_t *ctx = pool->ctx;
+	struct gc_pipe pipe = { 0, 0 };
+	dbval_t *p;
+
+	for(;;) {
+		while((p = gc_next(ctx, &self->stack, &pipe)) != NULL) {
+			gc_scan(ctx, &self->stack, p);
+			if ((++self->scanned & 0xFF) != 0)
+				continue;
+			if (pool->stop) {
+				gc_flush(ctx, &self->stack, &pipe);
+				return NULL;
+			}
+			if (pool->end && utime_now() >= pool->end) {
+				gc_flush(ctx, &self->stack, &pipe);
+				pthread_mutex_lock(&pool->lock);
+				pool->stop = 1;
+				pthread_cond_broadcast(&pool->cond);
+				pthread_mutex_unlock(&pool->lock);
+				return NULL;
+			}
+			if (pool->idle && self->stack.len > 1) {
+				pthread_mutex_lock(&pool->lock);
+				gc_share(self);
+				pthread_mutex_unlock(&pool->lock);
+			}
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->idle++;
+		while(!pool->stop && !pool->done && !gc_steal(self)) {
+			if (pool->idle == pool->n) {
+				pool->done = 1;
+				pthread_cond_broadcast(&pool->cond);
+				break;
+			}
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		pool->idle--;
+		if (pool->stop || pool->done) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+// Mark with ctx->gc.nthreads threads until the mark stack is empty or
+// the deadline passes.  Whatever is left over goes back on ctx->gc.stack.
+static void gc_mark_parallel(pgctx_t *ctx, int64_t end)
+{
+	struct gc_pool pool;
+	struct rcuhelper *st = &ctx->gc.stack;
+	dbval_t *p;
+	uint64_t size;
+	unsigned i, j;
+
+	// Expand the roots a little so every thread starts with some
+	// subtrees of its own.
+	for(i=0; st->len && st->len < 4*ctx->gc.nthreads && i < 1024; i++) {
+		if ((p = gc_claim(ctx, st->addr[--st->len])) != NULL) {
+			gc_scan(ctx, st, p);
+			ctx->gc.scanned++;
+		}
+	}
+	if (!st->len)
+		return;
+
+	// The threads must not remap the file or grow the bitmap.  Anything
+	// on the stack was allocated before now, so it is already in the
+	// file and so is everything it refers to.
+	size = mm_size(&ctx->mm);
+	if (size > ctx->mm.size)
+		mm_resize(&ctx->mm, size);
+	gc_visited_grow(ctx, 0);
+
+	memset(&pool, 0, sizeof(pool));
+	pool.ctx = ctx;
+	pool.end = end;
+	pool.n = ctx->gc.nthreads;
+	pool.w = calloc(pool.n, sizeof(struct gc_worker));
+	assert(pool.w);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	for(i=0; i<st->len; i++)
+		rcupush(&pool.w[i % pool.n].stack, st->addr[i]);
+	st->len = 0;
+
+	for(i=1; i<pool.n; i++) {
+		pool.w[i].pool = &pool;
+		if (pthread_create(&pool.w[i].thread, NULL, gc_worker_main, &pool.w[i])) {
+			// Run with fewer threads: our deques can be stolen
+			log_error("GC can't start marker thread");
+			pool.w[i].shared = pool.w[i].stack;
+			memset(&pool.w[i].stack, 0, sizeof(struct rcuhelper));
+			pool.w[i].thread = 0;
+			pool.idle++;
+		}
+	}
+	pool.w[0].pool = &pool;
+	gc_worker_main(&pool.w[0]);
+	for(i=1; i<pool.n; i++) {
+		if (pool.w[i].thread)
+			pthread_join(pool.w[i].thread, NULL);
+	}
+
+	for(i=0; i<pool.n; i++) {
+		ctx->gc.scanned += pool.w[i].scanned;
+		for(j=0; j<pool.w[i].shared.len; j++)
+			rcupush(st, pool.w[i].shared.addr[j]);
+		for(j=0; j<pool.w[i].stack.len; j++)
+			rcupush(st, pool.w[i].stack.addr[j]);
+		free(pool.w[i].shared.addr);
+		free(pool.w[i].stack.addr);
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.w);
+}
+#endif
+
+// Walk until the mark stack is empty or budget microseconds have passed
+// (a negative budget means no limit).  Returns 1 if there is more to do.
+static int gc_mark(pgctx_t *ctx, int64_t budget)
+{
+	int64_t end = utime_now() + budget;
+	struct gc_pipe pipe = { 0, 0 };
+	dbval_t *p;
+
+	for(;;) {
+		gc_drain_log(ctx);
+		if (!ctx->gc.stack.len)
+			return 0;
+#ifndef WIN32
+		if (ctx->gc.nthreads > 1) {
+			gc_mark_parallel(ctx, budget >= 0 ? end : 0);
+			if (ctx->gc.stack.len)
+				return 1;
+			continue;
+		}
+#endif
+		while((p = gc_next(ctx, &ctx->gc.stack, &pipe)) != NULL) {
+			gc_scan(ctx, &ctx->gc.stack, p);
+			ctx->gc.scanned++;
+			if (budget >= 0 && (ctx->gc.scanned & 0xFF) == 0 &&
+					utime_now() >= end) {
+				gc_flush(ctx, &ctx->gc.stack, &pipe);
+				return 1;
+			}
+		}
+	}
+}
+
+static void gc_finish(pgctx_t *ctx)
+{
+	memheap_t *heap = _ptr(ctx, ctx->root->heap);
+	gcstats_t *stats = &ctx->gc.stats;
+	gclog_t *log = _ptr(ctx, ctx->root->gcinc.log);
+	gcmap_t *map = _ptr(ctx, ctx->root->gcinc.map);
+	uint64_t i, n;
+	int64_t t0, t1, t2;
+
+	t0 = utime_now();
+	_dblockop(ctx, MLCK_WR, ctx->root->lock);
+	gc_mark(ctx, -1);
+	if (log->overflow) {
+		// Some replaced roots were not logged, so start over.  Nobody
+		// can change anything while we hold the lock.
+		log_debug("GC barrier log overflow, remarking");
+		stats->major = 1;
+		memset(ctx->gc.visited, 0, ctx->gc.nvisited*sizeof(uint64_t));
+		ctx->gc.stack.len = 0;
+		pmem_gc_mark(&ctx->mm, heap, 0, map);
+		gc_roots(ctx);
+		gc_mark(ctx, -1);
+	}
+
+	// Whatever we visited isn't garbage
+	n = map->size >> 9;
+	if (n > ctx->gc.nvisited) n = ctx->gc.nvisited;
+	for(i=0; i<n; i++) {
+		if (map->bits[i] & ctx->gc.visited[i])
+			map->bits[i] &= ~ctx->gc.visited[i];
+	}
+	ctx->root->gcinc.phase = GC_SWEEP;
+	_dblockop(ctx, MLCK_UN, ctx->root->lock);
+	ctx->gc.running = 0;
+	t1 = utime_now();
 
-	// Also any references owned by all currently running processes
-	gc_walk(ctx, ctx->root->pidcache);
-	t4 = utime_now();
 	// Free everything that remains
-	//pmem_gc_free(&ctx->mm, heap, 0, (gcfreecb_t)dbcache_del, ctx);
-	pmem_gc_free(&ctx->mm, heap, 0, NULL, ctx);
-
-	t5 = utime_now();
-	log_debug("GC timing:");
-	log_debug("  mark: %lldus", t1-t0);
-	log_debug("  sync: %lldus", t2-t1);
-	log_debug(" cache: %lldus", t3-t2);
-	log_debug("  walk: %lldus", t4-t3);
-	log_debug("  free: %lldus", t5-t4);
-	log_debug(" total: %lldus", t5-t0);
+	gc_heap_owners(ctx, heap);
+	//pmem_gc_free(&ctx->mm, heap, 0, map, stats->cls_freed, (gcfreecb_t)dbcache_del, ctx);
+	pmem_gc_free(&ctx->mm, heap, 0, map, stats->cls_freed, NULL, ctx);
+	for(i=0; i<NR_READERS; i++) {
+		if ((map->dead >> i) & 1) {
+			ctx->root->readers[i].pid = 0;
+			ctx->root->readers[i].state = READER_FREE;
+		}
+	}
+	map->dead = 0;
+	gc_age(ctx, stats->major);
+	ctx->root->gcinc.phase = GC_IDLE;
+	t2 = utime_now();
+
+	pmem_count(&ctx->mm, heap, stats->cls_after);
+	ctx->root->gcpressure.full_at = gc_total(stats->cls_after).size / 2;
+
+	ctx->gc.marktime += t1-t0;
+	stats->remark = t1-t0;
+	stats->scanned = ctx->gc.scanned;
+	stats->marktime = ctx->gc.marktime;
+	stats->sweep = t2-t1;
+	stats->total = t2 - stats->start;
+	gc_record(ctx, stats);
+	log_debug("GC remark: %lldus", t1-t0);
+	log_debug("GC mark: %llu blocks in %lldus (%.0f blocks/s)",
+			ctx->gc.scanned, ctx->gc.marktime,
+			ctx->gc.marktime ? ctx->gc.scanned * 1e6 / ctx->gc.marktime : 0.0);
+	log_debug("GC free: %llu blocks (%llu bytes) in %lldus",
+			stats->freed.num, stats->freed.size, t2-t1);
+}
+
+// Run one slice of the full GC.  Returns 1 if the collection isn't done.
+static int _db_gc_step(pgctx_t *ctx, int64_t budget, gcstats_t *stats)
+{
+	int64_t t0, tm, t1;
+	int more;
+
+	if (ctx->gc.running && (ctx->root->gcinc.phase == GC_IDLE ||
+				ctx->root->gcinc.pid != getpid())) {
+		// Some other process finished (or took over) our collection
+		ctx->gc.running = 0;
+		return 0;
+	}
+
+	t0 = utime_now();
+	if (!ctx->gc.running) {
+		// Also takes over a collection some other process left behind
+		gc_start(ctx);
+	}
+	tm = utime_now();
+	more = gc_mark(ctx, budget);
+	t1 = utime_now();
+	ctx->gc.marktime += t1-tm;
+	ctx->gc.stats.slices++;
+	if (t1-t0 > ctx->gc.stats.max_slice)
+		ctx->gc.stats.max_slice = t1-t0;
+	log_debug("GC slice: %lldus, %u pending", t1-t0, ctx->gc.stack.len);
+
+	if (!more)
+		gc_finish(ctx);
+	if (stats)
+		*stats = ctx->gc.stats;
+	return more;
+}
+
+int _db_gc(pgctx_t *ctx, gcstats_t *stats)
+{
+	int64_t t0 = utime_now();
+
+	// Start over so the whole collection happens during this call
+	ctx->gc.running = 0;
+	_db_gc_step(ctx, -1, stats);
+	log_debug("GC total: %lldus", utime_now()-t0);
 	return 0;
 }
 
-int _db_gc_fast(pgctx_t *ctx)
+int _db_gc_fast(pgctx_t *ctx, gcstats_t *stats)
 {
 	memheap_t *heap = _ptr(ctx, ctx->root->heap);
+	gcmap_t *map = gc_map(ctx);
+	gcstats_t st;
+	int64_t t0, t1;
+
+	memset(&st, 0, sizeof(st));
+	st.start = utime_now();
+	st.pid = getpid();
+	pmem_count(&ctx->mm, heap, st.cls_before);
+	t0 = utime_now();
+	ctx->root->gcpressure.suggest = 0;
 
 	// Synchronize here.  All this does is make sure anyone who was
 	// in the database using the blocks that were suggested to be
 	// freed is now out of the database and the blocks can be
 	// safely freed.
-	pmem_gc_mark(&ctx->mm, heap, 1);
+	pmem_gc_mark(&ctx->mm, heap, 1, map);
 	_dblockop(ctx, MLCK_WR, ctx->root->lock);
 	_dblockop(ctx, MLCK_UN, ctx->root->lock);
-	pmem_gc_free(&ctx->mm, heap, 1, NULL, ctx);
-	//pmem_gc_free(&ctx->mm, heap, 1, (gcfreecb_t)dbcache_del, ctx);
+	t1 = utime_now();
+	pmem_gc_free(&ctx->mm, heap, 1, map, st.cls_freed, (gcfreecb_t)gc_forget, ctx);
+	//pmem_gc_free(&ctx->mm, heap, 1, map, st.cls_freed, (gcfreecb_t)dbcache_del, ctx);
+	st.setup = t1-t0;
+	st.sweep = utime_now()-t1;
+	pmem_count(&ctx->mm, heap, st.cls_after);
+	st.total = utime_now() - st.start;
+	gc_record(ctx, &st);
+	if (stats)
+		*stats = st;
 	return 0;
 }
 
@@ -353,11 +1450,56 @@ int db_gc(pgctx_t *ctx, int complete, gcstats_t *stats)
 {
 	int num;
 	_dblockop(ctx, MLCK_WR, ctx->root->gc);
+	if (complete > 1)
+		ctx->gc.major = 1;
 	if (complete) {
 		num = _db_gc(ctx, stats);
+	} else if (ctx->root->gcinc.phase != GC_IDLE) {
+		// While a full collection is marking, every block looks like
+		// garbage to the fast collector.  Finish the full collection
+		// if the process running it went away.
+		num = 0;
+		if (!pid_alive(ctx->root->gcinc.pid))
+			num = _db_gc(ctx, stats);
 	} else {
-		num = _db_gc_fast(ctx);
+		num = _db_gc_fast(ctx, stats);
 	}
 	_dblockop(ctx, MLCK_UN, ctx->root->gc);
 	return num;
 }
+
+/*
+ * Run the collection the allocation counters call for, if any, unless
+ * some process is already running a full one.  Returns what it ran (see
+ * db_gc_pressure).
+ */
+int db_gc_auto(pgctx_t *ctx, gcstats_t *stats)
+{
+	int want;
+
+	_dblockop(ctx, MLCK_WR, ctx->root->gc);
+	want = db_gc_pressure(ctx);
+	if (ctx->root->gcinc.phase != GC_IDLE)
+		want = 0;
+	if (want == 2)
+		_db_gc(ctx, stats);
+	else if (want == 1)
+		_db_gc_fast(ctx, stats);
+	_dblockop(ctx, MLCK_UN, ctx->root->gc);
+	return want;
+}
+
+/*
+ * Run one slice of an incremental full collection, starting a new one
+ * if none is in progress.  budget is the slice length in microseconds.
+ * Returns 1 while the collection is still in progress and 0 once it has
+ * finished.
+ */
+int db_gc_step(pgctx_t *ctx, int64_t budget, gcstats_t *stats)
+{
+	int more;
+	_dblockop(ctx, MLCK_WR, ctx->root->gc);
+	more = _db_gc_step(ctx, budget, stats);
+	_dblockop(ctx, MLCK_UN, ctx->root->gc);
+	return more;
+}
@@ -35,6 +35,26 @@ dbtype_t dbint_new(pgctx_t *ctx, int64_t val)
 	return obj;
 }
 
+// Add delta to the Int a.  Returns CAS_ERR_INT if a isn't an Int and
+// CAS_ERR_OVERFLOW if the result doesn't fit into the 60 bits available
+// for an Int.
+int dbint_add(pgctx_t *ctx, dbtype_t a, int64_t delta, dbtype_t *result)
+{
+	dbtype_t obj;
+	int64_t val;
+
+	if (a.type != Int)
+		return CAS_ERR_INT;
+	if (__builtin_add_overflow((int64_t)a.val, delta, &val))
+		return CAS_ERR_OVERFLOW;
+	obj.type = Int;
+	obj.val = val;
+	if (obj.val != val)
+		return CAS_ERR_OVERFLOW;
+	*result = obj;
+	return 0;
+}
+
 dbtype_t dbstrtol(pgctx_t *ctx, dbtype_t s)
 {
 	dbtype_t ret;
@@ -123,6 +143,38 @@ dbtype_t dbstring_new(pgctx_t *ctx, const char *val, int len)
 }
 
 #ifdef WANT_UUID_TYPE
+/*
+ * New ids are laid out like a version 7 UUID:  the time in milliseconds,
+ * big endian, and the fraction of the millisecond in 12 bits come first,
+ * and the rest is random.  Uuids compare bytewise, so ids sort in the
+ * order they were made and a collection keyed by them grows at its end.
+ * The last time handed out is kept so that ids made within one tick of
+ * the clock still increase.
+ */
+static void uuid_generate_ordered(uint8_t *uu)
+{
+	static volatile uint64_t last;
+	uint64_t now, prev, next;
+	int64_t us = utime_now();
+
+	now = (uint64_t)(us / 1000) << 12 | (us % 1000) * 4096 / 1000;
+	do {
+		prev = last;
+		next = (now > prev) ? now : prev+1;
+	} while(!cmpxchg64(&last, prev, next));
+
+	// The random uuid already has the variant bits set
+	uuid_generate_random(uu);
+	uu[0] = next >> 52;
+	uu[1] = next >> 44;
+	uu[2] = next >> 36;
+	uu[3] = next >> 28;
+	uu[4] = next >> 20;
+	uu[5] = next >> 12;
+	uu[6] = 0x70 | ((next >> 8) & 0x0f);
+	uu[7] = next;
+}
+
 // FIXME: store uuids in cache?
 dbtype_t dbuuid_new(pgctx_t *ctx, uint8_t *val)
 {
@@ -131,7 +183,7 @@ dbtype_t dbuuid_new(pgctx_t *ctx, uint8_t *val)
 	if (val) {
 		memcpy(uu->uuval, val, 16);
 	} else {
-		uuid_generate_time(uu->uuval);
+		uuid_generate_ordered(uu->uuval);
 	}
 	return dboffset(ctx, uu);
 }
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pongo/bonsai.h>
+#include <pongo/btree.h>
 #include <pongo/json.h>
 #include <pongo/log.h>
 
@@ -201,6 +202,13 @@ static void collection_helper(pgctx_t *ctx, dbtype_t node, void *user)
     json_emit(j, node.ptr->value);
 }
 
+static void btree_helper(pgctx_t *ctx, dbtype_t key, dbtype_t value, void *user)
+{
+    jsonctx_t *j = (jsonctx_t*)user;
+    json_emit(j, key);
+    json_emit(j, value);
+}
+
 char *json_emit(jsonctx_t *ctx, dbtype_t db)
 {
 	yajl_gen g = ctx->json.generator;
@@ -314,6 +322,11 @@ char *json_emit(jsonctx_t *ctx, dbtype_t db)
 			yajl_gen_map_open(g);
             bonsai_foreach(ctx->dbctx, db.ptr->obj, collection_helper, ctx);
 			yajl_gen_map_close(g);
+            break;
+		case BTreeCollection:
+			yajl_gen_map_open(g);
+            btree_foreach(ctx->dbctx, db.ptr->obj, btree_helper, ctx);
+			yajl_gen_map_close(g);
             break;
 		default:
 			log_error("Unknown type: %d at %" PRIx64 "\n", type, db.all);
@@ -1,4 +1,8 @@
 #include <math.h>
+#ifndef WIN32
+#include <signal.h>
+#include <errno.h>
+#endif
 #include <pongo/misc.h>
 
 #ifndef WIN32
@@ -18,6 +22,11 @@ int gettid(void)
     tid = syscall(SYS_gettid);
     return tid;
 }
+
+int pid_alive(int pid)
+{
+    return !(kill(pid, 0) < 0 && errno == ESRCH);
+}
 #else
 int getpid(void)
 {
@@ -29,6 +38,18 @@ int gettid(void)
     return (int)GetCurrentThreadId();
 }
 
+int pid_alive(int pid)
+{
+    HANDLE h = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    DWORD ret;
+
+    if (!h)
+        return 0;
+    ret = WaitForSingleObject(h, 0);
+    CloseHandle(h);
+    return ret == WAIT_TIMEOUT;
+}
+
 int64_t utime_now(void)
 {
     int64_t now;
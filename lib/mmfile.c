@@ -6,6 +6,10 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <pongo/mmfile.h>
 #include <pongo/log.h>
@@ -165,3 +169,31 @@ int mm_lock(mmfile_t *mm, uint32_t flags, uint64_t offset, uint64_t len)
 	} while (ret < 0 && errno == EINTR && !(flags & MLCK_INTR));
 	return ret;
 }
+
+/*
+ * Sleep until *addr no longer contains val, or until timeout (in
+ * microseconds) expires.  A negative timeout waits forever.  The futex
+ * is keyed on the shared file mapping, so wakeups work across processes.
+ * Returns 0 if woken (or the value already changed), -1 on timeout.
+ */
+int mm_wait(volatile uint32_t *addr, uint32_t val, int64_t timeout)
+{
+	struct timespec ts, *tp = NULL;
+	int ret;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000000;
+		ts.tv_nsec = (timeout % 1000000) * 1000;
+		tp = &ts;
+	}
+	ret = syscall(SYS_futex, addr, FUTEX_WAIT, val, tp, NULL, 0);
+	if (ret < 0 && errno == ETIMEDOUT)
+		return -1;
+	return 0;
+}
+
+// Wake all processes sleeping in mm_wait on addr
+void mm_wake(volatile uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
@@ -224,3 +224,23 @@ int mm_lock(mmfile_t *mm, uint32_t flags, uint64_t offset, uint64_t len)
 	ret = -!ret;
 	return ret;
 }
+
+/*
+ * Windows has no cross-process futex on a file mapping, so waiters
+ * simply poll.
+ */
+int mm_wait(volatile uint32_t *addr, uint32_t val, int64_t timeout)
+{
+	while(*addr == val) {
+		if (timeout == 0)
+			return -1;
+		Sleep(1);
+		if (timeout > 0)
+			timeout = (timeout > 1000) ? timeout - 1000 : 0;
+	}
+	return 0;
+}
+
+void mm_wake(volatile uint32_t *addr)
+{
+}
@@ -1,76 +1,177 @@
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <pongo/context.h>
 #include <pongo/dbtypes.h>
+#include <pongo/dbmem.h>
+#include <pongo/pidcache.h>
 #include <pongo/atomic.h>
 #include <pongo/misc.h>
 #include <pongo/log.h>
 
-int pidcache_new(pgctx_t *ctx)
+/*
+ * The pidcache pins the objects a process refers to from outside of the
+ * database.  Pinning an object and letting go of it only touch a single
+ * slot: the free slots of each process are kept in a local stack of
+ * handles.  A handle is the index of the slab in ctx->pin.slab times
+ * PIDCACHE_SLOTS, plus the slot, plus 1.
+ *
+ * These are called with the database locked, so dblock keeps
+ * ctx->ebr.pid current.  Slabs set up before a fork are the parent's.
+ */
+
+// Adopt a slab some process gave up, or make a new one, and add its
+// slots to the free list.
+static int pidcache_grow(pgctx_t *ctx)
 {
-	dbtype_t pc;
-	dbtype_t root_pc;
-	dbtype_t pid;
-    dbval_t *pcp;
-    int _pid;
-
-    root_pc = ctx->root->pidcache;
-    _pid = getpid();
-	pid = dbint_new(ctx, _pid);
-	pc = dbcollection_new(ctx, 0);
-
-	if (dbcollection_setitem(ctx, root_pc, pid, pc, SET_OR_FAIL) < 0) {
-        log_error("pid=%d: pidcache already exists", _pid);
-        dbcollection_getitem(ctx, root_pc, pid, &pc);
+    pidslab_t *slab = NULL;
+    uint64_t ofs;
+    uint32_t n, i;
+
+    for(ofs=ctx->root->pidslab; ofs; ofs=slab->next) {
+        slab = _ptr(ctx, ofs);
+        if (slab->pid == 0 && cmpxchg32(&slab->pid, 0, ctx->pin.pid))
+            break;
+    }
+    if (!ofs) {
+        // Blocks allocated and linked while we hold the lock are
+        // either found by the next full GC or never marked as garbage.
+        slab = dballoc(ctx, sizeof(pidslab_t));
+        if (!slab) {
+            log_error("pid=%d: can't allocate a pidcache slab", ctx->pin.pid);
+            return -1;
+        }
+        memset(slab, 0, sizeof(pidslab_t));
+        slab->pid = ctx->pin.pid;
+        ofs = _offset(ctx, slab);
+        do {
+            slab->next = ctx->root->pidslab;
+        } while(!cmpxchg64(&ctx->root->pidslab, slab->next, ofs));
     }
 
-    pcp = dbptr(ctx, pc);
-    atomic_inc(&pcp->refcnt);
-    ctx->pidcache = pc;
-    return _pid;
+    n = ctx->pin.nslab++;
+    ctx->pin.slab = realloc(ctx->pin.slab, ctx->pin.nslab*sizeof(uint64_t));
+    ctx->pin.slab[n] = ofs;
+    // Room for every handle we have, since they may all come back
+    ctx->pin.free = realloc(ctx->pin.free, ctx->pin.nslab*PIDCACHE_SLOTS*sizeof(uint32_t));
+    // Hand out the lowest slots first
+    for(i=PIDCACHE_SLOTS; i>0; i--)
+        ctx->pin.free[ctx->pin.nfree++] = n*PIDCACHE_SLOTS + i;
+    return 0;
 }
 
-void pidcache_put(pgctx_t *ctx, void *localobj, dbtype_t dbobj)
+int pidcache_new(pgctx_t *ctx)
 {
-    dbtype_t key;
-    // make sure the pidcache is valid
-    // also make sure we aren't trying to put the pidcache into
-    // the pidcache.  The GC will die horribly if there is a cycle.
-    if (ctx->pidcache.all && ctx->pidcache.all != dbobj.all) {
-        key = dbint_new(ctx, (unsigned long)localobj);
-        dbcollection_setitem(ctx, ctx->pidcache, key, dbobj, 0);
+    int pid = getpid();
+
+    if (ctx->pin.pid == pid) {
+        ctx->pin.refcnt++;
+        return pid;
     }
+    // Forget about anything inherited from our parent
+    free(ctx->pin.slab);
+    free(ctx->pin.free);
+    memset(&ctx->pin, 0, sizeof(ctx->pin));
+    ctx->pin.pid = pid;
+    ctx->pin.refcnt = 1;
+    pidcache_grow(ctx);
+    return pid;
 }
 
-void pidcache_del(pgctx_t *ctx, void *localobj)
+uint32_t pidcache_put(pgctx_t *ctx, dbtype_t dbobj)
 {
-    dbtype_t key;
-    if (ctx->pidcache.all) {
-        key = dbint_new(ctx, (unsigned long)localobj);
-        dbcollection_delitem(ctx, ctx->pidcache, key, NULL, 0);
+    pidslab_t *slab;
+    uint32_t h;
+
+    if (!dbobj.all || !isPtr(dbobj.type))
+        return 0;
+    if (ctx->pin.pid != ctx->ebr.pid) {
+        if (!ctx->pin.pid)
+            return 0;
+        pidcache_new(ctx);
     }
+    if (!ctx->pin.nfree && pidcache_grow(ctx) < 0)
+        return 0;
+
+    h = ctx->pin.free[--ctx->pin.nfree];
+    slab = _ptr(ctx, ctx->pin.slab[(h-1) / PIDCACHE_SLOTS]);
+    slab->slot[(h-1) % PIDCACHE_SLOTS] = dbobj;
+    return h;
 }
 
-void pidcache_destroy(pgctx_t *ctx)
+static void pidcache_clear(pgctx_t *ctx, dbtype_t *slot)
+{
+    uint64_t old = slot->all;
+
+    *slot = DBNULL;
+    // The collector may not have seen the slot yet
+    if (old && ctx->root->gcinc.phase == GC_MARK)
+        db_gc_barrier(ctx, old);
+}
+
+void pidcache_del(pgctx_t *ctx, uint32_t h)
 {
-	dbtype_t root_pc;
-	dbtype_t pid;
-    dbval_t *pcp;
-    int _pid;
+    pidslab_t *slab;
 
-    if (!ctx->pidcache.all)
+    if (!h || ctx->pin.pid != ctx->ebr.pid)
         return;
+    slab = _ptr(ctx, ctx->pin.slab[(h-1) / PIDCACHE_SLOTS]);
+    pidcache_clear(ctx, &slab->slot[(h-1) % PIDCACHE_SLOTS]);
+    ctx->pin.free[ctx->pin.nfree++] = h;
+}
+
+/*
+ * Give back the slabs of processes which went away without calling
+ * pidcache_destroy, so that what they pinned can be freed.  The slots are
+ * cleared without the write barrier: only the collector calls this, before
+ * it looks at the slots.
+ */
+int pidcache_reap(pgctx_t *ctx)
+{
+    pidslab_t *slab;
+    uint32_t pid;
+    int i, n = 0;
+
+    for(slab=_ptr(ctx, ctx->root->pidslab); slab; slab=_ptr(ctx, slab->next)) {
+        pid = slab->pid;
+        if (!pid || pid_alive(pid))
+            continue;
+        for(i=0; i<PIDCACHE_SLOTS; i++)
+            slab->slot[i] = DBNULL;
+        __sync_synchronize();
+        if (cmpxchg32(&slab->pid, pid, 0)) {
+            log_debug("pid=%u went away, released its pidcache slab", pid);
+            n++;
+        }
+    }
+    return n;
+}
 
-    root_pc = ctx->root->pidcache;
-    _pid = getpid();
-	pid = dbint_new(ctx, _pid);
+void pidcache_destroy(pgctx_t *ctx)
+{
+    pidslab_t *slab;
+    uint32_t i, j;
+
+    if (!ctx->pin.pid || ctx->pin.pid != getpid())
+        return;
+    if (--ctx->pin.refcnt > 0) {
+        log_error("pid=%d: pidcache not destroyed (refcnt=%d)", ctx->pin.pid, ctx->pin.refcnt);
+        return;
+    }
 
-    pcp = dbptr(ctx, ctx->pidcache);
-    if (atomic_dec(&pcp->refcnt) == 0) {
-        dbcollection_delitem(ctx, root_pc, pid, NULL, 0);
-        ctx->pidcache = DBNULL;
-    } else {
-        log_error("pid=%d: pidcache not destroyed (refcnt=%d)", _pid, pcp->refcnt);
+    // Unpin everything and give the slabs back
+    for(i=0; i<ctx->pin.nslab; i++) {
+        slab = _ptr(ctx, ctx->pin.slab[i]);
+        for(j=0; j<PIDCACHE_SLOTS; j++) {
+            if (slab->slot[j].all)
+                pidcache_clear(ctx, &slab->slot[j]);
+        }
+        __sync_synchronize();
+        slab->pid = 0;
     }
+    free(ctx->pin.slab);
+    free(ctx->pin.free);
+    memset(&ctx->pin, 0, sizeof(ctx->pin));
 }
 
 // vim: ts=4 sts=4 sw=4 expandtab:
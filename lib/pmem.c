@@ -45,7 +45,7 @@ mempool_t *pmem_pool_init(void *addr, uint32_t size)
 void *pmem_pool_alloc(mempool_t *pool, uint32_t size)
 {
     unsigned p, i, n, sz, psz;
-    pdescr_t desc, newdesc;
+    pdescr_t desc, best, newdesc;
     uint8_t *ret;
     poolblock_t *pb;
 
@@ -66,11 +66,13 @@ void *pmem_pool_alloc(mempool_t *pool, uint32_t size)
             if (sz >= size && sz < psz) {
                 psz = sz;
                 p = i;
+                best = desc;
             }
         }
         if (psz == -1)
             break;
 
+        desc = best;
         newdesc = desc;
         newdesc.e_ofs -= size;
         ret = ((uint8_t*)pool + newdesc.e_ofs);
@@ -423,9 +425,13 @@ static inline int pmem_heap(memheap_t *heap)
     static int ph;
     int pid = getpid();
     if (!ph) {
-        ph = 1 + pid % (heap->nr_procheap-1);
+        ph = pmem_heap_of(heap, pid);
         log_bare("pid %d using heap %d", pid, ph);
     }
+    // Remember who uses the heap, so it can be retired once they're gone
+    // (see gc_heap_owners)
+    if (heap->procheap[ph].id != (uint64_t)pid)
+        heap->procheap[ph].id = pid;
     return ph;
 }
 
@@ -508,49 +514,53 @@ void pmem_retire(mmfile_t *mm, memheap_t *heap, int ph)
     }
 }
 
-void pmem_gc_mark_sb(mmfile_t *mm, superblock_t *sb)
+void pmem_gc_mark_sb(mmfile_t *mm, superblock_t *sb, gcmap_t *map)
 {
     memblock_t *mb;
     uint8_t *p;
+    uint64_t ofs;
     unsigned i;
     
     while(sb) {
         p = (uint8_t*)(sb+1);
-        for(i=0; i<sb->total; i++, p+=sb->size+sizeof(*mb)) {
+        ofs = __offset(mm, p) + sizeof(*mb);
+        for(i=0; i<sb->total; i++, p+=sb->size+sizeof(*mb), ofs+=sb->size+sizeof(*mb)) {
             mb = (memblock_t*)p;
-            if (mb->alloc) {
-                mb->gc = 1;
+            if (mb->alloc && !pmem_gcmap_owned(map, mb)) {
+                pmem_gcmap_set(map, ofs);
             }
         }
-        sb->gc = 1;
-        sb->suggest = 0;
+        // Only write to the superblock if we have to
+        if (sb->suggest)
+            sb->suggest = 0;
         sb = __ptr(mm, sb->next);
     }
 }
 
-void pmem_gc_mark_suggest(mmfile_t *mm, superblock_t *sb)
+void pmem_gc_mark_suggest(mmfile_t *mm, superblock_t *sb, gcmap_t *map)
 {
     memblock_t *mb;
     uint8_t *p;
+    uint64_t ofs;
     unsigned i;
     
     while(sb) {
         if (sb->suggest) {
             p = (uint8_t*)(sb+1);
-            for(i=0; i<sb->total; i++, p+=sb->size+sizeof(*mb)) {
+            ofs = __offset(mm, p) + sizeof(*mb);
+            for(i=0; i<sb->total; i++, p+=sb->size+sizeof(*mb), ofs+=sb->size+sizeof(*mb)) {
                 mb = (memblock_t*)p;
                 if (mb->suggest) {
-                    mb->gc = 1;
+                    pmem_gcmap_set(map, ofs);
                 }
             }
-            sb->gc = 1;
             sb->suggest = 0;
         }
         sb = __ptr(mm, sb->next);
     }
 }
 
-void pmem_gc_mark(mmfile_t *mm, memheap_t *heap, int suggest)
+void pmem_gc_mark(mmfile_t *mm, memheap_t *heap, int suggest, gcmap_t *map)
 {
     poolblock_t *pb;
     unsigned i, j;
@@ -559,37 +569,41 @@ void pmem_gc_mark(mmfile_t *mm, memheap_t *heap, int suggest)
         for(j=0; j<NR_SZCLS; j++) {
             if (suggest) {
                 pmem_gc_mark_suggest(mm,
-                        __ptr(mm, heap->procheap[i].szcls[j].freelist));
+                        __ptr(mm, heap->procheap[i].szcls[j].freelist), map);
                 pmem_gc_mark_suggest(mm,
-                        __ptr(mm, heap->procheap[i].szcls[j].fulllist));
+                        __ptr(mm, heap->procheap[i].szcls[j].fulllist), map);
             } else {
                 pmem_gc_mark_sb(mm,
-                        __ptr(mm, heap->procheap[i].szcls[j].freelist));
+                        __ptr(mm, heap->procheap[i].szcls[j].freelist), map);
                 pmem_gc_mark_sb(mm,
-                        __ptr(mm, heap->procheap[i].szcls[j].fulllist));
+                        __ptr(mm, heap->procheap[i].szcls[j].fulllist), map);
             }
         }
     }
     
     pb = __ptr(mm, heap->pool_alloc);
     while(pb) {
-        pb->gc = 1;
+        pmem_gcmap_set(map, __offset(mm, pb+1));
         pb = __ptr(mm, pb->next);
     }
 }
 
-int pmem_gc_free_sb(superblock_t *sb, gcfreecb_t callback, void *user)
+int pmem_gc_free_sb(mmfile_t *mm, superblock_t *sb, gcmap_t *map, gcfreecb_t callback, void *user)
 {
     memblock_t *mb;
     uint8_t *p;
+    uint64_t ofs;
     unsigned i, n;
     
 
-    sb->gc = 0;
     p = (uint8_t*)(sb+1);
-    for(n=i=0; i<sb->total; i++, p+=sb->size+sizeof(*mb)) {
+    ofs = __offset(mm, p) + sizeof(*mb);
+    for(n=i=0; i<sb->total; i++, p+=sb->size+sizeof(*mb), ofs+=sb->size+sizeof(*mb)) {
         mb = (memblock_t*)p;
-        if (mb->gc) {
+        if (pmem_gcmap_test(map, ofs)) {
+            pmem_gcmap_clear(map, ofs);
+            if (!mb->alloc || pmem_gcmap_owned(map, mb))
+                continue;
             if (callback) callback(user, mb+1);
             pmem_sb_free(sb, mb+1);
             n++;
@@ -598,7 +612,7 @@ int pmem_gc_free_sb(superblock_t *sb, gcfreecb_t callback, void *user)
     return n;
 }
 
-void pmem_gc_free_sblist(mmfile_t *mm, volatile mlist_t *memory, gcfreecb_t callback, void *user)
+void pmem_gc_free_sblist(mmfile_t *mm, volatile mlist_t *memory, gcmap_t *map, pmemcount_t *freed, gcfreecb_t callback, void *user)
 {
     uint64_t oldval, newval;
     superblock_t *sb;
@@ -618,7 +632,9 @@ void pmem_gc_free_sblist(mmfile_t *mm, volatile mlist_t *memory, gcfreecb_t call
     newval = oldval;
     sb = __ptr(mm, newval);
     while(sb) {
-        pmem_gc_free_sb(sb, callback, user);
+        n = pmem_gc_free_sb(mm, sb, map, callback, user);
+        freed->num += n;
+        freed->size += n*sb->size;
         oldval = sb->next;
 #if 1
         do {
@@ -639,7 +655,9 @@ void pmem_gc_free_sblist(mmfile_t *mm, volatile mlist_t *memory, gcfreecb_t call
     newval = oldval;
     sb = __ptr(mm, newval);
     while(sb) {
-        n = pmem_gc_free_sb(sb, callback, user);
+        n = pmem_gc_free_sb(mm, sb, map, callback, user);
+        freed->num += n;
+        freed->size += n*sb->size;
         oldval = sb->next;
         if (n) {
             do {
@@ -741,17 +759,22 @@ void pmem_relist_pools(mmfile_t *mm, memheap_t *heap)
     heap->pool = __offset(mm, pool);
 }
 
-void pmem_gc_free(mmfile_t *mm, memheap_t *heap, int fast, gcfreecb_t cb, void *user)
+/*
+ * Free every allocated block whose bit is set in map.  What was freed is
+ * added to freed[], which has NR_SZCLS+1 counters (see pmemcount_t).
+ */
+void pmem_gc_free(mmfile_t *mm, memheap_t *heap, int fast, gcmap_t *map, pmemcount_t *freed, gcfreecb_t cb, void *user)
 {
     poolblock_t *pb;
     unsigned i, j;
-    uint64_t oldval, newval;
-    uint64_t now;
+    uint64_t oldval, newval, ofs;
+    procheap_t *ph;
+    int64_t now, last;
 
     free_pattern = fast ? 0xFE : 0xFA;
     for(i=0; i<heap->nr_procheap; i++) {
         for(j=0; j<NR_SZCLS; j++) {
-            pmem_gc_free_sblist(mm, &heap->procheap[i].szcls[j], cb, user);
+            pmem_gc_free_sblist(mm, &heap->procheap[i].szcls[j], map, &freed[j], cb, user);
         }
     }
 
@@ -760,8 +783,15 @@ void pmem_gc_free(mmfile_t *mm, memheap_t *heap, int fast, gcfreecb_t cb, void *
 
     now = utime_now();
     for(i=1; i<heap->nr_procheap; i++) {
-        if (heap->procheap[i].last_used - now >= procheap_timeout) {
+        // Give the superblocks of idle heaps, and of heaps whose process
+        // went away, to everyone else
+        ph = &heap->procheap[i];
+        last = ph->last_used;
+        if (!last)
+            continue;
+        if (now - last >= procheap_timeout || (ph->id && !pid_alive(ph->id))) {
             pmem_retire(mm, heap, i);
+            cmpxchg64(&ph->last_used, last, 0);
         }
     }
     
@@ -774,8 +804,12 @@ void pmem_gc_free(mmfile_t *mm, memheap_t *heap, int fast, gcfreecb_t cb, void *
     pb = __ptr(mm, newval);
     while(pb) {
         oldval = pb->next;
-        if (pb->gc) {
+        ofs = __offset(mm, pb+1);
+        if (pmem_gcmap_test(map, ofs)) {
+            pmem_gcmap_clear(map, ofs);
             if (cb) cb(user, pb+1);
+            freed[NR_SZCLS].num++;
+            freed[NR_SZCLS].size += pb->size;
             pmem_pool_free(pb+1);
             // FIXME: a mempool with free space should be moved to the
             // front of the mempool freelist
@@ -790,6 +824,45 @@ void pmem_gc_free(mmfile_t *mm, memheap_t *heap, int fast, gcfreecb_t cb, void *
     pmem_relist_pools(mm, heap);
 }
 
+static void pmem_count_sblist(mmfile_t *mm, uint64_t p, pmemcount_t *inuse)
+{
+    superblock_t *sb;
+    uint32_t n;
+
+    while(p) {
+        sb = __ptr(mm, p);
+        n = sb->total - sb->desc.count;
+        inuse->num += n;
+        inuse->size += (uint64_t)n*sb->size;
+        p = sb->next;
+    }
+}
+
+/*
+ * Add up the blocks in use in each size class.  Only the superblock
+ * headers are read, so this is cheap enough to do on every collection.
+ * The lists can change while we walk them, so the result is approximate
+ * unless nobody else is allocating.
+ */
+void pmem_count(mmfile_t *mm, memheap_t *heap, pmemcount_t *inuse)
+{
+    poolblock_t *pb;
+    unsigned i, j;
+
+    for(i=0; i<heap->nr_procheap; i++) {
+        for(j=0; j<NR_SZCLS; j++) {
+            pmem_count_sblist(mm, heap->procheap[i].szcls[j].freelist, &inuse[j]);
+            pmem_count_sblist(mm, heap->procheap[i].szcls[j].fulllist, &inuse[j]);
+        }
+    }
+    pb = __ptr(mm, heap->pool_alloc);
+    while(pb) {
+        inuse[NR_SZCLS].num++;
+        inuse[NR_SZCLS].size += pb->size;
+        pb = __ptr(mm, pb->next);
+    }
+}
+
 static void print_mempool(mmfile_t *mm, mempool_t *pool)
 {
     unsigned i, n, s, e, total;
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <pongo/dbtypes.h>
+#include <pongo/bonsai.h>
+#include <pongo/btree.h>
+#include <pongo/dbmem.h>
+#include <pongo/log.h>
+
+/*
+ * Multi-container transactions.
+ *
+ * A transaction is a list of get/set/delete operations against one or
+ * more Collections.  The operations are applied to private copies of the
+ * trees (see bonsai_batch_*) and then all of the new roots are published
+ * together.  Publishing takes root->commit, which holds off every other
+ * synchronize, and only succeeds if none of the roots changed since they
+ * were read.  Otherwise the copies are thrown away and the transaction
+ * is run again against the new roots.
+ */
+
+typedef struct {
+    dbval_t *obj;
+    dbtype_t node, newnode;
+} txnroot_t;
+
+// commit.seq and commit.pid change together
+#define COMMIT(seq, pid) (((uint64_t)(pid) << 32) | (seq))
+
+/*
+ * Wait while a transaction holds commit.seq.  A process which died
+ * holding it is found the same way as dead readers are, and commit.seq
+ * is moved on for it.  Whatever roots it had published stay published.
+ */
+void commit_wait(pgctx_t *ctx)
+{
+    volatile dbroot_t *root = ctx->root;
+    volatile uint64_t *commit = (volatile uint64_t*)&root->commit;
+    uint64_t c;
+    unsigned n = 0;
+
+    while((c = *commit) & 1) {
+        if (n >= 64 && !pid_alive(c >> 32) &&
+                cmpxchg64(commit, c, COMMIT((uint32_t)c + 1, 0))) {
+            log_error("pid %d died while publishing a transaction", (int)(c >> 32));
+            break;
+        }
+        backoff(&n);
+    }
+}
+
+void commit_lock(pgctx_t *ctx)
+{
+    volatile dbroot_t *root = ctx->root;
+    volatile uint64_t *commit = (volatile uint64_t*)&root->commit;
+    volatile dbreader_t *r;
+    uint32_t seq, pid = getpid();
+    unsigned n = 0;
+    int i;
+
+    for(;;) {
+        commit_wait(ctx);
+        seq = root->commit.seq;
+        if (!(seq & 1) && cmpxchg64(commit, COMMIT(seq, 0), COMMIT(seq+1, pid)))
+            break;
+    }
+    // Wait for single-container synchronizes which got in ahead of us
+    for(i=0; i<NR_READERS; i++) {
+        r = &root->readers[i];
+        while(r->writing && r->state == READER_LIVE) {
+            if (n >= 64 && !pid_alive(r->pid)) {
+                cmpxchg32(&r->state, READER_LIVE, READER_DEAD);
+                break;
+            }
+            backoff(&n);
+        }
+    }
+}
+
+void commit_unlock(pgctx_t *ctx)
+{
+    volatile uint64_t *commit = (volatile uint64_t*)&ctx->root->commit;
+
+    __sync_synchronize();
+    *commit = COMMIT(ctx->root->commit.seq + 1, 0);
+}
+
+// Check that none of the roots changed since they were read and, if
+// publish is set, replace them all with their new values.
+static int txn_publish(pgctx_t *ctx, int nroot, txnroot_t *roots, int publish, int sync)
+{
+    volatile dbtype_t *p;
+    int i, ret = 1;
+
+    if (publish && sync) dbfile_sync(ctx);
+    commit_lock(ctx);
+    for(i=0; i<nroot; i++) {
+        p = &roots[i].obj->obj;
+        if (p->all != roots[i].node.all) {
+            ret = 0;
+            break;
+        }
+    }
+    if (ret && publish) {
+        for(i=0; i<nroot; i++) {
+            p = &roots[i].obj->obj;
+            p->all = roots[i].newnode.all;
+        }
+    }
+    commit_unlock(ctx);
+    if (ret && publish) {
+        for(i=0; i<nroot; i++) {
+            if (roots[i].newnode.all == roots[i].node.all)
+                continue;
+            if (ctx->root->gcinc.phase == GC_MARK)
+                db_gc_barrier(ctx, roots[i].node.all);
+            db_gc_remember(ctx, &roots[i].obj->obj);
+            dbversion_bump(ctx, &roots[i].obj->obj);
+        }
+    }
+    if (ret && publish && sync) dbfile_sync(ctx);
+    return ret;
+}
+
+/*
+ * Run the operations in ops as a single atomic transaction.  multi_GET
+ * stores the current value in ops[i].value.  Either every operation takes
+ * effect or none of them do.  Returns 0 on success, or one of the MULTI_ERR
+ * codes with the index of the failing operation in *failed:
+ *    MULTI_ERR_TYPE: ops[i].obj is not a Collection or BTreeCollection
+ *    MULTI_ERR_FROZEN: ops[i] writes to a snapshot
+ *    MULTI_ERR_CMD: ops[i].op is not a valid operation
+ *    MULTI_ERR_KEY: get or delete of a missing key, or multi_SET_OR_FAIL
+ *                   of an existing key
+ */
+int db_transaction(pgctx_t *ctx, int n, dbtxnop_t *ops, int *failed, int sync)
+{
+    txnroot_t *roots, *r;
+    dbval_t *obj;
+    dbtag_t type;
+    int *which;
+    int i, j, nroot, writes;
+    int ret = 0;
+
+    roots = malloc(n * sizeof(*roots));
+    which = malloc(n * sizeof(*which));
+    nroot = writes = 0;
+    for(i=0; i<n; i++) {
+        obj = dbptr(ctx, ops[i].obj);
+        if (obj->type != Collection && obj->type != BTreeCollection) {
+            ret = MULTI_ERR_TYPE;
+            goto error;
+        }
+        if (ops[i].op != multi_GET) {
+            if (obj->frozen) {
+                ret = MULTI_ERR_FROZEN;
+                goto error;
+            }
+            if (ops[i].op != multi_SET && ops[i].op != multi_SET_OR_FAIL &&
+                ops[i].op != multi_DEL) {
+                ret = MULTI_ERR_CMD;
+                goto error;
+            }
+            writes++;
+        }
+        for(j=0; j<nroot && roots[j].obj != obj; j++)
+            ;
+        if (j == nroot)
+            roots[nroot++].obj = obj;
+        which[i] = j;
+    }
+
+    assert(ctx->winner.len == 0);
+    assert(ctx->loser.len == 0);
+    bonsai_batch_begin(ctx);
+    for(;;) {
+        // Read-Copy-Update loop for safe modify
+        rculoser(ctx);
+        for(j=0; j<nroot; j++)
+            roots[j].newnode = roots[j].node = roots[j].obj->obj;
+        for(i=0; i<n; i++) {
+            r = &roots[which[i]];
+            type = r->obj->type;
+            if (ops[i].op == multi_GET) {
+                if (tree_find(ctx, type, r->newnode, ops[i].key, &ops[i].value) < 0)
+                    break;
+            } else if (ops[i].op == multi_DEL) {
+                if (tree_find(ctx, type, r->newnode, ops[i].key, NULL) < 0)
+                    break;
+                r->newnode = tree_delete(ctx, type, r->newnode, ops[i].key, NULL);
+            } else {
+                if (ops[i].op == multi_SET_OR_FAIL &&
+                    tree_find(ctx, type, r->newnode, ops[i].key, NULL) == 0)
+                    break;
+                r->newnode = tree_insert(ctx, type, r->newnode, ops[i].key, ops[i].value, 0);
+            }
+        }
+        if (i < n) {
+            // Only report the failure if it happened against an
+            // up-to-date view of the roots.
+            if (txn_publish(ctx, nroot, roots, 0, 0)) {
+                bonsai_batch_abort(ctx);
+                ret = MULTI_ERR_KEY;
+                goto error;
+            }
+            ctx->txn.retries++;
+            continue;
+        }
+        bonsai_batch_prepare(ctx);
+        if (txn_publish(ctx, nroot, roots, writes, sync & SYNC_MASK))
+            break;
+        ctx->txn.retries++;
+    }
+    ctx->txn.commits++;
+    bonsai_batch_commit(ctx);
+    goto exitproc;
+
+error:
+    if (failed) *failed = i;
+exitproc:
+    free(which);
+    free(roots);
+    return ret;
+}
+
+// vim: ts=4 sts=4 sw=4 expandtab:
@@ -10,12 +10,15 @@
 int
 usage(const char *progname)
 {
-    printf("%s [-f dbfile] [-l seconds] [-s seconds] [-i] [-d]\n"
+    printf("%s [-f dbfile] [-l seconds] [-s seconds] [-p seconds] [-j threads] [-i] [-g] [-d]\n"
         "    PongoDB Garbage Collector:\n"
         "        -f: Database file on which to operate\n"
-        "        -l: Long GC interval (full collection)\n"
-        "        -s: Short GC interval (quick collections)\n"
+        "        -l: Longest time between full collections while anything changes\n"
+        "        -s: How often to look at the allocation counters\n"
+        "        -p: Longest pause per full collection slice\n"
+        "        -j: Number of threads marking during full collections\n"
         "        -i: Allocator/Heap info\n"
+        "        -g: Statistics of recent collections\n"
         "        -d: dump database as json to stdout\n",
         progname);
     return 1;
@@ -28,26 +31,62 @@ print_meminfo(pgctx_t *ctx)
     pmem_print_mem(&ctx->mm, heap);
 }
 
+void
+print_gcstats(pgctx_t *ctx, int full)
+{
+    gcstats_t stats[GC_HIST_SZ], *st;
+    int i, n;
+
+    dblock(ctx);
+    n = db_gc_history(ctx, full, stats, GC_HIST_SZ);
+    dbunlock(ctx);
+    printf("=== Recent %s collections ===\n", full ? "full" : "fast");
+    for(i=0; i<n; i++) {
+        st = &stats[i];
+        printf("pid=%u start=%lld%s total=%lldus setup=%lldus mark=%lldus "
+               "(%u slices, max %lldus, remark %lldus, %llu scanned) sweep=%lldus\n",
+               st->pid, (long long)st->start, st->major ? " major" : "",
+               (long long)st->total,
+               (long long)st->setup, (long long)st->marktime, st->slices,
+               (long long)st->max_slice, (long long)st->remark,
+               (unsigned long long)st->scanned, (long long)st->sweep);
+        printf("    blocks: %llu before, %llu after, %llu freed (%llu bytes)\n",
+               (unsigned long long)st->before.num,
+               (unsigned long long)st->after.num,
+               (unsigned long long)st->freed.num,
+               (unsigned long long)st->freed.size);
+    }
+}
+
 int
 main(int argc, char *argv[])
 {
     int i;
     unsigned long_interval = 60000000;
     unsigned short_interval = 250000;
+    unsigned slice = 10000;
+    int threads = 1;
+    int marking, want;
     char *dbfile = NULL;
     int64_t t0, t1;
     pgctx_t *ctx;
-    int info = 0, dump = 0;
+    int info = 0, dump = 0, history = 0;
 
     for(i=1; i<argc; i++) {
         if (!strcmp(argv[i], "-l")) {
             long_interval = atof(argv[++i]) * 1e6;
         } else if (!strcmp(argv[i], "-s")) {
             short_interval = atof(argv[++i]) * 1e6;
+        } else if (!strcmp(argv[i], "-p")) {
+            slice = atof(argv[++i]) * 1e6;
+        } else if (!strcmp(argv[i], "-j")) {
+            threads = atoi(argv[++i]);
         } else if (!strcmp(argv[i], "-f")) {
             dbfile = argv[++i];
         } else if (!strcmp(argv[i], "-i")) {
             info = 1;
+        } else if (!strcmp(argv[i], "-g")) {
+            history = 1;
         } else if (!strcmp(argv[i], "-d")) {
             dump = 1;
         } else {
@@ -60,10 +99,16 @@ main(int argc, char *argv[])
     printf("PongoGC: file=%s\n", dbfile);
     log_init(NULL, LOG_DEBUG);
     ctx = dbfile_open(dbfile, 0);
+    ctx->gc.nthreads = threads;
     if (info) {
         print_meminfo(ctx);
         return 0;
     }
+    if (history) {
+        print_gcstats(ctx, 1);
+        print_gcstats(ctx, 0);
+        return 0;
+    }
     if (dump) {
         json_dump(ctx, ctx->root->data, stdout);
         return 0;
@@ -71,16 +116,30 @@ main(int argc, char *argv[])
 
     printf("  short_interval=%uus\n", short_interval);
     printf("   long_interval=%uus\n", long_interval);
+    printf("           slice=%uus\n", slice);
+    printf("         threads=%d\n", threads);
     db_gc(ctx, 1, NULL);
     t0 = utime_now();
+    marking = 0;
     for(;;) {
-        usleep(short_interval);
+        // Full collections run a slice at a time, with an equally
+        // long break between the slices.
+        usleep(marking ? slice : short_interval);
         t1 = utime_now();
-        if (t1-t0 < long_interval) {
-            db_gc(ctx, 0, NULL);
-        } else {
-            db_gc(ctx, 1, NULL);
+        if (marking) {
+            marking = db_gc_step(ctx, slice, NULL);
+            continue;
+        }
+        // Collect when the allocation counters call for it, and once
+        // in a while if anything was allocated at all.
+        want = db_gc_pressure(ctx);
+        if (!want && t1-t0 >= long_interval && ctx->root->gcpressure.alloc)
+            want = 2;
+        if (want == 2) {
+            marking = db_gc_step(ctx, slice, NULL);
             t0 = utime_now();
+        } else if (want == 1) {
+            db_gc(ctx, 0, NULL);
         }
     }
     return 0;
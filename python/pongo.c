@@ -48,6 +48,18 @@ to_python_helper(pgctx_t *ctx, dbtype_t node, void *user)
     }
 }
 
+static void
+to_python_btree(pgctx_t *ctx, dbtype_t key, dbtype_t value, void *user)
+{
+    tphelper_t *h = (tphelper_t*)user;
+    PyObject *k, *v;
+
+    k = to_python(ctx, key, h->flags);
+    v = to_python(ctx, value, h->flags);
+    PyDict_SetItem(h->ob, k, v);
+    Py_DECREF(k); Py_DECREF(v);
+}
+
 PyObject *
 to_python(pgctx_t *ctx, dbtype_t db, int flags)
 {
@@ -130,7 +142,7 @@ to_python(pgctx_t *ctx, dbtype_t db, int flags)
         case List:
             if (flags & TP_PROXY) {
                 ob = PongoList_Proxy(ctx, db);
-                pidcache_put(ctx, ob, db);
+                if (ob) ((PongoObject*)ob)->pin = pidcache_put(ctx, db);
             } else {
                 if (flags & TP_PROXYCHLD) flags = (flags & ~TP_PROXYCHLD) | TP_PROXY;
                 list = dbptr(ctx, dv->list);
@@ -145,7 +157,7 @@ to_python(pgctx_t *ctx, dbtype_t db, int flags)
         case Object:
             if (flags & TP_PROXY) {
                 ob = PongoDict_Proxy(ctx, db);
-                pidcache_put(ctx, ob, db);
+                if (ob) ((PongoObject*)ob)->pin = pidcache_put(ctx, db);
             } else {
                 if (flags & TP_PROXYCHLD) flags = (flags & ~TP_PROXYCHLD) | TP_PROXY;
                 obj = dbptr(ctx, dv->obj);
@@ -162,9 +174,16 @@ to_python(pgctx_t *ctx, dbtype_t db, int flags)
             // The cache is a collection
         case Collection:
         case MultiCollection:
+        case BTreeCollection:
             if (flags & TP_PROXY) {
                 ob = PongoCollection_Proxy(ctx, db);
-                pidcache_put(ctx, ob, db);
+                if (ob) ((PongoObject*)ob)->pin = pidcache_put(ctx, db);
+            } else if (type == BTreeCollection) {
+                if (flags & TP_PROXYCHLD) flags = (flags & ~TP_PROXYCHLD) | TP_PROXY;
+                h.flags = flags;
+                h.type = type;
+                h.ob = ob = PyDict_New();
+                btree_foreach(ctx, dv->obj, to_python_btree, &h);
             } else {
                 if (flags & TP_PROXYCHLD) flags = (flags & ~TP_PROXYCHLD) | TP_PROXY;
                 h.flags = flags | (TP_NODEKEY|TP_NODEVAL);
@@ -175,6 +194,7 @@ to_python(pgctx_t *ctx, dbtype_t db, int flags)
             break;
 
         case _BonsaiNode:
+        case _BonsaiPrefixNode:
         case _BonsaiMultiNode:
             k = v = NULL;
             if (flags & TP_NODEKEY) {
@@ -384,6 +404,28 @@ pongo_check(PongoCollection *data)
     return 0;
 }
 
+// Raise the exception for an error from a cas or incr (see CAS_ERR_*)
+void
+pongo_cas_error(int err, const char *op, PyObject *key)
+{
+    switch(err) {
+    case CAS_ERR_KEY:
+        PyErr_SetObject(PyExc_KeyError, key);
+        break;
+    case CAS_ERR_INT:
+        PyErr_Format(PyExc_TypeError, "value is not an integer");
+        break;
+    case CAS_ERR_OVERFLOW:
+        PyErr_Format(PyExc_OverflowError, "integer overflow");
+        break;
+    case CAS_ERR_FROZEN:
+        PyErr_Format(PyExc_TypeError, "a snapshot is read-only");
+        break;
+    default:
+        PyErr_Format(PyExc_TypeError, "%s requires a key-value collection", op);
+    }
+}
+
 static PyObject *
 pongo_close(PyObject *self, PyObject *args)
 {
@@ -425,6 +467,9 @@ pongo_meta(PyObject *self, PyObject *args)
     } else if (!strcmp(key, ".sync")) {
         ret = PyInt_FromLong(ctx->sync);
         if (value && value != Py_None) ctx->sync = PyInt_AsLong(value);
+    } else if (!strcmp(key, ".gc_inline")) {
+        ret = PyInt_FromLong(ctx->gc.inline_gc);
+        if (value && value != Py_None) ctx->gc.inline_gc = PyInt_AsLong(value);
 #ifdef WANT_UUID_TYPE
     } else if (!strcmp(key, ".uuid_class")) {
         ret = (PyObject*)uuid_class;
@@ -480,21 +525,40 @@ pongo_atoms(PyObject *self, PyObject *args)
 static PyObject *
 pongo_pidcache(PyObject *self, PyObject *args)
 {
-    PyObject *ret;
+    PyObject *ret, *pins, *pid, *ofs;
     PongoCollection *data;
-    dbtype_t pidcache;
+    pidslab_t *slab;
+    int i;
 
-    if (!PyArg_ParseTuple(args, "O:atoms", &data))
+    if (!PyArg_ParseTuple(args, "O:pidcache", &data))
         return NULL;
     if (pongo_check(data))
         return NULL;
 
+    // Report the offsets rather than proxies: making a proxy would pin
+    // the object in the pidcache we're looking at.
+    ret = PyDict_New();
     dblock(data->ctx);
-    pidcache = data->ctx->root->pidcache;
-    // Create the collection directly because the pidcache is
-    // already accounted for by pongogc, so we don't need to
-    // have the proxy reference inserted into the pidcache
-    ret = PongoCollection_Proxy(data->ctx, pidcache);
+    slab = _ptr(data->ctx, data->ctx->root->pidslab);
+    for(; slab; slab=_ptr(data->ctx, slab->next)) {
+        if (!slab->pid)
+            continue;
+        pid = PyInt_FromLong(slab->pid);
+        pins = PyDict_GetItem(ret, pid);
+        if (!pins) {
+            pins = PyList_New(0);
+            PyDict_SetItem(ret, pid, pins);
+            Py_DECREF(pins);
+        }
+        Py_DECREF(pid);
+        for(i=0; i<PIDCACHE_SLOTS; i++) {
+            if (!slab->slot[i].all)
+                continue;
+            ofs = PyLong_FromUnsignedLongLong(slab->slot[i].all);
+            PyList_Append(pins, ofs);
+            Py_DECREF(ofs);
+        }
+    }
     dbunlock(data->ctx);
 
     return ret;
@@ -545,7 +609,155 @@ pongo__show(PyObject *self, PyObject *args)
         return NULL;
 
     coll.ptr = dbptr(data->ctx, data->dbptr);
-    bonsai_show(data->ctx,  coll.ptr->obj, 0);
+    if (coll.ptr->type == BTreeCollection)
+        btree_show(data->ctx,  coll.ptr->obj, 0);
+    else
+        bonsai_show(data->ctx,  coll.ptr->obj, 0);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+pongo_transaction(PyObject *self, PyObject *args)
+{
+    PongoCollection *data, *coll;
+    PyObject *ops, *seq, *item, *key, *value;
+    PyObject *ret = NULL;
+    dbtxnop_t *txn;
+    pgctx_t *ctx;
+    const char *op;
+    int i, n, r, failed = 0;
+    int sync = -1;
+
+    if (!PyArg_ParseTuple(args, "OO|i:transaction", &data, &ops, &sync))
+        return NULL;
+    if (pongo_check(data))
+        return NULL;
+    seq = PySequence_Fast(ops, "ops must be a sequence");
+    if (!seq)
+        return NULL;
+
+    ctx = data->ctx;
+    if (sync == -1) sync = ctx->sync;
+    n = PySequence_Fast_GET_SIZE(seq);
+    txn = malloc(n * sizeof(*txn));
+    dblock(ctx);
+    for(i=0; i<n; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        value = NULL;
+        if (!PyTuple_Check(item)) {
+            PyErr_Format(PyExc_TypeError, "transaction ops must be tuples");
+            goto exitproc;
+        }
+        if (!PyArg_ParseTuple(item, "sOO|O:transaction", &op, &coll, &key, &value))
+            goto exitproc;
+        if (!PyObject_TypeCheck((PyObject*)coll, &PongoCollection_Type) ||
+            coll->ctx != ctx) {
+            PyErr_Format(PyExc_TypeError, "transaction ops require a PongoCollection in the same database");
+            goto exitproc;
+        }
+        if (!strcmp(op, "get")) {
+            txn[i].op = multi_GET;
+        } else if (!strcmp(op, "set")) {
+            txn[i].op = multi_SET;
+        } else if (!strcmp(op, "add")) {
+            txn[i].op = multi_SET_OR_FAIL;
+        } else if (!strcmp(op, "del")) {
+            txn[i].op = multi_DEL;
+        } else {
+            PyErr_Format(PyExc_ValueError, "Unknown transaction op %s", op);
+            goto exitproc;
+        }
+        if ((txn[i].op == multi_SET || txn[i].op == multi_SET_OR_FAIL) && !value) {
+            PyErr_Format(PyExc_TypeError, "%s requires a value", op);
+            goto exitproc;
+        }
+        txn[i].obj = coll->dbptr;
+        txn[i].key = from_python(ctx, key);
+        txn[i].value = value ? from_python(ctx, value) : DBNULL;
+        if (PyErr_Occurred())
+            goto exitproc;
+    }
+
+    r = db_transaction(ctx, n, txn, &failed, sync);
+    if (r == 0) {
+        ret = PyList_New(n);
+        for(i=0; i<n; i++) {
+            if (txn[i].op == multi_GET) {
+                value = to_python(ctx, txn[i].value, TP_PROXY);
+            } else {
+                value = Py_None;
+                Py_INCREF(value);
+            }
+            PyList_SET_ITEM(ret, i, value);
+        }
+    } else if (r == MULTI_ERR_KEY) {
+        item = PySequence_Fast_GET_ITEM(seq, failed);
+        PyErr_SetObject(PyExc_KeyError, PyTuple_GET_ITEM(item, 2));
+    } else if (r == MULTI_ERR_FROZEN) {
+        PyErr_Format(PyExc_TypeError, "transaction op %d writes to a snapshot, which is read-only", failed);
+    } else {
+        PyErr_Format(PyExc_TypeError, "transaction op %d requires a key-value collection", failed);
+    }
+exitproc:
+    dbunlock(ctx);
+    free(txn);
+    Py_DECREF(seq);
+    return ret;
+}
+
+/*
+ * A read-only view of a collection as it is now.  Only the collection's
+ * own tree is frozen: collections and dicts stored inside of it are the
+ * live ones, so snapshot(db) is not a consistent view of the database.
+ * To get a stable view of a nested collection, snapshot that collection.
+ *
+ * The snapshot holds a pin on the global reclaim epoch.  Until it is
+ * released by pongo.release() or by freeing the proxy, no process can
+ * reclaim replaced tree nodes, so release it promptly.
+ */
+static PyObject *
+pongo_snapshot(PyObject *self, PyObject *args)
+{
+    PongoCollection *coll;
+    PyObject *ret = NULL;
+    dbtype_t snap;
+
+    if (!PyArg_ParseTuple(args, "O:snapshot", &coll))
+        return NULL;
+    if (!PyObject_TypeCheck((PyObject*)coll, &PongoCollection_Type)) {
+        PyErr_Format(PyExc_TypeError, "snapshot requires a PongoCollection");
+        return NULL;
+    }
+    dblock(coll->ctx);
+    if (dbcollection_snapshot(coll->ctx, coll->dbptr, &snap) == 0) {
+        ret = to_python(coll->ctx, snap, TP_PROXY);
+        if (ret)
+            ((PongoCollection*)ret)->snapshot = 1;
+        else
+            dbcollection_release(coll->ctx, snap);
+    } else {
+        PyErr_Format(PyExc_TypeError, "snapshot requires a key-value collection");
+    }
+    dbunlock(coll->ctx);
+    return ret;
+}
+
+// Release a snapshot before its proxy goes away.  It reads as empty after.
+static PyObject *
+pongo_release(PyObject *self, PyObject *args)
+{
+    PongoCollection *snap;
+
+    if (!PyArg_ParseTuple(args, "O:release", &snap))
+        return NULL;
+    if (!PyObject_TypeCheck((PyObject*)snap, &PongoCollection_Type) || !snap->snapshot) {
+        PyErr_Format(PyExc_TypeError, "release requires a snapshot");
+        return NULL;
+    }
+    dblock(snap->ctx);
+    dbcollection_release(snap->ctx, snap->dbptr);
+    dbunlock(snap->ctx);
+    snap->snapshot = 0;
     Py_RETURN_NONE;
 }
 
@@ -558,21 +770,89 @@ pongo_gc(PyObject *self, PyObject *args)
     gcstats_t *stats = &_stats;
     int getstats = 1;
     int complete = 0;
+    int threads = 0;
 
-    if (!PyArg_ParseTuple(args, "O|ii:gc", &data, &complete, &getstats))
+    if (!PyArg_ParseTuple(args, "O|iii:gc", &data, &complete, &getstats, &threads))
         return NULL;
     if (pongo_check(data))
         return NULL;
 
+    if (threads > 0)
+        data->ctx->gc.nthreads = threads;
+
     memset(stats, 0, sizeof(*stats));
     if (!getstats) stats = NULL;
     db_gc(data->ctx, complete, stats);
     if (stats) {
-        ret = Py_BuildValue("(iiii)",
+        ret = Py_BuildValue("(KKKK)",
                 stats->before.num, stats->before.size,
                 stats->after.num, stats->after.size);
+    } else {
+        Py_INCREF(ret);
+    }
+    return ret;
+}
+
+static PyObject *
+gcstats_to_python(gcstats_t *st)
+{
+    PyObject *cls, *ret;
+    int i;
+
+    cls = PyList_New(GC_NR_CLS);
+    for(i=0; i<GC_NR_CLS; i++) {
+        PyList_SET_ITEM(cls, i, Py_BuildValue("((KK)(KK)(KK))",
+                st->cls_before[i].num, st->cls_before[i].size,
+                st->cls_after[i].num, st->cls_after[i].size,
+                st->cls_freed[i].num, st->cls_freed[i].size));
     }
-    Py_INCREF(ret);
+    ret = Py_BuildValue("{s:L,s:I,s:O,s:O,s:(KK),s:(KK),s:(KK),s:I,s:L,s:L,s:K,s:L,s:L,s:L,s:L,s:N}",
+            "start", st->start,
+            "pid", st->pid,
+            "full", st->full ? Py_True : Py_False,
+            "major", st->major ? Py_True : Py_False,
+            "before", st->before.num, st->before.size,
+            "after", st->after.num, st->after.size,
+            "freed", st->freed.num, st->freed.size,
+            "slices", st->slices,
+            "max_slice", st->max_slice,
+            "remark", st->remark,
+            "scanned", st->scanned,
+            "marktime", st->marktime,
+            "setup", st->setup,
+            "sweep", st->sweep,
+            "total", st->total,
+            "classes", cls);
+    return ret;
+}
+
+static PyObject *
+pongo_gcstats(PyObject *self, PyObject *args)
+{
+    PyObject *ret;
+    PongoCollection *data;
+    gcstats_t *stats;
+    int full = 1;
+    int i, n = GC_HIST_SZ;
+
+    if (!PyArg_ParseTuple(args, "O|ii:gcstats", &data, &full, &n))
+        return NULL;
+    if (pongo_check(data))
+        return NULL;
+
+    if (n < 0) n = 0;
+    if (n > GC_HIST_SZ) n = GC_HIST_SZ;
+    stats = malloc(GC_HIST_SZ * sizeof(gcstats_t));
+    if (!stats)
+        return PyErr_NoMemory();
+    dblock(data->ctx);
+    n = db_gc_history(data->ctx, full, stats, n);
+    dbunlock(data->ctx);
+
+    ret = PyList_New(n);
+    for(i=0; i<n; i++)
+        PyList_SET_ITEM(ret, i, gcstats_to_python(&stats[i]));
+    free(stats);
     return ret;
 }
 
@@ -586,6 +866,10 @@ static PyMethodDef _pongo_methods[] = {
     { "_info",  (PyCFunction)pongo__info, METH_VARARGS, NULL },
     { "_show",  (PyCFunction)pongo__show, METH_VARARGS, NULL },
     { "gc",     (PyCFunction)pongo_gc, METH_VARARGS, NULL },
+    { "gcstats", (PyCFunction)pongo_gcstats, METH_VARARGS, NULL },
+    { "transaction", (PyCFunction)pongo_transaction, METH_VARARGS, NULL },
+    { "snapshot", (PyCFunction)pongo_snapshot, METH_VARARGS, NULL },
+    { "release", (PyCFunction)pongo_release, METH_VARARGS, NULL },
     { NULL, NULL },
 };
 
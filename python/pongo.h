@@ -8,13 +8,19 @@
 #include <pongo/dbtypes.h>
 #include <pongo/pidcache.h>
 #include <pongo/json.h>
+#include <pongo/btree.h>
 
 #define PongoObject_HEAD \
     PyObject_HEAD \
     pgctx_t *ctx; \
-    dbtype_t dbptr; 
+    dbtype_t dbptr; \
+    uint32_t pin;   /* pidcache handle, 0 if not pinned */
 
 
+typedef struct {
+    PongoObject_HEAD
+} PongoObject;
+
 typedef struct {
     PongoObject_HEAD
 } PongoPointer;
@@ -31,16 +37,20 @@ typedef struct {
     PongoObject_HEAD
     dbtype_t index;
     PyObject *index_ob;
+    int snapshot;           // took a snapshot, released when freed
 } PongoCollection;
 
 typedef struct {
     PongoObject_HEAD
     dbtag_t tag;
-    uint32_t pos, len;
-    dbtype_t stack[64];
-    int depth;
+    uint32_t pos, len;      // position in a List or Object
+    int started;            // the cursor has been placed
+    int reverse;            // walking from the end to the start
+    bonsai_cursor_t cur;    // position in a Collection
+    btree_iter_t bt;        // position in a BTreeCollection
     int lhex, rhex;
     dbtype_t lhdata, rhdata;
+    uint32_t lhpin, rhpin;
 } PongoIter;
 
 #define SELF_CTX_AND_DBPTR self->ctx, self->dbptr
@@ -65,6 +75,7 @@ extern PyObject* PongoIter_Iter(PyObject *ob);
 extern PyObject *to_python(pgctx_t *ctx, dbtype_t db, int flags);
 extern dbtype_t from_python(pgctx_t *ctx, PyObject *ob);
 extern int pongo_check(PongoCollection *data);
+extern void pongo_cas_error(int err, const char *op, PyObject *key);
 
 extern int _py_sequence_cb(pgctx_t *ctx, int i, dbtype_t *item, void *user);
 extern int _py_mapping_cb(pgctx_t *ctx, int i, dbtype_t *key, dbtype_t *value, void *user);
@@ -18,9 +18,24 @@ PongoCollection_Proxy(pgctx_t *ctx, dbtype_t db)
 
     self->ctx = ctx;
     self->dbptr = db;
+    self->pin = 0;
+    self->snapshot = 0;
     return (PyObject *)self;
 }
 
+// Snapshots can't be written to
+static int
+frozen_check(PongoCollection *self)
+{
+    dbval_t *obj = dbptr(self->ctx, self->dbptr);
+
+    if (obj->frozen) {
+        PyErr_Format(PyExc_TypeError, "a snapshot is read-only");
+        return -1;
+    }
+    return 0;
+}
+
 static PyObject *
 PongoCollection_GetItem(PongoCollection *self, PyObject *key)
 {
@@ -47,6 +62,8 @@ PongoCollection_SetItem(PongoCollection *self, PyObject *key, PyObject *value)
     dbtype_t v = DBNULL;
     int ret = -1;
 
+    if (frozen_check(self) < 0)
+        return -1;
     dblock(self->ctx);
     if (PyTuple_Check(key)) {
         if (PyTuple_Size(key) == 2) {
@@ -181,6 +198,8 @@ PongoCollection_set(PongoCollection *self, PyObject *args, PyObject *kwargs)
         return NULL;
 
     k = DBNULL;
+    if (frozen_check(self) < 0)
+        return NULL;
     dblock(self->ctx);
     if (PyString_Check(key) || PyUnicode_Check(key)) {
         klist = PyObject_CallMethod(key, "split", "s", sep);
@@ -219,6 +238,105 @@ PongoCollection_set(PongoCollection *self, PyObject *args, PyObject *kwargs)
     return ret;
 }
 
+// Like _py_mapping_cb, for a sequence from the caller which may hold
+// anything at all
+static int
+_py_pair_cb(pgctx_t *ctx, int i, dbtype_t *key, dbtype_t *value, void *user)
+{
+    PyObject *item = PySequence_Fast_GET_ITEM((PyObject*)user, i);
+    PyObject *k, *v;
+
+    if (!PySequence_Check(item) || PySequence_Size(item) != 2) {
+        PyErr_Format(PyExc_TypeError, "update sequence element #%d is not a (key, value) pair", i);
+        return -1;
+    }
+    k = PySequence_GetItem(item, 0);
+    v = PySequence_GetItem(item, 1);
+    if (k && v) {
+        *key = from_python(ctx, k);
+        *value = from_python(ctx, v);
+    }
+    Py_XDECREF(k); Py_XDECREF(v);
+    if (PyErr_Occurred()) return -1;
+    return 0;
+}
+
+PyDoc_STRVAR(update_doc,
+"C.update(E, [sync]) -- For each item in E, add/replace that item in C.\n"
+"E may be a mapping or a sequence of (key, value) pairs.  All of the items\n"
+"are published to C at once.");
+static PyObject *
+PongoCollection_update(PongoCollection *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *iter, *items;
+    PyObject *ret = NULL;
+    int length;
+    int sync = self->ctx->sync;
+    char *kwlist[] = {"iter", "sync", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i:update", kwlist,
+                &iter, &sync))
+        return NULL;
+
+    if (frozen_check(self) < 0)
+        return NULL;
+    dblock(self->ctx);
+    if (PyMapping_Check(iter) && (items = PyMapping_Items(iter)) != NULL) {
+        length = PySequence_Length(items);
+        if (dbcollection_update(SELF_CTX_AND_DBPTR, length, _py_mapping_cb, items, sync) == 0)
+            ret = Py_None;
+        Py_DECREF(items);
+    } else {
+        PyErr_Clear();
+        items = PySequence_Fast(iter, "argument must be a mapping or sequence");
+        if (items) {
+            length = PySequence_Fast_GET_SIZE(items);
+            if (dbcollection_update(SELF_CTX_AND_DBPTR, length, _py_pair_cb, items, sync) == 0)
+                ret = Py_None;
+            Py_DECREF(items);
+        }
+    }
+    if (!ret && !PyErr_Occurred())
+        PyErr_Format(PyExc_TypeError, "a snapshot is read-only");
+    dbunlock(self->ctx);
+    Py_XINCREF(ret);
+    return ret;
+}
+
+PyDoc_STRVAR(delete_many_doc,
+"C.delete_many(keys, [sync]) -> int -- Remove all of keys from C at once.\n"
+"Keys which don't exist are ignored.  Returns the number of keys removed.");
+static PyObject *
+PongoCollection_delete_many(PongoCollection *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *keys, *seq;
+    PyObject *ret = NULL;
+    int n;
+    int sync = self->ctx->sync;
+    char *kwlist[] = {"keys", "sync", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i:delete_many", kwlist,
+                &keys, &sync))
+        return NULL;
+
+    if (frozen_check(self) < 0)
+        return NULL;
+    seq = PySequence_Fast(keys, "keys must be a sequence");
+    if (!seq)
+        return NULL;
+    dblock(self->ctx);
+    n = dbcollection_delete_many(SELF_CTX_AND_DBPTR, PySequence_Fast_GET_SIZE(seq),
+            _py_sequence_cb, seq, sync);
+    if (n >= 0) {
+        ret = PyInt_FromLong(n);
+    } else if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_TypeError, "delete_many requires a key-value collection");
+    }
+    dbunlock(self->ctx);
+    Py_DECREF(seq);
+    return ret;
+}
+
 PyDoc_STRVAR(pop_doc,
 "C.pop(key, [default, [sync]]) -> item -- Get and remove C[key] if it exists.\n");
 static PyObject *
@@ -234,6 +352,8 @@ PongoCollection_pop(PongoCollection *self, PyObject *args, PyObject *kwargs)
                 &key, &dflt, &sync))
         return NULL;
 
+    if (frozen_check(self) < 0)
+        return NULL;
     dblock(self->ctx);
     if (PyTuple_Check(key)) {
         if (PyTuple_Size(key) == 2) {
@@ -262,6 +382,80 @@ PongoCollection_pop(PongoCollection *self, PyObject *args, PyObject *kwargs)
     return ret;
 }
 
+PyDoc_STRVAR(cas_doc,
+"C.cas(key, expected, value, [sync]) -> bool -- Atomically set C[key] to\n"
+"value if its current value is equal to expected.  Returns True if the value\n"
+"was swapped, False if the current value is different.  Raises KeyError if\n"
+"key does not exist.");
+static PyObject *
+PongoCollection_cas(PongoCollection *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *key, *expected, *value;
+    PyObject *ret = NULL;
+    dbtype_t k, e, v;
+    int sync = self->ctx->sync;
+    int r;
+    char *kwlist[] = {"key", "expected", "value", "sync", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|i:cas", kwlist,
+                &key, &expected, &value, &sync))
+        return NULL;
+
+    if (frozen_check(self) < 0)
+        return NULL;
+    dblock(self->ctx);
+    k = from_python(self->ctx, key);
+    e = from_python(self->ctx, expected);
+    v = from_python(self->ctx, value);
+    if (!PyErr_Occurred()) {
+        r = dbcollection_cas(SELF_CTX_AND_DBPTR, k, e, v, sync);
+        if (r == 0) {
+            ret = Py_True;
+        } else if (r == 1) {
+            ret = Py_False;
+        } else {
+            pongo_cas_error(r, "cas", key);
+        }
+    }
+    dbunlock(self->ctx);
+    Py_XINCREF(ret);
+    return ret;
+}
+
+PyDoc_STRVAR(incr_doc,
+"C.incr(key, [delta, [sync]]) -> int -- Atomically add delta (default 1)\n"
+"to the integer C[key] and return the new value.  A missing key counts as 0.");
+static PyObject *
+PongoCollection_incr(PongoCollection *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *key;
+    PyObject *ret = NULL;
+    dbtype_t k, v;
+    PY_LONG_LONG delta = 1;
+    int sync = self->ctx->sync;
+    int r;
+    char *kwlist[] = {"key", "delta", "sync", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Li:incr", kwlist,
+                &key, &delta, &sync))
+        return NULL;
+
+    if (frozen_check(self) < 0)
+        return NULL;
+    dblock(self->ctx);
+    k = from_python(self->ctx, key);
+    if (!PyErr_Occurred()) {
+        r = dbcollection_incr(SELF_CTX_AND_DBPTR, k, delta, &v, sync);
+        if (r == 0) {
+            ret = to_python(self->ctx, v, 0);
+        } else {
+            pongo_cas_error(r, "incr", key);
+        }
+    }
+    dbunlock(self->ctx);
+    return ret;
+}
+
 typedef struct {
     int type;
     PyObject *ob;
@@ -289,6 +483,101 @@ kvi_helper(pgctx_t *ctx, dbtype_t node, void *user)
     }
 }
 
+static void
+kvi_btree(pgctx_t *ctx, dbtype_t key, dbtype_t value, void *user)
+{
+    kvi_t *kvi = (kvi_t*)user;
+    PyObject *item, *k, *v;
+
+    if (kvi->type == 0) {
+        item = to_python(ctx, key, TP_PROXY);
+    } else if (kvi->type == 1) {
+        item = to_python(ctx, value, TP_PROXY);
+    } else {
+        k = to_python(ctx, key, TP_PROXY);
+        v = to_python(ctx, value, TP_PROXY);
+        item = PyTuple_Pack(2, k, v);
+        Py_DECREF(k); Py_DECREF(v);
+    }
+    PyList_Append(kvi->ob, item);
+    Py_DECREF(item);
+}
+
+// Call the kvi helper for each item of the collection
+static void
+kvi_foreach(PongoCollection *self, kvi_t *kvi)
+{
+    dbtype_t obj;
+
+    obj.ptr = dbptr(self->ctx, self->dbptr);
+    if (obj.ptr->type == BTreeCollection)
+        btree_foreach(self->ctx, obj.ptr->obj, kvi_btree, kvi);
+    else
+        bonsai_foreach(self->ctx, obj.ptr->obj, kvi_helper, kvi);
+}
+
+// Call the kvi helper for the items at positions lo up to hi
+static void
+kvi_slice(PongoCollection *self, kvi_t *kvi, int lo, int hi)
+{
+    dbtype_t obj;
+
+    obj.ptr = dbptr(self->ctx, self->dbptr);
+    if (obj.ptr->type == BTreeCollection)
+        btree_slice(self->ctx, obj.ptr->obj, lo, hi, kvi_btree, kvi);
+    else
+        bonsai_slice(self->ctx, obj.ptr->obj, lo, hi, kvi_helper, kvi);
+}
+
+
+PyDoc_STRVAR(version_doc,
+"C.version() -> int -- The current version of C.\n"
+"The version changes every time C is modified.");
+static PyObject *
+PongoCollection_version(PongoCollection *self)
+{
+    PyObject *ret;
+
+    dblock(self->ctx);
+    ret = PyLong_FromUnsignedLong(db_version(SELF_CTX_AND_DBPTR));
+    dbunlock(self->ctx);
+    return ret;
+}
+
+PyDoc_STRVAR(wait_doc,
+"C.wait(version, [timeout]) -> int -- Sleep until C changes.\n"
+"Returns as soon as the version of C differs from version, or after\n"
+"timeout seconds.  Returns the current version.");
+static PyObject *
+PongoCollection_wait(PongoCollection *self, PyObject *args, PyObject *kwargs)
+{
+    unsigned long version;
+    uint32_t ret;
+    dbval_t *obj;
+    PyObject *timeout = Py_None;
+    int64_t usec = -1;
+    char *kwlist[] = {"version", "timeout", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "k|O:wait", kwlist,
+                &version, &timeout))
+        return NULL;
+    if (timeout != Py_None) {
+        usec = PyFloat_AsDouble(timeout) * 1e6;
+        if (PyErr_Occurred())
+            return NULL;
+        if (usec < 0) usec = 0;
+    }
+
+    // Don't hold the db lock or the GIL while sleeping.  The proxy keeps
+    // the collection from being collected.
+    dblock(self->ctx);
+    obj = dbptr(self->ctx, self->dbptr);
+    dbunlock(self->ctx);
+    Py_BEGIN_ALLOW_THREADS
+    ret = db_wait_change(self->ctx, obj, version, usec);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromUnsignedLong(ret);
+}
 
 PyDoc_STRVAR(keys_doc,
 "C.keys() -> [key, ...] -- Get the list of keys in the collection.");
@@ -296,13 +585,11 @@ static PyObject *
 PongoCollection_keys(PongoCollection *self)
 {
     kvi_t kvi;
-    dbtype_t obj;
 
     kvi.type = 0;
     kvi.ob = PyList_New(0);
     dblock(self->ctx);
-    obj.ptr = dbptr(self->ctx, self->dbptr);
-    bonsai_foreach(self->ctx, obj.ptr->obj, kvi_helper, &kvi);
+    kvi_foreach(self, &kvi);
     dbunlock(self->ctx);
     return kvi.ob;
 }
@@ -313,13 +600,11 @@ static PyObject *
 PongoCollection_values(PongoCollection *self)
 {
     kvi_t kvi;
-    dbtype_t obj;
 
     kvi.type = 1;
     kvi.ob = PyList_New(0);
     dblock(self->ctx);
-    obj.ptr = dbptr(self->ctx, self->dbptr);
-    bonsai_foreach(self->ctx, obj.ptr->obj, kvi_helper, &kvi);
+    kvi_foreach(self, &kvi);
     dbunlock(self->ctx);
     return kvi.ob;
 }
@@ -330,13 +615,89 @@ static PyObject *
 PongoCollection_items(PongoCollection *self)
 {
     kvi_t kvi;
-    dbtype_t obj;
 
     kvi.type = 2;
     kvi.ob = PyList_New(0);
+    dblock(self->ctx);
+    kvi_foreach(self, &kvi);
+    dbunlock(self->ctx);
+    return kvi.ob;
+}
+
+PyDoc_STRVAR(at_doc,
+"C.at(index) -> (k,v) -- Get the item at position index in the key order of C.\n"
+"Negative indices count from the end.");
+static PyObject *
+PongoCollection_at(PongoCollection *self, PyObject *args)
+{
+    PyObject *ret = NULL, *k, *v;
+    Py_ssize_t index, len;
+    dbtype_t obj, node, key, value;
+
+    if (!PyArg_ParseTuple(args, "n:at", &index))
+        return NULL;
+
     dblock(self->ctx);
     obj.ptr = dbptr(self->ctx, self->dbptr);
-    bonsai_foreach(self->ctx, obj.ptr->obj, kvi_helper, &kvi);
+    len = tree_size(self->ctx, obj.ptr->type, obj.ptr->obj);
+    if (index < 0)
+        index += len;
+    if (index < 0 || index >= len) {
+        PyErr_Format(PyExc_IndexError, "index out of range");
+    } else if (obj.ptr->type == BTreeCollection) {
+        btree_select(self->ctx, obj.ptr->obj, index, &key, &value);
+        k = to_python(self->ctx, key, TP_PROXY);
+        v = to_python(self->ctx, value, TP_PROXY);
+        ret = PyTuple_Pack(2, k, v);
+        Py_DECREF(k); Py_DECREF(v);
+    } else {
+        node = bonsai_select(self->ctx, obj.ptr->obj, index);
+        ret = to_python(self->ctx, node, TP_PROXY | TP_NODEKEY | TP_NODEVAL);
+    }
+    dbunlock(self->ctx);
+    return ret;
+}
+
+PyDoc_STRVAR(rank_doc,
+"C.rank(key) -> int -- The number of keys in C less than key.\n"
+"If key is in C, this is its position in the key order.");
+static PyObject *
+PongoCollection_rank(PongoCollection *self, PyObject *key)
+{
+    PyObject *ret = NULL;
+    dbtype_t obj, k;
+
+    dblock(self->ctx);
+    k = from_python(self->ctx, key);
+    if (!PyErr_Occurred()) {
+        obj.ptr = dbptr(self->ctx, self->dbptr);
+        ret = PyInt_FromLong(tree_rank(self->ctx, obj.ptr->type, obj.ptr->obj, k));
+    }
+    dbunlock(self->ctx);
+    return ret;
+}
+
+// C[lo:hi] is the list of items at positions lo up to hi
+static PyObject *
+PongoCollection_slice(PongoCollection *self, PyObject *slice)
+{
+    Py_ssize_t start, stop, step, slicelen;
+    kvi_t kvi;
+
+    dblock(self->ctx);
+    if (PySlice_GetIndicesEx((PySliceObject*)slice, dbcollection_len(SELF_CTX_AND_DBPTR),
+                &start, &stop, &step, &slicelen) < 0) {
+        dbunlock(self->ctx);
+        return NULL;
+    }
+    if (step != 1) {
+        dbunlock(self->ctx);
+        PyErr_Format(PyExc_ValueError, "slice step must be 1");
+        return NULL;
+    }
+    kvi.type = 2;
+    kvi.ob = PyList_New(0);
+    kvi_slice(self, &kvi, start, stop);
     dbunlock(self->ctx);
     return kvi.ob;
 }
@@ -369,6 +730,73 @@ PongoCollection_multi(PongoCollection *self)
     return ret;
 }
 
+PyDoc_STRVAR(btree_doc,
+"C.btree() -> bool -- Return whether C is kept in a B-tree");
+static PyObject *
+PongoCollection_btree(PongoCollection *self)
+{
+    PyObject *ret;
+    dbtype_t obj;
+
+    dblock(self->ctx);
+    obj.ptr = dbptr(self->ctx, self->dbptr);
+    ret = obj.ptr->type == BTreeCollection ? Py_True : Py_False;
+    dbunlock(self->ctx);
+    Py_INCREF(ret);
+    return ret;
+}
+
+typedef int (*setop_t)(pgctx_t *ctx, dbtype_t a, dbtype_t b, dbtype_t *result);
+
+static PyObject *
+setop_helper(PongoCollection *self, PyObject *other, setop_t op)
+{
+    PongoCollection *b = (PongoCollection*)other;
+    PyObject *ret = NULL;
+    dbtype_t result;
+
+    if (Py_TYPE(other) != &PongoCollection_Type || b->ctx != self->ctx) {
+        PyErr_Format(PyExc_TypeError, "argument must be a PongoCollection in the same db");
+        return NULL;
+    }
+    dblock(self->ctx);
+    if (op(self->ctx, self->dbptr, b->dbptr, &result) == 0) {
+        ret = to_python(self->ctx, result, TP_PROXY);
+    } else {
+        PyErr_Format(PyExc_TypeError, "both collections must be plain or both multi-value");
+    }
+    dbunlock(self->ctx);
+    return ret;
+}
+
+PyDoc_STRVAR(union_doc,
+"C.union(D) -> collection -- A new collection with the keys of C and D.\n"
+"The value from D is used for keys in both.  In multi-value collections,\n"
+"the values of both are kept.");
+static PyObject *
+PongoCollection_union(PongoCollection *self, PyObject *other)
+{
+    return setop_helper(self, other, dbcollection_union);
+}
+
+PyDoc_STRVAR(intersection_doc,
+"C.intersection(D) -> collection -- A new collection with the keys in both\n"
+"C and D, and the values from C.");
+static PyObject *
+PongoCollection_intersection(PongoCollection *self, PyObject *other)
+{
+    return setop_helper(self, other, dbcollection_intersection);
+}
+
+PyDoc_STRVAR(difference_doc,
+"C.difference(D) -> collection -- A new collection with the items of C\n"
+"whose keys are not in D.");
+static PyObject *
+PongoCollection_difference(PongoCollection *self, PyObject *other)
+{
+    return setop_helper(self, other, dbcollection_difference);
+}
+
 PyDoc_STRVAR(json_doc,
 "C.json([key, value]) -- Return or parse JSON string\n"
 "C.json() -> str -- Return a JSON encoded string representing C.\n"
@@ -479,23 +907,28 @@ PongoCollection_search(PongoCollection *self, PyObject *args)
 }
 
 PyDoc_STRVAR(create_doc,
-"PongoCollection.create([multi]) -- Create a new collection.\n"
-"multi determines whether the new collection is key-value or key-multivalue.");
+"PongoCollection.create([multi, [btree]]) -- Create a new collection.\n"
+"multi determines whether the new collection is key-value or key-multivalue.\n"
+"btree keeps a key-value collection in a B-tree instead of a binary tree.");
 static PyObject *
 PongoCollection_create(PyObject *self, PyObject *args)
 {
     PyObject *ret;
     PongoCollection *ref = NULL;
     dbtype_t coll;
-    int multi = 0;
+    int multi = 0, btree = 0;
 
-    if (!PyArg_ParseTuple(args, "O|i:create", &ref, &multi))
+    if (!PyArg_ParseTuple(args, "O|ii:create", &ref, &multi, &btree))
         return NULL;
     if (pongo_check(ref))
         return NULL;
+    if (multi && btree) {
+        PyErr_Format(PyExc_ValueError, "a B-tree collection can't be key-multivalue");
+        return NULL;
+    }
 
     dblock(ref->ctx);
-    coll = dbcollection_new(ref->ctx, multi);
+    coll = btree ? dbcollection_new_btree(ref->ctx) : dbcollection_new(ref->ctx, multi);
     ret = to_python(ref->ctx, coll, TP_PROXY);
     dbunlock(ref->ctx);
     return ret;
@@ -514,7 +947,9 @@ void PongoCollection_Del(PyObject *ob)
 {
     PongoCollection *self = (PongoCollection*)ob;
     dblock(self->ctx);
-    pidcache_del(self->ctx, self);
+    if (self->snapshot)
+        dbcollection_release(self->ctx, self->dbptr);
+    pidcache_del(self->ctx, self->pin);
     dbunlock(self->ctx);
     PyObject_Del(ob);
 }
@@ -567,9 +1002,17 @@ PongoCollection_setattr(PyObject *ob, PyObject *name, PyObject *value)
     return PyObject_GenericSetAttr(ob, name, value);
 }
 
+static PyObject *
+PongoCollection_subscript(PongoCollection *self, PyObject *key)
+{
+    if (PySlice_Check(key))
+        return PongoCollection_slice(self, key);
+    return PongoCollection_GetItem(self, key);
+}
+
 static PyMappingMethods pydbdict_as_mapping = {
     (lenfunc)PongoCollection_length,           /* mp_length */
-    (binaryfunc)PongoCollection_GetItem,       /* mp_subscript */
+    (binaryfunc)PongoCollection_subscript,     /* mp_subscript */
     (objobjargproc)PongoCollection_SetItem,    /* mp_ass_subscript */
 };
 
@@ -589,12 +1032,24 @@ static PySequenceMethods pydbdict_as_sequence = {
 static PyMethodDef pycoll_methods[] = {
     {"get",     (PyCFunction)PongoCollection_get,          METH_VARARGS|METH_KEYWORDS, get_doc },
     {"set",     (PyCFunction)PongoCollection_set,          METH_VARARGS|METH_KEYWORDS, set_doc },
+    {"update",  (PyCFunction)PongoCollection_update,       METH_VARARGS|METH_KEYWORDS, update_doc },
     {"pop",     (PyCFunction)PongoCollection_pop,          METH_VARARGS|METH_KEYWORDS, pop_doc },
+    {"delete_many", (PyCFunction)PongoCollection_delete_many, METH_VARARGS|METH_KEYWORDS, delete_many_doc },
+    {"cas",     (PyCFunction)PongoCollection_cas,          METH_VARARGS|METH_KEYWORDS, cas_doc },
+    {"incr",    (PyCFunction)PongoCollection_incr,         METH_VARARGS|METH_KEYWORDS, incr_doc },
+    {"version", (PyCFunction)PongoCollection_version,      METH_NOARGS, version_doc },
+    {"wait",    (PyCFunction)PongoCollection_wait,         METH_VARARGS|METH_KEYWORDS, wait_doc },
     {"keys",    (PyCFunction)PongoCollection_keys,         METH_NOARGS, keys_doc },
     {"values",  (PyCFunction)PongoCollection_values,       METH_NOARGS, values_doc },
     {"items",   (PyCFunction)PongoCollection_items,        METH_NOARGS, items_doc },
+    {"at",      (PyCFunction)PongoCollection_at,           METH_VARARGS, at_doc },
+    {"rank",    (PyCFunction)PongoCollection_rank,         METH_O, rank_doc },
+    {"union",   (PyCFunction)PongoCollection_union,        METH_O, union_doc },
+    {"intersection", (PyCFunction)PongoCollection_intersection, METH_O, intersection_doc },
+    {"difference", (PyCFunction)PongoCollection_difference, METH_O, difference_doc },
     {"native",  (PyCFunction)PongoCollection_native,       METH_NOARGS, native_doc },
     {"multi",   (PyCFunction)PongoCollection_multi,        METH_NOARGS, multi_doc },
+    {"btree",   (PyCFunction)PongoCollection_btree,        METH_NOARGS, btree_doc },
     {"create",  (PyCFunction)PongoCollection_create,       METH_STATIC|METH_VARARGS, create_doc },
     {"json",    (PyCFunction)PongoCollection_json,         METH_VARARGS, json_doc },
     {"search",  (PyCFunction)PongoCollection_search,       METH_VARARGS, search_doc },
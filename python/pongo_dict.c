@@ -17,6 +17,7 @@ PongoDict_Proxy(pgctx_t *ctx, dbtype_t db)
 
     self->ctx = ctx;
     self->dbptr = db;
+    self->pin = 0;
     return (PyObject *)self;
 }
 
@@ -281,6 +282,76 @@ PongoDict_pop(PongoDict *self, PyObject *args, PyObject *kwargs)
     return ret;
 }
 
+PyDoc_STRVAR(cas_doc,
+"D.cas(key, expected, value, [sync]) -> bool -- Atomically set D[key] to\n"
+"value if its current value is equal to expected.  Returns True if the value\n"
+"was swapped, False if the current value is different.  Raises KeyError if\n"
+"key does not exist.");
+static PyObject *
+PongoDict_cas(PongoDict *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *key, *expected, *value;
+    PyObject *ret = NULL;
+    dbtype_t k, e, v;
+    int sync = self->ctx->sync;
+    int r;
+    char *kwlist[] = {"key", "expected", "value", "sync", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|i:cas", kwlist,
+                &key, &expected, &value, &sync))
+        return NULL;
+
+    dblock(self->ctx);
+    k = from_python(self->ctx, key);
+    e = from_python(self->ctx, expected);
+    v = from_python(self->ctx, value);
+    if (!PyErr_Occurred()) {
+        r = dbobject_cas(SELF_CTX_AND_DBPTR, k, e, v, sync);
+        if (r == 0) {
+            ret = Py_True;
+        } else if (r == 1) {
+            ret = Py_False;
+        } else {
+            pongo_cas_error(r, "cas", key);
+        }
+    }
+    dbunlock(self->ctx);
+    Py_XINCREF(ret);
+    return ret;
+}
+
+PyDoc_STRVAR(incr_doc,
+"D.incr(key, [delta, [sync]]) -> int -- Atomically add delta (default 1)\n"
+"to the integer D[key] and return the new value.  A missing key counts as 0.");
+static PyObject *
+PongoDict_incr(PongoDict *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *key;
+    PyObject *ret = NULL;
+    dbtype_t k, v;
+    PY_LONG_LONG delta = 1;
+    int sync = self->ctx->sync;
+    int r;
+    char *kwlist[] = {"key", "delta", "sync", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Li:incr", kwlist,
+                &key, &delta, &sync))
+        return NULL;
+
+    dblock(self->ctx);
+    k = from_python(self->ctx, key);
+    if (!PyErr_Occurred()) {
+        r = dbobject_incr(SELF_CTX_AND_DBPTR, k, delta, &v, sync);
+        if (r == 0) {
+            ret = to_python(self->ctx, v, 0);
+        } else {
+            pongo_cas_error(r, "incr", key);
+        }
+    }
+    dbunlock(self->ctx);
+    return ret;
+}
+
 PyDoc_STRVAR(keys_doc,
 "D.keys() -> [key, ...] -- Get the list of keys in the dictionary.");
 static PyObject *
@@ -403,7 +474,11 @@ PongoDict_json(PongoDict *self, PyObject *args)
             obj = json_parse(jctx, key, klen);
             dict.ptr = dbptr(self->ctx, dict);
             obj.ptr = dbptr(self->ctx, obj);
-            dict.ptr->obj = obj.ptr->obj;
+            // Swap the root word like any other update, so the
+            // collector hears about it
+            while(!synchronize(self->ctx, self->ctx->sync,
+                        &dict.ptr->obj, dict.ptr->obj, obj.ptr->obj))
+                ;
         }
         Py_INCREF(ret);
     } else {
@@ -513,7 +588,7 @@ void PongoDict_Del(PyObject *ob)
 {
     PongoDict *self = (PongoDict*)ob;
     dblock(self->ctx);
-    pidcache_del(self->ctx, self);
+    pidcache_del(self->ctx, self->pin);
     dbunlock(self->ctx);
     PyObject_Del(ob);
 }
@@ -541,6 +616,8 @@ static PyMethodDef pydbdict_methods[] = {
     {"get",     (PyCFunction)PongoDict_get,          METH_VARARGS|METH_KEYWORDS, get_doc },
     {"set",     (PyCFunction)PongoDict_set,          METH_VARARGS|METH_KEYWORDS, set_doc },
     {"pop",     (PyCFunction)PongoDict_pop,          METH_VARARGS|METH_KEYWORDS, pop_doc },
+    {"cas",     (PyCFunction)PongoDict_cas,          METH_VARARGS|METH_KEYWORDS, cas_doc },
+    {"incr",    (PyCFunction)PongoDict_incr,         METH_VARARGS|METH_KEYWORDS, incr_doc },
     {"update",  (PyCFunction)PongoDict_update,       METH_VARARGS|METH_KEYWORDS, update_doc },
     {"keys",    (PyCFunction)PongoDict_keys,         METH_NOARGS, keys_doc },
     {"values",  (PyCFunction)PongoDict_values,       METH_NOARGS, values_doc },
@@ -20,7 +20,6 @@ PongoIter_Iter(PyObject *ob)
     dbtype_t internal;
     _list_t *list = NULL;
     _obj_t *obj = NULL;
-    dbnode_t *node = NULL;
     dbtag_t tag;
     int len;
 
@@ -37,14 +36,12 @@ PongoIter_Iter(PyObject *ob)
         internal = internal.ptr->obj;
         obj = dbptr(po->ctx, internal);
         len = obj ? obj->len : 0;
-    } else if (tag == Collection) {
+    } else if (tag == Collection || tag == MultiCollection) {
         internal = internal.ptr->obj;
-        node = dbptr(po->ctx, internal);
-        len = node ? node->size : 0;
-    } else if (tag == MultiCollection) {
+        len = bonsai_size(po->ctx, internal);
+    } else if (tag == BTreeCollection) {
         internal = internal.ptr->obj;
-        node = dbptr(po->ctx, internal);
-        len = node ? node->size : 0;
+        len = btree_size(po->ctx, internal);
     } else {
         goto exitproc;
     }
@@ -58,131 +55,92 @@ PongoIter_Iter(PyObject *ob)
     self->tag = tag;
     self->pos = 0;
     self->len = len;
-    self->depth = -1;
+    self->started = 0;
+    self->reverse = 0;
     self->lhex = 0;
     self->rhex = 0;
     self->lhdata = self->rhdata = DBNULL;
-    pidcache_put(po->ctx, self, self->dbptr);
+    self->lhpin = self->rhpin = 0;
+    self->pin = pidcache_put(po->ctx, self->dbptr);
+    // Keep the nodes of the snapshot from being reclaimed.  The bonsai
+    // cursor pins the snapshot itself.
+    if (tag == Collection || tag == MultiCollection)
+        bonsai_cursor_init(po->ctx, &self->cur, internal);
+    else
+        db_pin(po->ctx);
 
 exitproc:
-    dbunlock(self->ctx);
+    dbunlock(po->ctx);
     return (PyObject *)self;
 }
 
-static PyObject *
-PongoIter_next_item(PyObject *ob)
+// Whether a key satisfies the left or the right hand side of the expression
+static inline int
+iter_lhs(PongoIter *self, dbtype_t key)
 {
-    PongoIter *self = (PongoIter*)ob;
-    dbval_t *internal, *pn;
-    dbtype_t node;
-    PyObject *ret=NULL, *k, *v;
-    _list_t *list;
-    _obj_t *obj;
-
-    dblock(self->ctx);
-    internal = dbptr(self->ctx, self->dbptr);
-    if (!internal) {
-        // The {List,Object,Collection} internal pointer is NULL, so
-        // there is no iteration to do
-        PyErr_SetNone(PyExc_StopIteration);
-    } else if (self->tag == List) {
-        list = (_list_t*)internal;
-        if (self->pos < self->len) {
-            ret = to_python(self->ctx, list->item[self->pos], TP_PROXY);
-            self->pos++;
-        } else {
-            PyErr_SetNone(PyExc_StopIteration);
-        }
-    } else if (self->tag == Object) {
-        obj = (_obj_t*)internal;
-        if (self->pos < self->len) {
-            k = to_python(self->ctx, obj->item[self->pos].key, TP_PROXY);
-            v = to_python(self->ctx, obj->item[self->pos].value, TP_PROXY);
-            ret = PyTuple_Pack(2, k, v);
-            self->pos++;
-        } else {
-            PyErr_SetNone(PyExc_StopIteration);
-        }
-    } else if (self->tag == Collection || self->tag == MultiCollection) {
-        if (self->pos && self->depth == -1) {
-            PyErr_SetNone(PyExc_StopIteration);
-        } else {
-            // NOTE: I'm overloading the lowest bit to mean "already traversed the left
-            // side".  Normally, this bit is part of the 'type' field and would encode
-            // this value as "Int".  However, the BonsaiNode left/right can only point
-            // to other BonsaiNodes and the stack (where the bit overloading is happening)
-            // lives only in main memory, so we'll never write this bit modification
-            // to disk.
-
-            // If were at position 0, put the internal node onto the stack
-            // I'm reusing pos as a flag since pos is otherwise unused by the tree iterator
-            if (self->pos == 0) {
-                self->stack[++self->depth] = self->dbptr;
-                self->pos = 1;
-            }
+    return !self->lhdata.all || dbcmp(self->ctx, key, self->lhdata) >= self->lhex;
+}
 
-            // Get current top of stack.  If we've already traversed the left side
-            // of this node, go directly to the emit stage and traverse the right side.
-            node = self->stack[self->depth];
-            pn = _ptr(self->ctx, node.all & ~1);
-            if (node.all & 1) {
-                node.all &= ~1;
-            } else {
-                // Walk as far left as possible, pushing onto stack as we
-                // follow each link
-                while (pn->left.all) {
-                    node = pn->left;
-                    self->stack[++self->depth] = node;
-                    pn = _ptr(self->ctx, node.all);
-                }
-            }
-            // Now node, pn and top of stack all reference the same object,
-            // so convert the object to python, pop the top of stack and
-            // mark the new top as "left side traversed"
-            ret = to_python(self->ctx, node, TP_NODEKEY|TP_NODEVAL|TP_PROXY);
-            if (--self->depth >= 0) {
-                self->stack[self->depth].all |= 1;
-            }
+static inline int
+iter_rhs(PongoIter *self, dbtype_t key)
+{
+    return !self->rhdata.all || dbcmp(self->ctx, key, self->rhdata) <= self->rhex;
+}
 
-            // Now check if there is a right branch in the tree and push
-            // it for the next call to the iterator
-            if (pn->right.all) {
-                self->stack[++self->depth] = pn->right;
-            }
-        }
+// Place the tree cursors at the end of the expression range they start from
+static void
+iter_start(PongoIter *self)
+{
+    if (self->tag == BTreeCollection) {
+        // The gap after the last key <= rhs is the gap before the first
+        // key > rhs
+        if (!self->reverse)
+            btree_iter_init(self->ctx, &self->bt, self->dbptr, self->lhdata, self->lhex);
+        else if (self->rhdata.all)
+            btree_iter_init(self->ctx, &self->bt, self->dbptr, self->rhdata, !self->rhex);
+        else
+            btree_iter_last(self->ctx, &self->bt, self->dbptr);
+    } else {
+        bonsai_cursor_range(self->ctx, &self->cur,
+                self->lhdata.all ? &self->lhdata : NULL, self->lhex,
+                self->rhdata.all ? &self->rhdata : NULL, -self->rhex);
+        if (self->reverse)
+            bonsai_cursor_last(self->ctx, &self->cur);
     }
-    dbunlock(self->ctx);
-    return ret;
+    self->started = 1;
 }
 
-
 static PyObject *
-PongoIter_next_expr(PyObject *ob)
+PongoIter_next(PyObject *ob)
 {
     PongoIter *self = (PongoIter*)ob;
-    dbval_t *internal, *pn;
+    dbval_t *internal;
     dbtype_t node, key, val;
     PyObject *ret=NULL, *k, *v;
-    int ls, rs;
     _list_t *list;
     _obj_t *obj;
+    int i, r;
 
     dblock(self->ctx);
     internal = dbptr(self->ctx, self->dbptr);
     if (!internal) {
+        // The {List,Object,Collection} internal pointer is NULL, so
+        // there is no iteration to do
         PyErr_SetNone(PyExc_StopIteration);
     } else if (self->tag == List) {
+        // Lists are not sorted, so every item is checked
         list = (_list_t*)internal;
         for(;;) {
             if (self->pos == self->len) {
                 PyErr_SetNone(PyExc_StopIteration);
                 break;
             }
-            node = list->item[self->pos++];
-            if ((!self->lhdata.all || dbcmp(self->ctx, node, self->lhdata) >= self->lhex) &&
-                (!self->rhdata.all || dbcmp(self->ctx, node, self->rhdata) <= self->rhex)) {
-                    ret = to_python(self->ctx, node, TP_PROXY);
-                    break;
+            i = self->reverse ? self->len - 1 - self->pos : self->pos;
+            self->pos++;
+            node = list->item[i];
+            if (iter_lhs(self, node) && iter_rhs(self, node)) {
+                ret = to_python(self->ctx, node, TP_PROXY);
+                break;
             }
         }
     } else if (self->tag == Object) {
@@ -193,135 +151,65 @@ PongoIter_next_expr(PyObject *ob)
                 PyErr_SetNone(PyExc_StopIteration);
                 break;
             }
-            key = obj->item[self->pos].key;
-            val = obj->item[self->pos].value;
+            i = self->reverse ? self->len - 1 - self->pos : self->pos;
             self->pos++;
-            // If the key doesn't satisfy the RHS, and since Objects are
-            // sorted, we can quit with StopIteration
-            if (!(!self->rhdata.all || dbcmp(self->ctx, key, self->rhdata) <= self->rhex)) {
+            key = obj->item[i].key;
+            val = obj->item[i].value;
+            // Objects are sorted, so once a key is past the far side of
+            // the expression, we can quit with StopIteration
+            if (!(self->reverse ? iter_lhs(self, key) : iter_rhs(self, key))) {
                 PyErr_SetNone(PyExc_StopIteration);
                 break;
             }
-            // If the key does satisfy the LHS, return it
-            if (!self->lhdata.all || dbcmp(self->ctx, key, self->lhdata) >= self->lhex) {
+            // If the key satisfies the near side too, return it
+            if (self->reverse ? iter_rhs(self, key) : iter_lhs(self, key)) {
                 k = to_python(self->ctx, key, TP_PROXY);
                 v = to_python(self->ctx, val, TP_PROXY);
                 ret = PyTuple_Pack(2, k, v);
+                Py_DECREF(k); Py_DECREF(v);
                 break;
             }
         }
     } else if (self->tag == Collection || self->tag == MultiCollection) {
-        if (self->pos && self->depth == -1) {
+        if (!self->started)
+            iter_start(self);
+        if (self->reverse)
+            r = bonsai_cursor_prev(self->ctx, &self->cur, &node);
+        else
+            r = bonsai_cursor_next(self->ctx, &self->cur, &node);
+        if (r < 0) {
             PyErr_SetNone(PyExc_StopIteration);
         } else {
-            // NOTE: I'm overloading the lowest bit to mean "already traversed the left
-            // side".  Normally, this bit is part of the 'type' field and would encode
-            // this value as "Int".  However, the BonsaiNode left/right can only point
-            // to other BonsaiNodes and the stack (where the bit overloading is happening)
-            // lives only in main memory, so we'll never write this bit modification
-            // to disk.
-
-            // If were at position 0, put the internal node onto the stack
-            // I'm reusing pos as a flag since pos is otherwise unused by the tree iterator
-            if (self->pos == 0) {
-                node = self->dbptr;
-                for(;;) {
-                    pn = _ptr(self->ctx, node.all);
-                    ls = (!self->lhdata.all || dbcmp(self->ctx, pn->key, self->lhdata) >= self->lhex);
-                    rs = (!self->rhdata.all || dbcmp(self->ctx, pn->key, self->rhdata) <= self->rhex);
-                    if (ls && rs) {
-                        self->stack[++self->depth] = node;
-                        self->pos = 1;
-                        break;
-                    } else if (ls && pn->left.all) {
-                        node = pn->left;
-                    } else if (rs && pn->right.all) {
-                        node = pn->right;
-                    } else {
-                        PyErr_SetNone(PyExc_StopIteration);
-                        goto exitproc;
-                    }
-                }
-            }
-
-            // Get current top of stack.  If we've already traversed the left side
-            // of this node, go directly to the emit stage and traverse the right side.
-            node = self->stack[self->depth];
-            pn = _ptr(self->ctx, node.all & ~1);
-            if (node.all & 1) {
-                node.all &= ~1;
-            } else {
-                // Walk as far left as possible, pushing onto stack as we
-                // follow each link
-                if (pn->left.all) {
-                    node = pn->left;
-                    for(;;) {
-                        pn = _ptr(self->ctx, node.all);
-                        ls = (!self->lhdata.all || dbcmp(self->ctx, pn->key, self->lhdata) >= self->lhex);
-                        rs = (!self->rhdata.all || dbcmp(self->ctx, pn->key, self->rhdata) <= self->rhex);
-                        if (ls && rs) {
-                            self->stack[++self->depth] = node;
-                        }
-                        if (ls && pn->left.all) {
-                            node = pn->left;
-                        } else if (rs && pn->right.all) {
-                            node = pn->right;
-                        } else {
-                            break;
-                        }
-                    }
-                    // Reset node and pn to whatever is on the top of stack now
-                    node = self->stack[self->depth];
-                    pn = _ptr(self->ctx, node.all);
-                }
-            }
-            // Now node, pn and top of stack all reference the same object,
-            // so convert the object to python, pop the top of stack and
-            // mark the new top as "left side traversed"
             ret = to_python(self->ctx, node, TP_NODEKEY|TP_NODEVAL|TP_PROXY);
-            if (--self->depth >= 0) {
-                self->stack[self->depth].all |= 1;
-            }
-
-            // Now check if there is a right branch in the tree and push
-            // it for the next call to the iterator
-            if (pn->right.all) {
-                node = pn->right;
-                for(;;) {
-                    pn = _ptr(self->ctx, node.all);
-                    ls = (!self->lhdata.all || dbcmp(self->ctx, pn->key, self->lhdata) >= self->lhex);
-                    rs = (!self->rhdata.all || dbcmp(self->ctx, pn->key, self->rhdata) <= self->rhex);
-                    if (ls && rs) {
-                        self->stack[++self->depth] = node;
-                    }
-                    if (ls && pn->left.all) {
-                        node = pn->left;
-                    } else if (rs && pn->right.all) {
-                        node = pn->right;
-                    } else {
-                        break;
-                    }
-                }
-            }
+        }
+    } else if (self->tag == BTreeCollection) {
+        // The iterator starts at one end of the expression range, and
+        // since the keys come out sorted, the first key past the other
+        // end stops the iteration.
+        if (!self->started)
+            iter_start(self);
+        if (self->reverse) {
+            r = btree_iter_prev(self->ctx, &self->bt, &key, &val);
+            if (r == 0 && !iter_lhs(self, key)) r = -1;
+        } else {
+            r = btree_iter_next(self->ctx, &self->bt, &key, &val);
+            if (r == 0 && !iter_rhs(self, key)) r = -1;
+        }
+        if (r < 0) {
+            // Stay finished, even though the iterator did move
+            self->bt.depth = -1;
+            PyErr_SetNone(PyExc_StopIteration);
+        } else {
+            k = to_python(self->ctx, key, TP_PROXY);
+            v = to_python(self->ctx, val, TP_PROXY);
+            ret = PyTuple_Pack(2, k, v);
+            Py_DECREF(k); Py_DECREF(v);
         }
     }
-exitproc:
     dbunlock(self->ctx);
     return ret;
 }
 
-static PyObject *
-PongoIter_next(PyObject *ob)
-{
-    PongoIter *self = (PongoIter*)ob;
-    PyObject *ret;
-    if (self->lhdata.all || self->rhdata.all)
-        ret = PongoIter_next_expr(ob);
-    else
-        ret = PongoIter_next_item(ob);
-    return ret;
-}
-
 PyDoc_STRVAR(expr_doc,
 "x.expr(lhs, rhs, lhex, rhex) -- Filter the iterator such that\n"
 "the returned items match the expression lhs <= item <= rhs.\n"
@@ -347,17 +235,30 @@ PongoIter_expr(PyObject *ob, PyObject *args, PyObject *kwargs)
 
     // Convert the lhs and rhs to pongo objects and reference them in the pidcache
     self->lhdata = from_python(self->ctx, lhs);
-    if (self->lhdata.all)
-        pidcache_put(self->ctx, &self->lhdata, self->lhdata);
+    pidcache_del(self->ctx, self->lhpin);
+    self->lhpin = pidcache_put(self->ctx, self->lhdata);
 
     self->rhdata = from_python(self->ctx, rhs);
-    if (self->rhdata.all)
-        pidcache_put(self->ctx, &self->rhdata, self->rhdata);
+    pidcache_del(self->ctx, self->rhpin);
+    self->rhpin = pidcache_put(self->ctx, self->rhdata);
     dbunlock(self->ctx);
     Py_INCREF(self);
     return (PyObject*)self;
 }
 
+PyDoc_STRVAR(reverse_doc,
+"x.reverse() -- Make the iterator run from the last item to the first.\n"
+"Call before the iteration starts.  Combines with expr.");
+static PyObject *
+PongoIter_reverse(PyObject *ob)
+{
+    PongoIter *self = (PongoIter*)ob;
+
+    self->reverse = 1;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
 static PyObject *
 PongoIter_repr(PyObject *ob)
 {
@@ -371,15 +272,20 @@ void PongoIter_Del(PyObject *ob)
 {
     PongoIter *self = (PongoIter*)ob;
     dblock(self->ctx);
-    pidcache_del(self->ctx, self);
-    pidcache_del(self->ctx, &self->lhdata);
-    pidcache_del(self->ctx, &self->rhdata);
+    pidcache_del(self->ctx, self->pin);
+    pidcache_del(self->ctx, self->lhpin);
+    pidcache_del(self->ctx, self->rhpin);
+    if (self->tag == Collection || self->tag == MultiCollection)
+        bonsai_cursor_close(self->ctx, &self->cur);
+    else
+        db_unpin(self->ctx);
     dbunlock(self->ctx);
     PyObject_Del(ob);
 }
 
 static PyMethodDef iter_methods[] = {
     { "expr", (PyCFunction)PongoIter_expr, METH_VARARGS|METH_KEYWORDS, expr_doc },
+    { "reverse", (PyCFunction)PongoIter_reverse, METH_NOARGS, reverse_doc },
     { NULL }
 };
 
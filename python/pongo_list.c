@@ -16,6 +16,7 @@ PongoList_Proxy(pgctx_t *ctx, dbtype_t db)
 
     self->ctx = ctx;
     self->dbptr = db;
+    self->pin = 0;
     return (PyObject *)self;
 }
 
@@ -257,7 +258,7 @@ void PongoList_Del(PyObject *ob)
 {
     PongoList *self = (PongoList*)ob;
     dblock(self->ctx);
-    pidcache_del(self->ctx, self);
+    pidcache_del(self->ctx, self->pin);
     dbunlock(self->ctx);
     PyObject_Del(ob);
 }
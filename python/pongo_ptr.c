@@ -22,6 +22,7 @@ PongoPointer_Proxy(pgctx_t *ctx, dbtype_t db)
 
     self->ctx = ctx;
     self->dbptr = db;
+    self->pin = 0;
     return (PyObject *)self;
 }
 
@@ -38,7 +39,7 @@ void PongoPointer_Del(PyObject *ob)
 {
     PongoPointer *self = (PongoPointer*)ob;
     dblock(self->ctx);
-    pidcache_del(self->ctx, self);
+    pidcache_del(self->ctx, self->pin);
     dbunlock(self->ctx);
     PyObject_Del(ob);
 }
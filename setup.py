@@ -22,7 +22,7 @@ if sys.platform == 'win32':
 else:
     native = Extension("_pongo",
             sources=sources,
-            extra_objects = ['lib/libpongo.a', 'yajl/libyajl.a', '-luuid', '-lrt'],
+            extra_objects = ['lib/libpongo.a', 'yajl/libyajl.a', '-luuid', '-lrt', '-lpthread'],
             include_dirs = ['include'],
             extra_compile_args=['-fms-extensions', '-g3', '-DWANT_UUID_TYPE']+coverage,
 #            extra_link_args=['--coverage'],
@@ -16,10 +16,31 @@
 	printf("%16s: size = %d bytes\n", #t, (int)sizeof(t)); \
 	} while(0)
 
+// The root fills the first page of the file, and databases made by older
+// versions must still find their fields where they left them.
+#define at(t, n, ofs) do {					\
+	int x = offsetof(t, n);					\
+	printf("%16s: %6s %4d %4d", #t, #n, x, ofs);		\
+	if (x != ofs) { printf(" error"); error = 1; }		\
+	printf("\n"); \
+	} while(0)
+
+_Static_assert(sizeof(dbreader_t) == 32, "dbreader_t must be 32 bytes");
+_Static_assert(sizeof(dbroot_t) == 4096, "dbroot_t must fill the root page");
+_Static_assert(offsetof(dbroot_t, gcgen) == 2224, "dbroot_t.gcgen moved");
+_Static_assert(offsetof(dbroot_t, meta) == 3072, "dbroot_t.meta moved");
+
 int
 main()
 {
 	int error = 0;
+
+	size(dbroot_t);
+	at(dbroot_t, readers, 160);
+	at(dbroot_t, gchist, 2208);
+	at(dbroot_t, gcgen, 2224);
+	at(dbroot_t, gcpressure, 2248);
+	at(dbroot_t, meta, 3072);
 	/*
 	size(dbboolean_t);
 	check(dbboolean_t, type);
@@ -82,5 +103,10 @@ main()
 	check(dbnode_t, value);
 	check(dbnode_t, size);
 
+	size(dbbtree_t);
+	check(dbbtree_t, type);
+	check(dbbtree_t, _pad);
+	check(dbbtree_t, size);
+
 	return error;
 }
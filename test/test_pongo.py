@@ -1,6 +1,6 @@
 import unittest
 import uuid
-from datetime import datetime
+from datetime import datetime, timedelta
 import _pongo as pongo
 import json
 import os
@@ -406,6 +406,463 @@ class TestPongo(unittest.TestCase):
         self.assertEqual(d['b'].native(), b)
 
 
+    def test_cas(self):
+        c = pongo.PongoCollection.create(self.db)
+        c['a'] = 1
+        c['s'] = 'a longer string value'
+        self.assertTrue(c.cas('a', 1, 2))
+        self.assertEqual(c['a'], 2)
+        self.assertFalse(c.cas('a', 1, 3))
+        self.assertEqual(c['a'], 2)
+        self.assertTrue(c.cas('s', 'a longer string value', 'x'))
+        self.assertEqual(c['s'], 'x')
+        self.assertRaises(KeyError, c.cas, 'b', 1, 2)
+
+        d = self.db['primitive']
+        self.assertTrue(d.cas('int-1', 1, 5))
+        self.assertEqual(d['int-1'], 5)
+        self.assertFalse(d.cas('int-1', 1, 6))
+        self.assertRaises(KeyError, d.cas, 'blurf', 1, 2)
+
+    def test_incr(self):
+        c = pongo.PongoCollection.create(self.db)
+        self.assertEqual(c.incr('n'), 1)
+        self.assertEqual(c.incr('n', 5), 6)
+        self.assertEqual(c.incr('n', delta=-10), -4)
+        self.assertEqual(c['n'], -4)
+        self.assertRaises(OverflowError, c.incr, 'n', -2**63)
+        self.assertEqual(c['n'], -4)
+        c['s'] = 'foo'
+        self.assertRaises(TypeError, c.incr, 's')
+
+        d = self.db['primitive']
+        self.assertEqual(d.incr('int-1'), 2)
+        self.assertEqual(d.incr('new', 3), 3)
+        self.assertRaises(TypeError, d.incr, 'str')
+
+        m = pongo.PongoCollection.create(self.db, 1)
+        m['n'] = 1
+        self.assertRaises(TypeError, m.incr, 'n')
+        self.assertRaises(TypeError, m.cas, 'n', 1, 2)
+
+    def test_batch(self):
+        c = pongo.PongoCollection.create(self.db)
+        c.update(dict(('k%03d' % i, i) for i in range(100)))
+        self.assertEqual(len(c), 100)
+        self.assertEqual(c['k042'], 42)
+        c.update([('k001', 'one'), ('zzz', 1), ('k001', 'uno')])
+        self.assertEqual(len(c), 101)
+        self.assertEqual(c['k001'], 'uno')
+        self.assertEqual(c.keys(), sorted(c.keys()))
+        self.assertEqual(c.delete_many(['k%03d' % i for i in range(0, 100, 2)] + ['nope']), 50)
+        self.assertEqual(len(c), 51)
+        self.assertFalse('k002' in c)
+        self.assertEqual(c['k003'], 3)
+        self.assertRaises(TypeError, c.update, [1])
+        self.assertRaises(TypeError, c.update, [(1,)])
+        self.assertRaises(TypeError, c.update, [(1, 2, 3)])
+        self.assertEqual(len(c), 51)
+
+        m = pongo.PongoCollection.create(self.db, 1)
+        m.update([('a', 1), ('a', 2), ('b', 3)])
+        self.assertEqual(m['a'], (1, 2))
+
+    def test_transaction(self):
+        users = pongo.PongoCollection.create(self.db)
+        names = pongo.PongoCollection.create(self.db)
+        users['u1'] = dict(name='alice')
+        names['alice'] = 'u1'
+        r = pongo.transaction(self.db, [
+            ('get', users, 'u1'),
+            ('set', users, 'u2', dict(name='bob')),
+            ('add', names, 'bob', 'u2'),
+            ('del', names, 'alice'),
+            ('set', names, 'alicia', 'u1'),
+        ])
+        self.assertEqual(r[0]['name'], 'alice')
+        self.assertEqual(r[1:], [None, None, None, None])
+        self.assertEqual(users['u2']['name'], 'bob')
+        self.assertEqual(sorted(names.keys()), ['alicia', 'bob'])
+
+        # A failing op aborts the whole transaction
+        self.assertRaises(KeyError, pongo.transaction, self.db, [
+            ('set', users, 'u3', dict(name='carol')),
+            ('add', names, 'bob', 'u3'),
+        ])
+        self.assertFalse('u3' in users)
+        self.assertRaises(KeyError, pongo.transaction, self.db, [('del', users, 'zzz')])
+        self.assertRaises(ValueError, pongo.transaction, self.db, [('frob', users, 'u1')])
+        self.assertRaises(TypeError, pongo.transaction, self.db, [('get', dict(), 'u1')])
+        self.db['txnmulti'] = pongo.PongoCollection.create(self.db, 1)
+        self.assertRaisesRegexp(TypeError, 'op 1 requires a key-value collection',
+            pongo.transaction, self.db, [('get', users, 'u1'), ('get', self.db['txnmulti'], 'u1')])
+        del self.db['txnmulti']
+        self.assertEqual(len(users), 2)
+
+    def test_wait(self):
+        c = pongo.PongoCollection.create(self.db)
+        v = c.version()
+        self.assertEqual(c.wait(v, 0.01), v)
+        c['a'] = 1
+        self.assertNotEqual(c.version(), v)
+        self.assertEqual(c.wait(v, 0.01), c.version())
+
+        self.db['waitq'] = c
+        v = c.version()
+        pid = os.fork()
+        if pid == 0:
+            db = pongo.open('test.db')
+            db['waitq']['b'] = 2
+            os._exit(0)
+        nv = c.wait(v, 10.0)
+        os.waitpid(pid, 0)
+        self.assertNotEqual(nv, v)
+        self.assertEqual(c['b'], 2)
+
+    def test_gc_parallel(self):
+        c = pongo.PongoCollection.create(self.db)
+        for i in range(2000):
+            c[i] = {'n': -i}
+        for i in range(2000):
+            c[i] = {'n': i, 'l': [i, str(i)*3]}
+        pongo.gc(self.db, 1, 1, 4)
+        for i in range(2000):
+            self.assertEqual(c[i]['n'], i)
+            self.assertEqual(c[i]['l'][1], str(i)*3)
+
+    def test_reclaim(self):
+        c = pongo.PongoCollection.create(self.db)
+        for i in range(100):
+            c[i] = i
+        it = iter(c)
+        first = it.next()
+        for i in range(5000):
+            c[i % 100] = -i
+        items = [first] + list(it)
+        self.assertEqual(items, [(i, i) for i in range(100)])
+        self.assertEqual(c[99], -4999)
+
+    def test_gcstats(self):
+        c = pongo.PongoCollection.create(self.db)
+        for i in range(500):
+            c[i] = {'n': i}
+        for i in range(500):
+            c[i] = i
+        ret = pongo.gc(self.db, 1)
+        st = pongo.gcstats(self.db)[-1]
+        self.assertTrue(st['full'])
+        self.assertEqual(ret, st['before'] + st['after'])
+        self.assertTrue(st['freed'][0] >= 500)
+        self.assertEqual(st['freed'][0], sum(f[0] for b, a, f in st['classes']))
+        self.assertTrue(st['total'] >= st['sweep'])
+        pongo.gc(self.db)
+        self.assertFalse(pongo.gcstats(self.db, 0)[-1]['full'])
+
+    def test_pin(self):
+        self.db['pinned'] = [{'n': i} for i in range(300)]
+        items = list(self.db['pinned'])
+        del self.db['pinned']
+        pongo.gc(self.db, 1)
+        self.assertEqual(list(d['n'] for d in items), range(300))
+        self.assertEqual(len(pongo.pidcache(self.db)[os.getpid()]), 300)
+        del items
+        self.assertEqual(pongo.pidcache(self.db)[os.getpid()], [])
+
+    def test_gc_inline(self):
+        pongo.gc(self.db, 1)
+        last = pongo.gcstats(self.db)[-1]['start']
+        pongo.meta(self.db, '.gc_inline', 1)
+        c = pongo.PongoCollection.create(self.db)
+        # Appends in key order, enough of them to pass GC_FULL_MIN
+        for i in range(10000):
+            c[i] = {'n': i, 's': 'x' * 100}
+        pongo.meta(self.db, '.gc_inline', 0)
+        st = pongo.gcstats(self.db)[-1]
+        self.assertTrue(st['start'] > last)
+        self.assertEqual(st['pid'], os.getpid())
+        self.assertEqual(c[4999]['n'], 4999)
+
+    def test_dead_pidcache(self):
+        self.db['orphan'] = [{'n': i} for i in range(10)]
+        pid = os.fork()
+        if pid == 0:
+            items = list(self.db['orphan'])
+            os._exit(0)
+        os.waitpid(pid, 0)
+        self.assertTrue(len(pongo.pidcache(self.db)[pid]) >= 10)
+        pongo.gc(self.db, 1)
+        self.assertFalse(pid in pongo.pidcache(self.db))
+        del self.db['orphan']
+
+    def test_generations(self):
+        c = pongo.PongoCollection.create(self.db)
+        self.db['gen'] = c
+        for i in range(2000):
+            c[i] = {'n': [i]}
+        pongo.gc(self.db, 2)
+        st = pongo.gcstats(self.db)[-1]
+        self.assertTrue(st['major'])
+        for i in range(10):
+            c[i] = {'n': [-i]}
+        pongo.gc(self.db, 1)
+        minor = pongo.gcstats(self.db)[-1]
+        self.assertFalse(minor['major'])
+        self.assertTrue(minor['scanned'] * 10 < st['scanned'])
+        self.assertEqual([c[i]['n'][0] for i in range(12)],
+                         [-i for i in range(10)] + [10, 11])
+        del self.db['gen']
+
+    def test_btree(self):
+        c = pongo.PongoCollection.create(self.db, 0, 1)
+        self.assertTrue(c.btree())
+        self.assertRaises(ValueError, pongo.PongoCollection.create, self.db, 1, 1)
+        self.db['bt'] = c
+        ref = {}
+        for i in range(2000):
+            k = (i * 7919) % 1000
+            if i % 3 == 2 and k in ref:
+                del c[k]
+                del ref[k]
+            else:
+                c[k] = i
+                ref[k] = i
+        self.assertEqual(len(c), len(ref))
+        self.assertEqual(c.items(), sorted(ref.items()))
+        self.assertEqual(list(c), sorted(ref.items()))
+        self.assertEqual(list(iter(c).expr(100, 200, 1)),
+                         [(k, ref[k]) for k in sorted(ref) if 100 < k <= 200])
+        self.assertRaises(KeyError, c.__delitem__, 5000)
+        c.update(dict(('k%03d' % i, i) for i in range(100)))
+        self.assertEqual(c.delete_many(['k%03d' % i for i in range(0, 100, 2)]), 50)
+        self.assertEqual(c['k003'], 3)
+        self.assertEqual(c.incr('n', 2), 2)
+        self.assertTrue(c.cas('n', 2, 3))
+        c['d'] = {'x': [1, 2]}
+        self.assertEqual(c['d']['x'][1], 2)
+        self.assertEqual(json.loads(c.json())['k001'], 1)
+        pongo.gc(self.db, 2)
+        self.assertEqual(c.get('k099'), 99)
+        for k in c.keys():
+            del c[k]
+        self.assertEqual(len(c), 0)
+        del self.db['bt']
+
+    def test_bulk_update(self):
+        c = pongo.PongoCollection.create(self.db)
+        self.db['bulk'] = c
+        ref = dict((i * 3, i) for i in range(1000))
+        c.update(ref)
+        self.assertEqual(c.items(), sorted(ref.items()))
+        more = dict((i * 2, -i) for i in range(1500))
+        c.update(more)
+        ref.update(more)
+        self.assertEqual(c.items(), sorted(ref.items()))
+        c.update({1: 1, 7: 7})
+        ref.update({1: 1, 7: 7})
+        few = dict((k, 'x') for k in range(1000, 1300))
+        c.update(few)
+        ref.update(few)
+        self.assertEqual(c.items(), sorted(ref.items()))
+        for k in range(0, 3000, 5):
+            c.pop(k, None)
+            ref.pop(k, None)
+        self.assertEqual(len(c), len(ref))
+        self.assertEqual(c.items(), sorted(ref.items()))
+        pongo.gc(self.db, 2)
+        self.assertEqual(c[7], 7)
+        del self.db['bulk']
+
+    def test_positional(self):
+        for bt in (0, 1):
+            c = pongo.PongoCollection.create(self.db, 0, bt)
+            self.db['pos'] = c
+            ref = sorted((i * 2, str(i)) for i in range(500))
+            c.update(dict(ref))
+            self.assertEqual(c.at(0), ref[0])
+            self.assertEqual(c.at(123), ref[123])
+            self.assertEqual(c.at(-1), ref[-1])
+            self.assertRaises(IndexError, c.at, 500)
+            self.assertEqual(c.rank(246), 123)
+            self.assertEqual(c.rank(247), 124)
+            self.assertEqual(c.rank(-1), 0)
+            self.assertEqual(c.rank(5000), 500)
+            self.assertEqual(c[100:110], ref[100:110])
+            self.assertEqual(c[-3:], ref[-3:])
+            self.assertEqual(c[490:600], ref[490:])
+            self.assertEqual(c[10:5], [])
+            self.assertEqual([c.at(i) for i in range(len(c))], ref)
+            del self.db['pos']
+
+    def test_iter_range(self):
+        ref = [(i * 3, i) for i in range(300)]
+        for bt in (0, 1):
+            c = pongo.PongoCollection.create(self.db, 0, bt)
+            self.db['range'] = c
+            c.update(dict(ref))
+            self.assertEqual(list(iter(c)), ref)
+            self.assertEqual(list(iter(c).reverse()), ref[::-1])
+            self.assertEqual(list(iter(c).expr(30, 60)), ref[10:21])
+            self.assertEqual(list(iter(c).expr(30, 60, 1, 1)), ref[11:20])
+            self.assertEqual(list(iter(c).expr(31, 59).reverse()), ref[11:20][::-1])
+            self.assertEqual(list(iter(c).expr(None, 5).reverse()), ref[1::-1])
+            self.assertEqual(list(iter(c).expr(890, None)), ref[-3:])
+            self.assertEqual(list(iter(c).expr(100, 50)), [])
+            del self.db['range']
+        self.db['range'] = dict(ref)
+        self.assertEqual(list(iter(self.db['range']).expr(30, 60, 1).reverse()), ref[11:21][::-1])
+        self.assertEqual(list(iter(self.db['list']).reverse()), [6, 5, 4, 3, 2, 1])
+        del self.db['range']
+
+    def test_set_ops(self):
+        a = pongo.PongoCollection.create(self.db, 0)
+        b = pongo.PongoCollection.create(self.db, 0)
+        self.db['a'] = a
+        self.db['b'] = b
+        da = dict((i, 'a') for i in range(0, 300, 2))
+        db = dict((i, 'b') for i in range(0, 300, 3))
+        a.update(da)
+        b.update(db)
+        u = a.union(b)
+        i = a.intersection(b)
+        d = a.difference(b)
+        ref = dict(da)
+        ref.update(db)
+        self.assertEqual(u.items(), sorted(ref.items()))
+        self.assertEqual(i.items(), sorted((k, 'a') for k in da if k in db))
+        self.assertEqual(d.items(), sorted((k, 'a') for k in da if k not in db))
+        self.assertEqual(a.items(), sorted(da.items()))
+        self.assertEqual(b.items(), sorted(db.items()))
+        # The results share no nodes with their inputs
+        self.db['u'] = u
+        for k in range(0, 300, 6):
+            del a[k]
+            del b[k]
+        pongo.gc(self.db, 2)
+        self.assertEqual(self.db['u'].items(), sorted(ref.items()))
+        m = pongo.PongoCollection.create(self.db, 1)
+        self.db['m'] = m
+        m[1] = 'x'
+        m[1] = 'y'
+        m[2] = 'x'
+        n = pongo.PongoCollection.create(self.db, 1)
+        self.db['n'] = n
+        n[1] = 'z'
+        n[3] = 'z'
+        self.assertEqual(m.union(n).items(),
+                [(1, ('x', 'y', 'z')), (2, ('x',)), (3, ('z',))])
+        self.assertEqual(m.intersection(n).items(), [(1, ('x', 'y'))])
+        self.assertRaises(TypeError, m.union, u)
+        for k in ('a', 'b', 'u', 'm', 'n'):
+            del self.db[k]
+
+    def test_string_keys(self):
+        # Keys around the length of the prefix kept in the tree nodes
+        c = pongo.PongoCollection.create(self.db, 0)
+        self.db['strkeys'] = c
+        keys = []
+        for base in ('', 'abc', 'abcdefghij', 'abcdefghijk', 'abcdefghijkl'):
+            for tail in ('', 'a', 'b', 'ab', 'ba', 'zzzz'):
+                keys.append(base + tail)
+        for k in reversed(keys):
+            c[k] = k
+        self.assertEqual(c.keys(), sorted(set(keys)))
+        for k in keys:
+            self.assertEqual(c[k], k)
+        self.assertFalse('abcdefghijklm' in c)
+        self.assertEqual(c.rank('abcdefghijkl'), sorted(set(keys)).index('abcdefghijkl'))
+        for k in keys[::2]:
+            if k in c:
+                del c[k]
+        self.assertEqual(c.keys(), sorted(set(keys) - set(keys[::2])))
+        del self.db['strkeys']
+
+    def test_snapshot(self):
+        c = pongo.PongoCollection.create(self.db, 0)
+        self.db['snap'] = c
+        c.update(dict((i, 'v%d' % i) for i in range(200)))
+        s = pongo.snapshot(c)
+        c[5] = 'new'
+        del c[6]
+        c[500] = 'added'
+        self.assertEqual(s[5], 'v5')
+        self.assertEqual(s[6], 'v6')
+        self.assertFalse(500 in s)
+        self.assertEqual(len(s), 200)
+        self.assertEqual(c[5], 'new')
+        self.assertRaises(TypeError, s.__setitem__, 1, 2)
+        self.assertRaises(TypeError, s.pop, 1)
+        self.assertRaisesRegexp(TypeError, 'op 0 writes to a snapshot',
+            pongo.transaction, self.db, [('set', s, 1, 2)])
+        # The snapshot keeps the old tree and its values alive
+        for i in range(200):
+            c[i] = i
+        pongo.gc(self.db, 2)
+        self.assertEqual(s.items(), sorted((i, 'v%d' % i) for i in range(200)))
+        root = pongo.snapshot(self.db)
+        del self.db['snap']
+        self.assertEqual(len(root['snap']), 201)
+        pongo.release(root)
+        pongo.release(s)
+        self.assertEqual(len(s), 0)
+        self.assertRaises(TypeError, pongo.release, c)
+
+    def test_snapshot_nested(self):
+        # Only the top tree is frozen; containers inside it are the live ones
+        c = pongo.PongoCollection.create(self.db, 0)
+        self.db['snapnest'] = c
+        c['sub'] = {'x': 1}
+        s = pongo.snapshot(c)
+        c['sub']['x'] = 2
+        self.assertEqual(s['sub']['x'], 2)
+        root = pongo.snapshot(self.db)
+        c['y'] = 3
+        self.assertEqual(root['snapnest']['y'], 3)
+        pongo.release(root)
+        pongo.release(s)
+        del self.db['snapnest']
+
+    def test_replace_value(self):
+        c = pongo.PongoCollection.create(self.db, 0)
+        self.db['replace'] = c
+        for i in range(100):
+            c['k%02d' % i] = i
+        for i in range(100):
+            c['k%02d' % i] = -i
+        self.assertEqual(c.items(), [('k%02d' % i, -i) for i in range(100)])
+        v = c.version()
+        c['k10'] = -10
+        self.assertEqual(c.version(), v)
+        c['k10'] = 10
+        self.assertEqual(c.version(), v + 1)
+        # set with fail must fail for any existing key, not only the root
+        for i in range(100):
+            self.assertRaises(KeyError, c.set, 'k%02d' % i, 0, fail=True)
+        del self.db['replace']
+
+    def test_append(self):
+        c = pongo.PongoCollection.create(self.db, 0)
+        self.db['append'] = c
+        t0 = datetime(2020, 1, 1)
+        keys = [t0 + timedelta(minutes=i) for i in range(300)]
+        for i, k in enumerate(keys):
+            c[k] = i
+        # Deletes and inserts below the end mix with the appends
+        for i in range(0, 300, 7):
+            del c[keys[i]]
+        for i in range(300, 400):
+            c[t0 + timedelta(minutes=i)] = i
+            c[keys[i % 300]] = -i
+        keys = [k for i, k in enumerate(keys) if i < 100 or i % 7]
+        keys.extend(t0 + timedelta(minutes=i) for i in range(300, 400))
+        self.assertEqual(c.keys(), keys)
+        self.assertEqual(c[keys[-1]], 399)
+        # Generated ids sort in the order they were made
+        ids = [c.set(pongo.id, {'n': i}) for i in range(100)]
+        self.assertEqual(ids, sorted(ids, key=lambda u: u.bytes))
+        self.assertTrue(all(u.version == 7 for u in ids))
+        self.assertEqual([v['n'] for v in c.values()[-100:]], range(100))
+        del self.db['append']
+
     def test_membership(self):
         self.assertTrue('primitive' in self.db)
         self.assertFalse('blurf' in self.db)